@@ -0,0 +1,199 @@
+/*********************************************************************
+wgnet WireGuard network utility
+
+Copyright (C) 2020 - Andrew Gaylo - drew@clisystems.com
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*******************************************************************/
+
+/*********************************************************************
+ *
+ * Overview:
+ *
+ * This file caches compiled rulesets under CACHE_PATH, one file per
+ * interface, <iface>.rules.  Each file starts with a key, a hash of
+ * everything the ruleset is generated from:
+ *
+ *  - the config file and the saved rule order file, byte for byte
+ *  - the interface's address, the subnet drop rule is built from it
+ *  - the backend and --sets, which change what gets compiled
+ *  - the program version, so an upgrade never reads an old format
+ *
+ * A key that doesn't match, or a file that doesn't read back, is a miss
+ * and the ruleset is generated as usual.  CACHE_PATH is on a tmpfs, so
+ * the cache never outlives the interfaces it was made for.
+ *
+ ********************************************************************/
+
+#include "defs.h"
+#include "cache.h"
+#include "link.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Definitions
+// ----------------------------------------------------------------------------
+#define CACHE_KEY_TAG       "key"
+
+// FNV-1a, same as the rule IDs
+#define FNV_OFFSET          0xcbf29ce484222325ULL
+#define FNV_PRIME           0x100000001b3ULL
+
+// Variables
+// ----------------------------------------------------------------------------
+static bool b_dryrun = false;
+
+// Local functions
+// ----------------------------------------------------------------------------
+static void _cache_file(ruleset_t * rs, char * out, int max_len);
+static uint64_t _hash_bytes(uint64_t hash, void * data, size_t len);
+static uint64_t _hash_file(uint64_t hash, char * path);
+static uint64_t _cache_key(ruleset_t * rs, char * config_file, char * order_file);
+
+// Public functions
+// ----------------------------------------------------------------------------
+void cache_enable_dryrun()
+{
+    b_dryrun = true;
+}
+
+bool cache_load(ruleset_t * rs, char * config_file, char * order_file)
+{
+    char path[250];
+    unsigned long long key;
+    FILE * fp;
+    bool ret;
+
+    _cache_file(rs,path,sizeof(path));
+    fp = fopen(path,"r");
+    if(!fp){
+        if(g_verbose) printf("Cache: no compiled ruleset for '%s'\n",rs->iface);
+        return false;
+    }
+
+    ret = false;
+    if(fscanf(fp,CACHE_KEY_TAG " %llx",&key)!=1 ||
+       key!=_cache_key(rs,config_file,order_file))
+    {
+        if(g_verbose) printf("Cache: '%s' is stale\n",path);
+    }else if(!ruleset_read(rs,fp)){
+        printf("Cache: '%s' is damaged, ignoring it\n",path);
+    }else{
+        if(g_verbose) printf("Cache: loaded %d rules from '%s'\n",rs->num_rules,path);
+        ret = true;
+    }
+    fclose(fp);
+    return ret;
+}
+
+void cache_store(ruleset_t * rs, char * config_file, char * order_file)
+{
+    char path[250];
+    char tmp[260];
+    uint64_t key;
+    FILE * fp;
+
+    _cache_file(rs,path,sizeof(path));
+    if(b_dryrun){
+        if(g_verbose) printf("Cache: would save '%s'\n",path);
+        return;
+    }
+
+    if(mkdir(CACHE_PATH,0700)!=0 && access(CACHE_PATH,W_OK)!=0){
+        if(g_verbose) printf("Cache: can't create '%s'\n",CACHE_PATH);
+        return;
+    }
+
+    // Written aside and renamed in, a reader never sees half a file
+    key = _cache_key(rs,config_file,order_file);
+    snprintf(tmp,sizeof(tmp),"%s.tmp",path);
+    fp = fopen(tmp,"w");
+    if(!fp){
+        if(g_verbose) printf("Cache: can't write '%s'\n",tmp);
+        return;
+    }
+    fprintf(fp,CACHE_KEY_TAG " %016llx\n",(unsigned long long)key);
+    if(!ruleset_write(rs,fp)){
+        fclose(fp);
+        unlink(tmp);
+        return;
+    }
+    if(fclose(fp)!=0 || rename(tmp,path)!=0){
+        unlink(tmp);
+        return;
+    }
+    if(g_verbose) printf("Cache: saved %d rules to '%s'\n",rs->num_rules,path);
+    return;
+}
+
+// Private functions
+// ----------------------------------------------------------------------------
+static void _cache_file(ruleset_t * rs, char * out, int max_len)
+{
+    snprintf(out,max_len,"%s/%s.rules",CACHE_PATH,rs->iface);
+    return;
+}
+
+static uint64_t _hash_bytes(uint64_t hash, void * data, size_t len)
+{
+    unsigned char * p = data;
+    size_t x;
+
+    for(x=0;x<len;x++)
+    {
+        hash ^= p[x];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+// A missing file hashes differently from an empty one
+static uint64_t _hash_file(uint64_t hash, char * path)
+{
+    unsigned char buf[4096];
+    size_t len;
+    FILE * fp;
+
+    fp = path ? fopen(path,"r") : NULL;
+    hash = _hash_bytes(hash,(fp?"+":"-"),1);
+    if(!fp) return hash;
+    while((len=fread(buf,1,sizeof(buf),fp))>0)
+        hash = _hash_bytes(hash,buf,len);
+    fclose(fp);
+    return hash;
+}
+
+static uint64_t _cache_key(ruleset_t * rs, char * config_file, char * order_file)
+{
+    uint64_t hash = FNV_OFFSET;
+    uint32_t addr;
+    uint8_t flags[2];
+
+    hash = _hash_bytes(hash,PROG_VERSION,sizeof(PROG_VERSION));
+    hash = _hash_file(hash,config_file);
+    hash = _hash_file(hash,order_file);
+    addr = get_ip_of_interface(rs->iface);
+    hash = _hash_bytes(hash,&addr,sizeof(addr));
+    flags[0] = ruleset_get_backend();
+    flags[1] = ruleset_sets_enabled();
+    hash = _hash_bytes(hash,flags,sizeof(flags));
+    return hash;
+}
+
+// EOF
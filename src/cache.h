@@ -0,0 +1,35 @@
+/*********************************************************************
+wgnet WireGuard network utility
+
+Copyright (C) 2020 - Andrew Gaylo - drew@clisystems.com
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*******************************************************************/
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "ruleset.h"
+
+void cache_enable_dryrun();
+
+// Load the compiled ruleset saved for this config, order file and the
+// interface's address, instead of generating it.  False on a miss
+bool cache_load(ruleset_t * rs, char * config_file, char * order_file);
+
+// Save the compiled ruleset for the next cache_load()
+void cache_store(ruleset_t * rs, char * config_file, char * order_file);
+
+#endif
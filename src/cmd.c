@@ -33,6 +33,11 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "defs.h"
 #include "cmd.h"
 #include "conf.h"
+#include "ruleset.h"
+#include "cache.h"
+#include "wgconf.h"
+#include "status.h"
+#include "output.h"
 #include "defs_colors.h"
 
 #include <string.h>
@@ -40,6 +45,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <ctype.h>
+#include <net/if.h>
 
 // For handling ip and netmasks
 #include <sys/socket.h>
@@ -75,29 +82,41 @@ enum error_codes{
 static void _cmd_config_error(char * conf);
 
 static int _bringup_interface(char * iface);
-static int _bringup_routing();
+static bool _native_config(char * iface, wgconf_t * wc);
+static int _bringup_native(char * iface, wgconf_t * wc);
+static int _sync_native(char * iface, wgconf_t * wc);
 static int _bringup_nat();
-static int _bringup_firewall();
-static int _bringup_lockdown_forwarding(char * iface);
+
+static int _build_rules(ruleset_t * rs, char * iface);
+static int _build_routing(ruleset_t * rs);
+static int _build_firewall(ruleset_t * rs);
+static int _build_lockdown_forwarding(ruleset_t * rs, char * iface);
 
 static int _teardown_interface(char * iface);
-static int _teardown_routing();
 static int _teardown_nat();
-static int _teardown_firewall();
-static int _teardown_lockdown_forwarding(char * iface);
+static int _teardown_rules(char * iface);
 
 static int _run_command(char * command);
 static int _test_command(char * command);
 static bool _is_interface_running(char * iface);
 static bool _interface_config_exists(char * iface);
+static bool _interface_settings_changed(char * iface);
+static void _order_file(char * config, char * out, int max_len);
+static void _load_order(ruleset_t * rs, char * config);
+static int _load_rules(ruleset_t * rs, char * config, char * iface);
 static uint16_t _uint16_swap(uint16_t in);
+static int _status_peer(const wg_device * dev, const wg_peer * peer, void * data);
+static void _status_table(wg_peer_table * table);
 
 // Public functions
 // ----------------------------------------------------------------------------
 static bool b_dryrun = false;
+static bool b_hints = false;
+static bool b_native = false;
 
 void cmd_init()
 {
+    output_init();
     return;
 }
 
@@ -105,6 +124,53 @@ void cmd_enable_dryrun()
 {
     if(g_verbose) printf("dry run mode = true\n");
     b_dryrun = true;
+    ruleset_enable_dryrun();
+    cache_enable_dryrun();
+    link_enable_dryrun();
+}
+
+bool cmd_set_format(char * name)
+{
+    if(!output_set_format(name)){
+        ERROR("Unknown output format '%s'\n",name);
+        return false;
+    }
+    return true;
+}
+
+bool cmd_set_recv(char * spec)
+{
+    if(!status_set_recv(spec)){
+        ERROR("Bad receive tuning '%s'\n",spec);
+        return false;
+    }
+    return true;
+}
+
+bool cmd_set_backend(char * name)
+{
+    if(!ruleset_set_backend(name)){
+        ERROR("Unknown firewall backend '%s'\n",name);
+        return false;
+    }
+    return true;
+}
+
+void cmd_enable_sets()
+{
+    ruleset_enable_sets();
+}
+
+void cmd_enable_hints()
+{
+    if(g_verbose) printf("Save rule order = true\n");
+    b_hints = true;
+}
+
+void cmd_enable_native()
+{
+    if(g_verbose) printf("Native interface setup = true\n");
+    b_native = true;
 }
 
 void cmd_show(char * config)
@@ -128,16 +194,24 @@ void cmd_list()
     DIR * dir;
     struct dirent *ent;
     char * path;
-    char * devs;
-    char * name;
-    int len;
+    wg_link * links;
+    size_t num_links,x;
+    status_entry_t * entries;
+    char ** names;
+    struct timespec start;
     int dev_num=0;
+    // The machine formats only list the interfaces, as status records
+    bool text = (output_get_format()==OUTPUT_TEXT);
+    FILE * out = text ? stdout : stderr;
 
     // List configs
     path = conf_get_path();
-    printf("Directory: %s\n",path);
+    if(text) printf("Directory: %s\n",path);
 
-    if ((dir = opendir(path)) != NULL)
+    if (!text)
+    {
+        // Nothing
+    } else if ((dir = opendir(path)) != NULL)
     {
         while ((ent = readdir(dir)) != NULL)
         {
@@ -156,45 +230,93 @@ void cmd_list()
     }
 
 
-    // List devices
-    devs = wg_list_device_names();
-    wg_for_each_device_name(devs,name,len){
-        wg_device * pdev;
-        struct wg_peer * peerptr;
-        int ret,peers;
+    // List devices, read all at once by the status workers.  The listing
+    // already has each link's state
+    links = wg_list_devices(&num_links);
+    if(!links) return;
+    names = malloc((num_links+1)*sizeof(char *));
+    if(!names){
+        free(links);
+        return;
+    }
+    for(x=0;x<num_links;x++) names[x] = links[x].name;
+    clock_gettime(CLOCK_MONOTONIC,&start);
+    entries = status_collect(names,num_links);
+    free(names);
+    if(!entries){
+        free(links);
+        return;
+    }
+    if(g_verbose) fprintf(out,"Read %zu interfaces with %d workers, %.3f ms\n",
+                          num_links,status_workers(),ruleset_elapsed_ms(&start));
+
+    if(!text) output_begin();
+    for(x=0;x<num_links;x++){
+        wg_peer_table * table = entries[x].table;
+        uint64_t rx,tx;
+        size_t i;
         wg_key_b64_string base64;
 
-        ret = wg_get_device(&pdev,name);
-        if(ret<0){
-            ERROR("Error getting device, are you root?\n");
-            return;
+        // Gone since the listing
+        if(entries[x].error==-ENODEV) continue;
+        if(!table){
+            output_flush();
+            if(text){
+                ERROR("Error getting device, are you root?\n");
+            }else{
+                fprintf(stderr,"Error getting device, are you root?\n");
+            }
+            break;
         }
 
-        wg_key_to_base64(base64,pdev->public_key);
-
         dev_num++;
+        if(!text){
+            _status_table(table);
+            continue;
+        }
+
+        wg_key_to_base64(base64,table->public_key);
         BOLD();GREEN();
-        printf("\ninterface : %s\n",pdev->name);
+        printf("\ninterface : %s\n",table->name);
         DEFAULT();NORMAL();
         printf("  Publickey: %s\n",base64);
+        printf("  Link: %s, mtu %u\n",(links[x].flags&IFF_UP)?"up":"down",links[x].mtu);
+
+        // Through the output buffer, a line per peer adds up
+        for(i=0;i<table->num_peers;i++)
+        {
+            output_color(VTCOLOR_YELLOW);output_bold();
+            output_str("  peer: ");
+            output_key(table->keys[i].public_key);
+            output_str("\n");
+            output_color(VTCOLOR_GRAY);output_normal();
+        }
+        output_flush();
+        printf("  Num Peers: %zu\n",table->num_peers);
 
-        peers=0;
-        wg_for_each_peer(pdev,peerptr)
+        // Totals only touch the counters, not the keys
+        rx=tx=0;
+        for(i=0;i<table->num_peers;i++)
         {
-            YELLOW();BOLD();
-            wg_key_to_base64(base64,peerptr->public_key);
-            printf("  peer: %s\n",base64);
-            DEFAULT();NORMAL();
-            peers++;
+            rx+=table->peers[i].rx_bytes;
+            tx+=table->peers[i].tx_bytes;
+        }
+        printf("  Transfer: %llu B received, %llu B sent\n",
+               (unsigned long long)rx,(unsigned long long)tx);
+        if(g_verbose){
+            wg_recv_stats * stats = &entries[x].stats;
+            printf("  Dump: %lu bytes in %lu datagrams, %lu syscalls\n",
+                   stats->bytes,stats->datagrams,stats->syscalls);
         }
-        printf("  Num Peers: %d\n",peers);
-        //printf("  Acting as: %s\n",((pdev->flags&WGDEVICE_HAS_LISTEN_PORT)?"Server (ListenPort)":"Client"));
-        wg_free_device(pdev);
+        //printf("  Acting as: %s\n",((table->flags&WGDEVICE_HAS_LISTEN_PORT)?"Server (ListenPort)":"Client"));
 
     }
+    if(!text) output_end();
+    status_free(entries,num_links);
+    free(links);
     if(dev_num==0)
     {
-        printf("No active tunnels found\n");
+        fprintf(out,"No active tunnels found\n");
     }
 
     return;
@@ -224,9 +346,12 @@ void cmd_default(char * config, bool force)
 
 void cmd_status(char * config)
 {
-    wg_device * dev;
+    wg_handle * wg;
     int ret;
     char * iface;
+    bool started;
+    // Only records go to stdout in the machine formats
+    FILE * out = (output_get_format()==OUTPUT_TEXT) ? stdout : stderr;
 
     // Do we have this config?
     if(!conf_exists(config)){_cmd_config_error(config);return;}
@@ -241,59 +366,33 @@ void cmd_status(char * config)
     iface = conf_get_interface();
     if(!iface || !_interface_config_exists(iface))
     {
-        printf("%s: interface config does not exist, or we can't read it.\n",iface);
+        fprintf(out,"%s: interface config does not exist, or we can't read it.\n",iface);
 
     }else{
 
-        // Does the tunnel exist?
-        ret = wg_get_device(&dev, iface);
+        // Does the tunnel exist?  Peers are printed as they are read,
+        // the device is never held in memory as a whole
+        started = false;
+        output_begin();
+        wg = status_open();
+        ret = wg ? wg_handle_for_each_peer(wg,iface,_status_peer,&started) : -errno;
+        wg_close(wg);
+        if(started) output_device_end();
+        output_end();
         if(ret==-1){
-            printf("Permission denied for interface '%s', are you root?\n",iface);
+            fprintf(out,"Permission denied for interface '%s', are you root?\n",iface);
             return;
         }
         if(ret==-ENODEV){
-            printf("%s: interface not up\n",iface);
+            fprintf(out,"%s: interface not up\n",iface);
             return;
         }
-
-
-        // Show the tunnel info.
-        // Match wg output
-        // =========================================
-        struct wg_peer * peerptr;
-        int peers;
-        wg_key_b64_string base64;
-        wg_key_to_base64(base64,dev->public_key);
-        GREEN();
-        BOLD(); printf("interface: "); NORMAL(); GREEN(); printf("%s\n",dev->name);
-        DEFAULT();
-        BOLD(); printf("  public key: "); NORMAL(); printf("%s\n",base64);
-        BOLD(); printf("  private key: "); NORMAL(); printf("(hidden)\n");
-        //printf("  Flags: 0x%0X\n",dev->flags);
-        // TODO: Servers are ???? clients are ????
-        //printf("  Acting as: %s\n",((dev->flags&WGDEVICE_HAS_LISTEN_PORT)?"Server (ListenPort)":"Client"));
-        BOLD(); printf("  listening port: "); NORMAL(); printf("%d\n",dev->listen_port);
-        printf("\n");
-        peers=0;
-        wg_for_each_peer(dev,peerptr)
-        {
-            struct wg_allowedip * ptrallowip;
-            wg_key_to_base64(base64,peerptr->public_key);
-            YELLOW();
-            BOLD(); printf("peer: "); NORMAL(); YELLOW(); printf("%s\n",base64);
-            DEFAULT();
-            BOLD(); printf("  endpoint: "); NORMAL();
-            printf("%s:%d\n",inet_ntoa(peerptr->endpoint.addr4.sin_addr),_uint16_swap(peerptr->endpoint.addr4.sin_port));
-            wg_for_each_allowedip(peerptr,ptrallowip)
-            {
-                BOLD(); printf("  allowed ips: "); NORMAL(); printf("%s/%d\n",inet_ntoa(ptrallowip->ip4),ptrallowip->cidr);
-            }
-            peers++;
+        if(ret<0){
+            fprintf(out,"%s: error reading interface: %s\n",iface,strerror(-ret));
+            return;
         }
-        //printf("  Peers: %d\n",peers);
-        wg_free_device(dev);
-        printf("\n");
     }
+    if(out!=stdout) return;
 
     // Show the network info.
     // =========================================
@@ -305,10 +404,102 @@ void cmd_status(char * config)
 
     return;
 }
+
+// Every config's interface, with the devices read all at once
+void cmd_status_all()
+{
+    DIR * dir;
+    struct dirent *ent;
+    char * path;
+    char ** configs = NULL;
+    char ** names = NULL;
+    status_entry_t * entries;
+    int num=0,max=0,x;
+
+    path = conf_get_path();
+    if ((dir = opendir(path)) == NULL)
+    {
+        printf("Directory %s does not exist\n",path);
+        return;
+    }
+    while ((ent = readdir(dir)) != NULL)
+    {
+        char config[256];
+        char * ptr;
+        char * iface;
+
+        ptr = strstr(ent->d_name,".conf");
+        if(!ptr || ptr[5]!='\0' || ptr==ent->d_name) continue;
+        snprintf(config,sizeof(config),"%.*s",(int)(ptr-ent->d_name),ent->d_name);
+        if(!conf_load(config)){
+            ERROR("Error loading '%s'\n",config);
+            continue;
+        }
+        iface = conf_get_interface();
+        if(!iface) continue;
+        if(num==max){
+            char ** ptr_configs, ** ptr_names;
+            max = max ? max*2 : 8;
+            ptr_configs = realloc(configs,max*sizeof(char *));
+            if(ptr_configs) configs = ptr_configs;
+            ptr_names = realloc(names,max*sizeof(char *));
+            if(ptr_names) names = ptr_names;
+            if(!ptr_configs || !ptr_names) break;
+        }
+        configs[num] = strdup(config);
+        names[num] = strdup(iface);
+        if(!configs[num] || !names[num]){
+            free(configs[num]);
+            free(names[num]);
+            break;
+        }
+        num++;
+    }
+    closedir (dir);
+
+    if(!num){
+        printf("No configs found in %s\n",path);
+    }else if((entries = status_collect(names,num))!=NULL){
+        // Only records go to stdout in the machine formats
+        bool text = (output_get_format()==OUTPUT_TEXT);
+        FILE * out = text ? stdout : stderr;
+
+        output_begin();
+        for(x=0;x<num;x++){
+            if(text){
+                output_flush();
+                BLUE(); BOLD(); printf("config: %s\n",configs[x]); NORMAL();
+            }
+            if(entries[x].table){
+                _status_table(entries[x].table);
+                continue;
+            }
+            output_flush();
+            if(entries[x].error==-ENODEV) fprintf(out,"%s: interface not up\n",names[x]);
+            else if(entries[x].error==-EPERM || entries[x].error==-1)
+                fprintf(out,"Permission denied for interface '%s', are you root?\n",names[x]);
+            else fprintf(out,"%s: error reading interface: %s\n",names[x],strerror(-entries[x].error));
+            if(text) printf("\n");
+        }
+        output_end();
+        if(g_verbose) fprintf(out,"Read %d interfaces with %d workers\n",num,status_workers());
+        status_free(entries,num);
+    }
+
+    for(x=0;x<num;x++){
+        free(configs[x]);
+        free(names[x]);
+    }
+    free(configs);
+    free(names);
+    return;
+}
+
 void cmd_net_up(char * config, bool force)
 {
     int ret;
     char * iface;
+    ruleset_t rs;
 
     // Make sure we have a config
     if(!conf_exists(config)){_cmd_config_error(config);return;}
@@ -343,39 +534,31 @@ void cmd_net_up(char * config, bool force)
     }
 
 
-    // Set routing rules
-    if(_bringup_routing()==ERROR_ROUTING) goto net_up_err_routing;
-
-    // Set per-client firewall rules
-    if(_bringup_firewall()==ERROR_FIREWALL) goto net_up_err_firewall;
+    // Generate the routing, per-client firewall and drop policy rules,
+    // then install them all in one go
+    ruleset_init(&rs, iface);
+    if(_load_rules(&rs, config, iface)!=OK) goto net_up_err_rules;
+    if(ruleset_apply(&rs)<0) goto net_up_err_rules;
 
     // Set NAT rules
     if(_bringup_nat()==ERROR_NAT) goto net_up_err_nat;
 
-    // Set the policy for this interface to drop
-    if(_bringup_lockdown_forwarding(iface)==ERROR_FIREWALL) goto net_up_err_firewall;
-
+    ruleset_free(&rs);
     return;
 
-net_up_err_firewall:
-    printf("Error setting up firewall, tearing down\n");
-    _teardown_firewall();
-
-net_up_err_routing:
-    printf("Error setting up routing, tearing down\n");
-    _teardown_routing();
-
 net_up_err_nat:
     printf("Error setting up NAT, tearing down\n");
     _teardown_nat();
+    ruleset_remove(&rs);
+
+net_up_err_rules:
+    printf("Error setting up firewall, tearing down\n");
+    ruleset_free(&rs);
 
 net_up_err_end:
     printf("Error setting up device, tearing down\n");
     _teardown_interface(iface);
 
-    // Drop the block for this interface
-    _teardown_lockdown_forwarding(iface);
-
     return;
 }
 void cmd_net_down(char * config, bool force)
@@ -401,11 +584,7 @@ void cmd_net_down(char * config, bool force)
 
     _teardown_nat();
 
-    _teardown_firewall();
-
-    _teardown_routing();
-
-    _teardown_lockdown_forwarding(iface);
+    _teardown_rules(iface);
 
     // Tear down the interface
     _teardown_interface(iface);
@@ -414,13 +593,127 @@ void cmd_net_down(char * config, bool force)
 }
 void cmd_net_restart(char * config, bool force)
 {
-    cmd_net_down(config, force);
+    char cmd[255];
+    char * iface;
+    ruleset_t rs;
+    wgconf_t wc;
+    link_addr_t * routes;
+    int num_routes;
+    bool native;
 
-    cmd_net_up(config, force);
+    if(!conf_exists(config)){_cmd_config_error(config);return;}
+    if(!conf_load(config)){
+        ERROR("Error loading '%s'\n",config);
+        return;
+    }
+    iface = conf_get_interface();
+    if(!iface || !_interface_config_exists(iface)){
+        printf("%s: interface config doesn't exist, permission error?\n",iface);
+        return;
+    }
+
+    // Nothing to restart
+    if(!_is_interface_running(iface)){
+        cmd_net_up(config, force);
+        return;
+    }
+
+    // Forced, or the address or MTU moved which wg-quick only sets on the
+    // way up.  The old rules stay in place until 'up' swaps the new ones
+    // in, so the interface is never without its drop policy
+    if(force || _interface_settings_changed(iface)){
+        if(!force) printf("%s: address or MTU changed, restarting the interface\n",iface);
+        _teardown_nat();
+        _teardown_interface(iface);
+        cmd_net_up(config, true);
+        return;
+    }
+
+    // Update keys and peers in place, existing sessions stay up
+    if(g_verbose) printf("*Sync interface '%s'\n",iface);
+    native = b_native && _native_config(iface,&wc);
+    if(native){
+        if(_sync_native(iface,&wc)<0){
+            wgconf_free(&wc);
+            return;
+        }
+    }else{
+        snprintf(cmd,sizeof(cmd),"bash -c 'wg syncconf %s <(wg-quick strip %s)' 2> /dev/null",iface,iface);
+        if(_run_command(cmd)!=0){
+            printf("Error syncing device, are you root?\n");
+            return;
+        }
+    }
+
+    // wg syncconf leaves the routes alone, natively they follow the peers'
+    // allowed IPs, added and removed in one batch
+    if(native)
+    {
+        routes = wgconf_routes(&wc,&num_routes);
+        if(link_sync_routes(iface,routes,num_routes)<0)
+            printf("Error updating routes, use -F to restart from scratch\n");
+        free(routes);
+        wgconf_free(&wc);
+    }
+
+    // Only the rules that changed are touched
+    ruleset_init(&rs, iface);
+    if(_load_rules(&rs, config, iface)!=OK){
+        printf("Error building firewall rules, nothing changed\n");
+    }else{
+        if(ruleset_reconcile(&rs)<0)
+            printf("Error updating firewall, use -F to restart from scratch\n");
+    }
+    ruleset_free(&rs);
 
     return;
 }
 
+void cmd_optimize(char * config)
+{
+    char path[250];
+    char * iface;
+    ruleset_t rs;
+    int moved;
+
+    if(!conf_exists(config)){_cmd_config_error(config);return;}
+    if(!conf_load(config)){
+        ERROR("Error loading '%s'\n",config);
+        return;
+    }
+    iface = conf_get_interface();
+    if(!iface){
+        printf("Error getting interface from config");
+        return;
+    }
+
+    // Same rules as 'up' generated, with the hit counts of the installed
+    // copies
+    ruleset_init(&rs, iface);
+    if(_build_rules(&rs, iface)!=OK) goto optimize_end;
+    if(ruleset_count_hits(&rs)<0){
+        printf("%s: firewall rules not installed, bring it up first\n",iface);
+        goto optimize_end;
+    }
+
+    moved = ruleset_order_by_hits(&rs);
+    if(moved<0) goto optimize_end;
+    if(moved==0) printf("%s: accept rules already in order of hits\n",iface);
+    else{
+        printf("%s: moving %d accept rules, busiest first\n",iface,moved);
+        if(ruleset_apply(&rs)<0) goto optimize_end;
+    }
+
+    if(b_hints){
+        _order_file(config,path,sizeof(path));
+        ruleset_save_order(&rs,path);
+    }
+
+optimize_end:
+    ruleset_free(&rs);
+    return;
+}
+
 void cmd_test(char * config)
 {
     #if 0
@@ -456,6 +749,7 @@ static void _cmd_config_error(char * conf)
 static int _bringup_interface(char * iface)
 {
     char cmd[255];
+    wgconf_t wc;
     char * pch;
     uint16_t port;
     int x;
@@ -475,14 +769,25 @@ static int _bringup_interface(char * iface)
 
     if(g_verbose) printf("*Bring up interface '%s'\n",iface);
 
-    // Option 1 use wg-quick
+    // Option 1 use wg-quick, or with --native netlink if the config
+    // doesn't need wg-quick's scripting
 #if 1
-    // Create the new device
-    sprintf(cmd,"wg-quick up %s 2> /dev/null",iface);
-    ret = _run_command(cmd);
-    if(ret < 0){
-        printf("Error setting up device, are you root?\n");
-        return ERROR_SETUP_DEVICE;
+    if(b_native && _native_config(iface,&wc))
+    {
+        ret = _bringup_native(iface,&wc);
+        wgconf_free(&wc);
+        if(ret!=OK) return ret;
+    }
+    else
+    {
+        // Create the new device
+        sprintf(cmd,"wg-quick up %s 2> /dev/null",iface);
+        ret = _run_command(cmd);
+        link_cache_flush();
+        if(ret < 0){
+            printf("Error setting up device, are you root?\n");
+            return ERROR_SETUP_DEVICE;
+        }
     }
 #endif
 
@@ -592,10 +897,185 @@ static int _bringup_interface(char * iface)
 
     return OK;
 }
-static int _bringup_routing()
+
+// Load the interface's WireGuard config, true if it can come up natively
+static bool _native_config(char * iface, wgconf_t * wc)
 {
-    char cmd[250];
+    if(!wgconf_load(wc, iface)){
+        printf("%s: can't read WireGuard config, using wg-quick\n",iface);
+        return false;
+    }
+    if(wc->needs_quick){
+        printf("%s: config uses %s, using wg-quick\n",iface,wc->needs_quick);
+        wgconf_free(wc);
+        return false;
+    }
+    return true;
+}
+
+// Show the tunnel info, one peer at a time.
+// =========================================
+static int _status_peer(const wg_device * dev, const wg_peer * peer, void * data)
+{
+    struct wg_allowedip * ptrallowip;
+
+    if(!peer)
+    {
+        *(bool *)data = true;
+        output_device_begin(dev->name,dev->public_key,dev->listen_port,dev->fwmark);
+        return 0;
+    }
+
+    output_peer_begin(peer->public_key,&peer->endpoint.addr,peer->last_handshake_time.tv_sec,
+                      peer->rx_bytes,peer->tx_bytes,peer->persistent_keepalive_interval);
+    wg_for_each_allowedip(peer,ptrallowip)
+        output_allowedip(ptrallowip->family,&ptrallowip->ip4,ptrallowip->cidr);
+    output_peer_end();
+    return 0;
+}
+
+// Same output as _status_peer(), for a device read whole
+static void _status_table(wg_peer_table * table)
+{
+    size_t x;
+    uint32_t i;
+
+    output_device_begin(table->name,table->public_key,table->listen_port,table->fwmark);
+    for(x=0;x<table->num_peers;x++)
+    {
+        wg_peer_stats * peer = &table->peers[x];
+        output_peer_begin(table->keys[x].public_key,&peer->endpoint.addr,
+                          peer->last_handshake_time.tv_sec,peer->rx_bytes,peer->tx_bytes,
+                          peer->persistent_keepalive_interval);
+        for(i=0;i<peer->num_allowedips;i++)
+        {
+            wg_peer_allowedip * ip = &table->allowedips[peer->first_allowedip+i];
+            output_allowedip(ip->family,&ip->ip4,ip->cidr);
+        }
+        output_peer_end();
+    }
+    output_device_end();
+}
+
+// Only the peers that differ from the running device are sent
+static int _sync_native(char * iface, wgconf_t * wc)
+{
+    struct timespec start;
+    wg_handle * wg;
+    wg_set_status status;
+    wg_key_b64_string base64;
+    int ret;
+
+    if(b_dryrun || g_verbose)
+        printf("WG: sync device %s, changed peers only\n",iface);
+    if(b_dryrun) return OK;
+
+    clock_gettime(CLOCK_MONOTONIC,&start);
+    wg = wg_open();
+    if(!wg){
+        printf("Error syncing device, are you root?\n");
+        return -1;
+    }
+    ret = wg_handle_sync_device(wg,wc->dev);
+    wg_handle_set_status(wg,&status);
+    wg_close(wg);
+    if(ret<0 && status.error){
+        // The kernel applied the chunks around the refused one, the device
+        // is neither the old config nor the new
+        printf("Error, %s is only partially synced: chunk %u of %u refused: %s\n",
+               iface,status.failed_chunk+1,status.chunks,strerror(-status.error));
+        if(status.failed_has_peer){
+            wg_key_to_base64(base64,status.failed_peer);
+            printf("  Starting at peer %s, allowed IP %u\n",base64,status.failed_allowedip);
+        }
+        printf("  Run restart again to resync, or restart -F to recreate it\n");
+        return -1;
+    }
+    if(ret<0){
+        printf("Error syncing device, are you root?\n");
+        if(g_verbose) printf("%s: sync failed: %s\n",iface,strerror(-ret));
+        return -1;
+    }
+    printf("%s: %d peers changed, %.3f ms\n",iface,ret,ruleset_elapsed_ms(&start));
+    return OK;
+}
+
+// What 'wg-quick up' does for a plain config, as netlink requests: create
+// the link, load the key and peers, add the addresses, set the MTU and
+// bring it up, then route each peer's allowed IPs to it
+static int _bringup_native(char * iface, wgconf_t * wc)
+{
+    struct timespec start;
+    link_batch_t batch;
+    link_addr_t * routes;
+    wg_peer * peer;
+    int num_routes;
+    int num_peers = 0;
     int ret;
+    int x;
+
+    wg_for_each_peer(wc->dev,peer) num_peers++;
+    if(b_dryrun || g_verbose){
+        printf("WG: add device %s\n",iface);
+        printf("WG: set device %s, %d peers\n",iface,num_peers);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC,&start);
+    if(!b_dryrun)
+    {
+        ret = wg_add_device(iface);
+        link_cache_flush();
+        if(ret<0){
+            printf("Error creating device %s: %s, are you root?\n",iface,strerror(-ret));
+            return ERROR_SETUP_DEVICE;
+        }
+        ret = wg_set_device(wc->dev);
+        if(ret<0){
+            printf("Error configuring device %s: %s\n",iface,strerror(-ret));
+            goto native_err;
+        }
+    }
+
+    // Addresses, link up and every route in one stream of requests, the
+    // kernel runs them in order so the routes find the link up
+    if(!link_batch_init(&batch,iface)) goto native_err;
+    routes = wgconf_routes(wc,&num_routes);
+    ret = OK;
+    for(x=0;x<wc->num_addrs && ret==OK;x++)
+        if(!link_batch_add_address(&batch,&wc->addrs[x])) ret = ERROR_DEVICE;
+    if(ret==OK && !link_batch_set_up(&batch,wc->mtu)) ret = ERROR_DEVICE;
+    for(x=0;x<num_routes && ret==OK;x++)
+        if(!link_batch_add_route(&batch,&routes[x])) ret = ERROR_DEVICE;
+    if(ret==OK && link_batch_send(&batch)!=0) ret = ERROR_DEVICE;
+    free(routes);
+    link_batch_free(&batch);
+    if(ret!=OK) goto native_err;
+
+    if(!b_dryrun) printf("%s: up over netlink, %.3f ms\n",iface,ruleset_elapsed_ms(&start));
+    return OK;
+
+native_err:
+    if(!b_dryrun) wg_del_device(iface);
+    link_cache_flush();
+    return ERROR_DEVICE;
+}
+static int _build_rules(ruleset_t * rs, char * iface)
+{
+    int ret;
+
+    // Set routing rules
+    ret = _build_routing(rs);
+    if(ret!=OK) return ret;
+
+    // Set per-client firewall rules
+    ret = _build_firewall(rs);
+    if(ret!=OK) return ret;
+
+    // Set the policy for this interface to drop
+    return _build_lockdown_forwarding(rs, iface);
+}
+static int _build_routing(ruleset_t * rs)
+{
     int nets,x;
     char * iface;
 
@@ -620,9 +1100,7 @@ static int _bringup_routing()
         struct in_addr a;
         a.s_addr = get_ip_of_interface(iface);
         sprintf(cidr,"%s/%d",inet_ntoa(a),conf_get_routesubnet_cidr());
-        sprintf(cmd,"iptables -t filter -A FORWARD -i %s -d %s -j DROP",iface,cidr);
-        ret = _run_command(cmd);
-        if(ret<0){
+        if(!ruleset_add(rs,"FORWARD",iface,cidr,0,RULE_DROP)){
             printf("Error setting subnet routing\n");
             return ERROR_ROUTING;
         }
@@ -634,9 +1112,7 @@ static int _bringup_routing()
     if(nets<0){ printf("Error routing subnets\n"); return ERROR_ROUTING; }
     for(x=0;x<nets;x++)
     {
-        sprintf(cmd,"iptables -t filter -A FORWARD -i %s -d %s -j ACCEPT",iface,conf_get_route_subnet(x));
-        ret = _run_command(cmd);
-        if(ret<0){
+        if(!ruleset_add(rs,"FORWARD",iface,conf_get_route_subnet(x),0,RULE_ACCEPT)){
             printf("Error setting subnet routing\n");
             return ERROR_ROUTING;
         }
@@ -686,10 +1162,10 @@ static int _bringup_nat()
 
     return OK;
 }
-static int _bringup_firewall()
+
+static int _build_firewall(ruleset_t * rs)
 {
-    char cmd[250];
-    int ret, num_hosts;
+    int num_hosts;
     int x,y;
     char * iface;
 
@@ -725,11 +1201,9 @@ static int _bringup_firewall()
                 continue;
             }
 
-            // Actually enable it for the subnet
-            sprintf(cmd,"iptables -t filter -A FORWARD -i %s -d %s -p tcp --dport %d -j ACCEPT",iface,ip,p);
-            ret = _run_command(cmd);
-            if(ret<0){
-                printf("Error setting subnet routing\n");
+            // Actually enable it for the host
+            if(!ruleset_add(rs,"FORWARD",iface,ip,p,RULE_ACCEPT)){
+                printf("Error setting firewall host\n");
                 return ERROR_FIREWALL;
             }
         }
@@ -738,25 +1212,13 @@ static int _bringup_firewall()
 
     return OK;
 }
-static int _bringup_lockdown_forwarding(char * iface)
+static int _build_lockdown_forwarding(ruleset_t * rs, char * iface)
 {
-    char cmd[250];
-    int ret;
-
     if(g_verbose) printf("*Blocking all other FORWARD and INPUT packets\n");
 
-    // Drop all FORWARD traffic from this interface
-    sprintf(cmd,"iptables -t filter -A FORWARD -i %s -j DROP",iface);
-    ret = _run_command(cmd);
-    if(ret < 0){
-        printf("Error setting firewall drop rule\n");
-        return ERROR_FIREWALL;
-    }
-
-    // Drop all INPUT traffic from this interface
-    sprintf(cmd,"iptables -t filter -A INPUT -i %s -j DROP",iface);
-    ret = _run_command(cmd);
-    if(ret < 0){
+    // Drop all FORWARD and INPUT traffic from this interface
+    if(!ruleset_add(rs,"FORWARD",iface,NULL,0,RULE_DROP) ||
+       !ruleset_add(rs,"INPUT",iface,NULL,0,RULE_DROP)){
         printf("Error setting firewall drop rule\n");
         return ERROR_FIREWALL;
     }
@@ -767,6 +1229,7 @@ static int _bringup_lockdown_forwarding(char * iface)
 static int _teardown_interface(char * iface)
 {
     char cmd[250];
+    wgconf_t wc;
     int ret;
 
     // Skip if we are testing
@@ -781,14 +1244,30 @@ static int _teardown_interface(char * iface)
     }
 
 
-    // Option 1 use wg-quick
+    // Option 1 use wg-quick, or with --native delete the link, which
+    // takes its addresses and routes with it
 #if 1
-    // Use wg-quick
-    sprintf(cmd,"wg-quick down %s 2> /dev/null",iface);
-    ret = _run_command(cmd);
-    if(ret < 0){
-        printf("Error setting up device, are you root?\n");
-        return ERROR_SETUP_DEVICE;
+    if(b_native && _native_config(iface,&wc))
+    {
+        wgconf_free(&wc);
+        if(b_dryrun || g_verbose) printf("WG: delete device %s\n",iface);
+        ret = b_dryrun ? 0 : wg_del_device(iface);
+        link_cache_flush();
+        if(ret < 0){
+            printf("Error deleting device %s: %s\n",iface,strerror(-ret));
+            return ERROR_DEVICE_DOWN;
+        }
+    }
+    else
+    {
+        // Use wg-quick
+        sprintf(cmd,"wg-quick down %s 2> /dev/null",iface);
+        ret = _run_command(cmd);
+        link_cache_flush();
+        if(ret < 0){
+            printf("Error setting up device, are you root?\n");
+            return ERROR_SETUP_DEVICE;
+        }
     }
 #endif
 
@@ -821,53 +1300,6 @@ static int _teardown_interface(char * iface)
 #endif
 
 
-    return OK;
-}
-static int _teardown_routing()
-{
-    char cmd[250];
-    int ret;
-    int nets,x;
-    char * iface;
-    char cidr[25];
-    struct in_addr a;
-
-    if(g_verbose) printf("*Tear down routing\n");
-
-
-    // get the interface name
-    iface = conf_get_interface();
-    if(!iface)
-    {
-        printf("ERROR: interface NULL\n");
-        return ERROR_ROUTING;
-    }
-
-
-    // Delete the subnet blocking command
-    a.s_addr = get_ip_of_interface(iface);
-    sprintf(cidr,"%s/%d",inet_ntoa(a),conf_get_routesubnet_cidr());
-    sprintf(cmd,"iptables -t filter -D FORWARD -i %s -d %s -j DROP 2> /dev/null",iface,cidr);
-    ret = _run_command(cmd);
-    if(ret<0){
-        printf("Error setting subnet routing\n");
-        return ERROR_ROUTING;
-    }
-
-    // For each network we want to route
-    nets = conf_get_num_routed_networks();
-    if(nets<0){ printf("Error un-routing subnets\n"); return ERROR_DEVICE_DOWN; }
-    for(x=0;x<nets;x++)
-    {
-        sprintf(cmd,"iptables -t filter -D FORWARD -i %s -d %s -j ACCEPT 2> /dev/null",iface,conf_get_route_subnet(x));
-        ret = _run_command(cmd);
-        if(ret<0){
-            printf("Error setting subnet routing\n");
-            return ERROR_DEVICE_DOWN;
-        }
-    }
-
-
     return OK;
 }
 static int _teardown_nat()
@@ -913,85 +1345,22 @@ static int _teardown_nat()
 
     return OK;
 }
-static int _teardown_firewall()
-{
-    char cmd[250];
-    int ret, num_hosts;
-    int x,y;
-    char * iface;
-
-    if(g_verbose) printf("*Tear down firewall\n");
-
-    // get the interface name
-    iface = conf_get_interface();
-    if(!iface)
-    {
-        printf("ERROR: interface NULL\n");
-        return ERROR_FIREWALL;
-    }
-
-    // Clear firewall_hosts rules
-    num_hosts = conf_get_num_firewall_hosts();
-    for(x=0;x<num_hosts;x++)
-    {
-        int ports;
-        char * ip;
-        ports = conf_get_firewall_host_num_ports(x);
-        ip = conf_get_firewall_host_ip(x);
-        if(ports<=0 || ip==NULL){
-            printf("Invalid number of ports %d\n",ports);
-            continue;
-        }
-
-        for(y=0;y<ports;y++)
-        {
-            int p;
-            p = conf_get_firewall_host_port(x,y);
-            if(p==0){
-                printf("Invalid port\n");
-                continue;
-            }
 
-            // Actually enable it for the subnet
-            sprintf(cmd,"iptables -t filter -D FORWARD -i %s -d %s -p tcp --dport %d -j ACCEPT 2> /dev/null",iface,ip,p);
-            ret = _run_command(cmd);
-            if(ret<0){
-                printf("Error setting subnet routing\n");
-                return ERROR_FIREWALL;
-            }
-        }
-
-    }
-
-    return OK;
-}
-static int _teardown_lockdown_forwarding(char * iface)
+static int _teardown_rules(char * iface)
 {
-    char cmd[250];
-    int ret;
-
-    if(g_verbose) printf("*Remove blocking all other FORWARD and INPUT packets\n");
-
-    // Delete FORWARD rule
-    sprintf(cmd,"iptables -t filter -D FORWARD -i %s -j DROP 2> /dev/null",iface);
-    ret = _run_command(cmd);
-    if(ret < 0){
-        printf("Error setting firewall drop rule\n");
-        return ERROR_FIREWALL;
-    }
+    ruleset_t rs;
+    int ret = OK;
 
-    // Delete INPUT rule
-    sprintf(cmd,"iptables -t filter -D INPUT -i %s -j DROP 2> /dev/null",iface);
-    ret = _run_command(cmd);
-    if(ret < 0){
-        printf("Error setting firewall drop rule\n");
-        return ERROR_FIREWALL;
-    }
+    if(g_verbose) printf("*Tear down routing and firewall\n");
 
-    return OK;
+    // Everything for the interface sits in its own chains, so nothing
+    // has to be regenerated from the config to remove it
+    ruleset_init(&rs, iface);
+    if(ruleset_remove(&rs)<0) ret = ERROR_FIREWALL;
+    ruleset_free(&rs);
+    return ret;
 }
 
-
 static int _run_command(char * command)
 {
     if(b_dryrun || g_verbose){
@@ -1011,20 +1380,11 @@ static int _test_command(char * command)
 
 static bool _is_interface_running(char * iface)
 {
-    int ret;
-    wg_device * dev;
+    link_info_t * link;
 
-    // Does the tunnel exist?
-    ret = wg_get_device(&dev, iface);
-    if(ret==-1){
-       printf("Permission denied, are you root?\n");
-       return false;
-    }
-    if(ret==-ENODEV){
-       return false;
-    }
-    wg_free_device(dev);
-    return true;
+    // Does the tunnel exist?  From the link cache, no peer dump needed
+    link = link_get(iface);
+    return link && strcmp(link->kind,"wireguard")==0;
 }
 
 static bool _interface_config_exists(char * iface)
@@ -1038,6 +1398,114 @@ static bool _interface_config_exists(char * iface)
     //printf("File '%s' does not exist, can this user access it?\n",name);
     return false;
 }
+// Compares the Address and MTU of the wg-quick config against the running
+// interface, only the first IPv4 address is checked
+static bool _interface_settings_changed(char * iface)
+{
+    FILE * fp;
+    link_info_t * link;
+    char name[200];
+    char line[256];
+    char address[INET_ADDRSTRLEN+4] = "";
+    char current[INET_ADDRSTRLEN+4];
+    char * key, * value, * end;
+    bool in_interface = false;
+    int mtu = 0;
+
+    sprintf(name,"/etc/wireguard/%s.conf",iface);
+    fp = fopen(name,"r");
+    if(!fp) return true;
+    while(fgets(line,sizeof(line),fp))
+    {
+        key = line;
+        while(isspace((unsigned char)*key)) key++;
+        if(*key=='['){
+            in_interface = (strncasecmp(key,"[Interface]",11)==0);
+            continue;
+        }
+        value = strchr(key,'=');
+        if(!in_interface || !value) continue;
+        for(end=value;end>key && isspace((unsigned char)end[-1]);end--);
+        *end = 0;
+        value++;
+
+        if(strcasecmp(key,"Address")==0 && !address[0])
+        {
+            // Comma separated, skip any IPv6 ones
+            value = strtok(value,", \t\r\n");
+            while(value && strchr(value,':')) value = strtok(NULL,", \t\r\n");
+            if(value) snprintf(address,sizeof(address),"%s",value);
+        }
+        else if(strcasecmp(key,"MTU")==0) mtu = atoi(value);
+    }
+    fclose(fp);
+
+    if(address[0])
+    {
+        if(!strchr(address,'/')) strncat(address,"/32",sizeof(address)-strlen(address)-1);
+        cidr_of_interface(iface,current,sizeof(current));
+        if(strcmp(address,current)!=0){
+            if(g_verbose) printf("%s: address %s, was %s\n",iface,address,current);
+            return true;
+        }
+    }
+
+    if(mtu)
+    {
+        link = link_get(iface);
+        if(!link || link->mtu!=mtu){
+            if(g_verbose) printf("%s: MTU %d, was %d\n",iface,mtu,(link?link->mtu:0));
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// The saved rule order sits next to the config, <name>.order
+static void _order_file(char * config, char * out, int max_len)
+{
+    int len;
+
+    if(access(config,F_OK)!=0){
+        snprintf(out,max_len,"%s/%s.order",conf_get_path(),config);
+        return;
+    }
+    len = strlen(config);
+    if(len>5 && strcmp(config+len-5,".conf")==0) len -= 5;
+    snprintf(out,max_len,"%.*s.order",len,config);
+    return;
+}
+
+// Order the rules as 'optimize' saved them, if it did
+static void _load_order(ruleset_t * rs, char * config)
+{
+    char path[250];
+
+    _order_file(config,path,sizeof(path));
+    if(access(path,R_OK)!=0) return;
+    if(ruleset_load_order(rs,path)) ruleset_order_by_hits(rs);
+    return;
+}
+
+// The compiled ruleset from the cache, or generated, ordered and cached
+static int _load_rules(ruleset_t * rs, char * config, char * iface)
+{
+    char order[250];
+    char file[250];
+    int ret;
+
+    snprintf(file,sizeof(file),"%s",conf_get_fullpath(config));
+    _order_file(config,order,sizeof(order));
+    if(cache_load(rs,file,order)) return OK;
+
+    ret = _build_rules(rs, iface);
+    if(ret!=OK) return ret;
+    _load_order(rs, config);
+    cache_store(rs,file,order);
+    return OK;
+}
+
 static uint16_t _uint16_swap(uint16_t in)
 {
     uint16_t tmp16;
@@ -24,6 +24,12 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 void cmd_init();
 
 void cmd_enable_dryrun();
+bool cmd_set_backend(char * name);
+bool cmd_set_format(char * name);
+bool cmd_set_recv(char * spec);
+void cmd_enable_sets();
+void cmd_enable_hints();
+void cmd_enable_native();
 
 void cmd_list();
 
@@ -31,9 +37,11 @@ void cmd_show(char * config);
 void cmd_default(char * config, bool force);
 
 void cmd_status(char * config);
+void cmd_status_all();
 void cmd_net_up(char * config, bool force);
 void cmd_net_down(char * config, bool force);
 void cmd_net_restart(char * config, bool force);
+void cmd_optimize(char * config);
 
 void cmd_test(char * config);
 
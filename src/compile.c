@@ -0,0 +1,572 @@
+/*********************************************************************
+wgnet WireGuard network utility
+
+Copyright (C) 2020 - Andrew Gaylo - drew@clisystems.com
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*******************************************************************/
+
+/*********************************************************************
+ *
+ * Overview:
+ *
+ * This file is the rule compiler.  It runs over a ruleset after cmd.c
+ * has generated it from the config and before a backend installs it,
+ * and shrinks every run of accept rules:
+ *
+ *  - destinations are parsed into address ranges once, so the same
+ *    network written two ways is one destination
+ *  - ports for the same destination are sorted and deduplicated, and
+ *    consecutive ports collapse into ranges
+ *  - port rules for addresses an any-port rule already accepts are
+ *    dropped
+ *  - destinations with exactly the same ports share a rule, and their
+ *    addresses are merged into the fewest CIDRs that cover exactly the
+ *    same addresses.  Duplicates and overlaps go away, and neighbouring
+ *    networks or hosts join into bigger prefixes
+ *  - the ports and ranges are packed into rules of up to RULE_MAX_PORTS,
+ *    a range taking two, as with iptables multiport
+ *
+ * Only a run of accepts gets rearranged, moving an accept past a drop
+ * could change what is let through.  Within a run the merged rules keep
+ * the order of the first rule they came from.
+ *
+ ********************************************************************/
+
+#include "defs.h"
+#include "compile.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// Types
+// ----------------------------------------------------------------------------
+
+// Inclusive, host byte order
+typedef struct {
+    uint32_t first;
+    uint32_t last;
+} compile_range_t;
+
+// A rule of the run with its destination parsed
+typedef struct {
+    rule_t * rule;
+    bool parsed;            // Destination is empty, an address or a network
+    compile_range_t addrs;
+} compile_src_t;
+
+// Everything the run accepts for one chain, interface and destination
+typedef struct {
+    compile_src_t * src;    // Earliest rule for the destination
+    int order;              // Its index in the run
+    bool any_port;          // Some rule accepts every port
+    bool covered;           // An any-port network already accepts all of it
+    uint32_t reach;         // Furthest address any-port ranges up to here reach
+    rule_ports_t * ports;   // Sorted and merged
+    int num_ports;
+} compile_dest_t;
+
+// Destinations sharing one rule, a run of the sorted destinations
+typedef struct {
+    compile_dest_t ** dests;
+    int num;
+} compile_group_t;
+
+typedef struct {
+    rule_t * rules;
+    int num_rules;
+    int max_rules;
+} compile_out_t;
+
+// Local functions
+// ----------------------------------------------------------------------------
+static bool _plain_accept(rule_t * rule);
+static bool _parse_dest(char * dest, compile_range_t * addrs);
+static int _cmp_key(compile_src_t * a, compile_src_t * b);
+static int _cmp_src(const void * a, const void * b);
+static int _cmp_dest(const void * a, const void * b);
+static int _cmp_group(const void * a, const void * b);
+static int _cmp_range(const void * a, const void * b);
+static bool _same_ports(compile_dest_t * a, compile_dest_t * b);
+static void _mark_covered(compile_dest_t ** by_ports, int num);
+static int _merge_ranges(compile_range_t * ranges, int num);
+static char ** _cidr_cover(compile_range_t * ranges, int num, int * num_cidrs);
+static bool _out_add(compile_out_t * out, rule_t * rule);
+static bool _compile_run(rule_t * run, int num, compile_out_t * out);
+static bool _emit_group(compile_dest_t ** group, int num, compile_out_t * out);
+
+// Public functions
+// ----------------------------------------------------------------------------
+bool compile_ruleset(ruleset_t * rs)
+{
+    compile_out_t out = {0};
+    int x,y,end;
+
+    if(rs->compiled) return true;
+
+    x = 0;
+    while(x<rs->num_rules)
+    {
+        if(!_plain_accept(&rs->rules[x]))
+        {
+            if(!_out_add(&out,&rs->rules[x])) goto compile_err;
+            x++;
+            continue;
+        }
+
+        for(end=x;end<rs->num_rules && _plain_accept(&rs->rules[end]);end++);
+        if(!_compile_run(&rs->rules[x],end-x,&out)) goto compile_err;
+        x = end;
+    }
+
+    if(g_verbose) printf("Compiled %d rules into %d\n",rs->num_rules,out.num_rules);
+    free(rs->rules);
+    rs->rules = out.rules;
+    rs->num_rules = out.num_rules;
+    rs->max_rules = out.max_rules;
+    rs->compiled = true;
+    return true;
+
+compile_err:
+    // Only rules made here have destination lists, ruleset_add never
+    // gives a rule one
+    for(x=0;x<out.num_rules;x++)
+    {
+        for(y=0;y<out.rules[x].num_dests;y++) free(out.rules[x].dests[y]);
+        free(out.rules[x].dests);
+    }
+    free(out.rules);
+    return false;
+}
+
+// Private functions
+// ----------------------------------------------------------------------------
+static bool _plain_accept(rule_t * rule)
+{
+    return rule->target==RULE_ACCEPT && !rule->match_set && !rule->num_dests && rule->num_ports<=1;
+}
+
+static bool _parse_dest(char * dest, compile_range_t * addrs)
+{
+    char ip[RULE_DEST_LEN];
+    char * slash;
+    struct in_addr a;
+    int cidr = 32;
+    uint32_t mask;
+
+    // No destination is every address
+    if(!dest[0]){
+        addrs->first = 0;
+        addrs->last = 0xFFFFFFFF;
+        return true;
+    }
+
+    strncpy(ip,dest,sizeof(ip)-1);
+    ip[sizeof(ip)-1] = 0;
+    slash = strchr(ip,'/');
+    if(slash){
+        *slash = 0;
+        cidr = atoi(slash+1);
+        if(cidr<0 || cidr>32) return false;
+    }
+    if(inet_pton(AF_INET,ip,&a)!=1) return false;
+
+    // Host bits are ignored, as iptables does
+    mask = cidr ? 0xFFFFFFFFu << (32-cidr) : 0;
+    addrs->first = ntohl(a.s_addr) & mask;
+    addrs->last = addrs->first | ~mask;
+    return true;
+}
+
+static int _cmp_key(compile_src_t * a, compile_src_t * b)
+{
+    int ret;
+    if((ret = strcmp(a->rule->chain,b->rule->chain))) return ret;
+    if((ret = strcmp(a->rule->iface,b->rule->iface))) return ret;
+    if(a->parsed!=b->parsed) return a->parsed-b->parsed;
+    if(!a->parsed) return strcmp(a->rule->dest,b->rule->dest);
+    if(a->addrs.first!=b->addrs.first) return (a->addrs.first>b->addrs.first)-(a->addrs.first<b->addrs.first);
+    return (a->addrs.last>b->addrs.last)-(a->addrs.last<b->addrs.last);
+}
+
+// Same destination together, then by first port
+static int _cmp_src(const void * a, const void * b)
+{
+    compile_src_t * sa = (compile_src_t *)a;
+    compile_src_t * sb = (compile_src_t *)b;
+    int pa, pb;
+    int ret;
+
+    if((ret = _cmp_key(sa,sb))) return ret;
+    pa = sa->rule->num_ports ? sa->rule->ports[0].first : -1;
+    pb = sb->rule->num_ports ? sb->rule->ports[0].first : -1;
+    if(pa!=pb) return pa-pb;
+    return (sa->rule>sb->rule)-(sa->rule<sb->rule);
+}
+
+// Destinations that can share a rule together, any-port ones by address
+// first, then in run order
+static int _cmp_dest(const void * a, const void * b)
+{
+    compile_dest_t * da = *(compile_dest_t **)a;
+    compile_dest_t * db = *(compile_dest_t **)b;
+    int ret;
+
+    if((ret = strcmp(da->src->rule->chain,db->src->rule->chain))) return ret;
+    if((ret = strcmp(da->src->rule->iface,db->src->rule->iface))) return ret;
+    if(da->src->parsed!=db->src->parsed) return da->src->parsed-db->src->parsed;
+    if(da->src->parsed)
+    {
+        if(da->any_port!=db->any_port) return db->any_port-da->any_port;
+        if(da->any_port && da->src->addrs.first!=db->src->addrs.first)
+            return (da->src->addrs.first>db->src->addrs.first)-(da->src->addrs.first<db->src->addrs.first);
+        if(da->num_ports!=db->num_ports) return da->num_ports-db->num_ports;
+        if(!da->any_port && (ret = memcmp(da->ports,db->ports,da->num_ports*sizeof(rule_ports_t))))
+            return ret;
+    }
+    return da->order-db->order;
+}
+
+static int _cmp_group(const void * a, const void * b)
+{
+    const compile_group_t * ga = a;
+    const compile_group_t * gb = b;
+    int oa = ga->dests[0]->order, ob = gb->dests[0]->order;
+    int x;
+
+    // A group is placed by its earliest rule, which is not always the
+    // first of it once sorted by address
+    for(x=1;x<ga->num;x++) if(ga->dests[x]->order<oa) oa = ga->dests[x]->order;
+    for(x=1;x<gb->num;x++) if(gb->dests[x]->order<ob) ob = gb->dests[x]->order;
+    return oa-ob;
+}
+
+static int _cmp_range(const void * a, const void * b)
+{
+    const compile_range_t * ra = a;
+    const compile_range_t * rb = b;
+    return (ra->first>rb->first)-(ra->first<rb->first);
+}
+
+static bool _same_ports(compile_dest_t * a, compile_dest_t * b)
+{
+    if(!a->src->parsed || !b->src->parsed) return false;
+    if(strcmp(a->src->rule->chain,b->src->rule->chain) || strcmp(a->src->rule->iface,b->src->rule->iface))
+        return false;
+    if(a->any_port || b->any_port) return a->any_port==b->any_port;
+    return a->num_ports==b->num_ports &&
+           memcmp(a->ports,b->ports,a->num_ports*sizeof(rule_ports_t))==0;
+}
+
+static void _mark_covered(compile_dest_t ** by_ports, int num)
+{
+    compile_dest_t ** any;
+    compile_dest_t * d;
+    int x, y, num_any;
+    uint32_t reach;
+
+    // Any-port destinations sort first in each chain and interface, by
+    // address, so each run of them is searched for the ported ones after
+    for(x=0;x<num;x+=num_any)
+    {
+        any = &by_ports[x];
+        for(num_any=0;x+num_any<num && any[num_any]->src->parsed && any[num_any]->any_port &&
+                      !strcmp(any[num_any]->src->rule->chain,any[0]->src->rule->chain) &&
+                      !strcmp(any[num_any]->src->rule->iface,any[0]->src->rule->iface);num_any++);
+        if(!num_any){ num_any = 1; continue; }
+
+        // Sorted by first address, so a running maximum of the last one
+        // tells if any range starting at or before an address contains it
+        for(y=0;y<num_any;y++)
+        {
+            reach = any[y]->src->addrs.last;
+            if(y && any[y-1]->reach>reach) reach = any[y-1]->reach;
+            any[y]->reach = reach;
+        }
+
+        for(y=x+num_any;y<num;y++)
+        {
+            d = by_ports[y];
+            if(!d->src->parsed || d->any_port) break;
+            if(strcmp(d->src->rule->chain,any[0]->src->rule->chain) ||
+               strcmp(d->src->rule->iface,any[0]->src->rule->iface)) break;
+
+            // Last any-port range starting at or before the destination
+            int lo = 0, hi = num_any;
+            while(lo<hi)
+            {
+                int mid = (lo+hi)/2;
+                if(any[mid]->src->addrs.first<=d->src->addrs.first) lo = mid+1;
+                else hi = mid;
+            }
+            if(lo>0 && any[lo-1]->reach>=d->src->addrs.last) d->covered = true;
+        }
+    }
+    return;
+}
+
+static int _merge_ranges(compile_range_t * ranges, int num)
+{
+    int x, out = 0;
+
+    qsort(ranges,num,sizeof(compile_range_t),_cmp_range);
+    for(x=0;x<num;x++)
+    {
+        // Overlapping or touching the last one, extend it
+        if(out && (ranges[out-1].last==0xFFFFFFFF || ranges[x].first<=ranges[out-1].last+1))
+        {
+            if(ranges[x].last>ranges[out-1].last) ranges[out-1].last = ranges[x].last;
+            continue;
+        }
+        ranges[out++] = ranges[x];
+    }
+    return out;
+}
+
+static char ** _cidr_cover(compile_range_t * ranges, int num, int * num_cidrs)
+{
+    char ** cidrs = NULL;
+    int count = 0, max = 0;
+    struct in_addr a;
+    char ip[INET_ADDRSTRLEN];
+    uint64_t first, last, size;
+    int x, len;
+
+    for(x=0;x<num;x++)
+    {
+        first = ranges[x].first;
+        last = ranges[x].last;
+        while(first<=last)
+        {
+            // Biggest aligned block starting here that stays in range
+            for(len=0;len<32;len++)
+            {
+                size = 1ull << (32-len);
+                if((first & (size-1))==0 && first+size-1<=last) break;
+            }
+            size = 1ull << (32-len);
+
+            if(count==max)
+            {
+                max = max ? max*2 : 16;
+                char ** grown = realloc(cidrs,max*sizeof(char *));
+                if(!grown) goto cidr_cover_err;
+                cidrs = grown;
+            }
+
+            // Every address is no destination at all
+            a.s_addr = htonl((uint32_t)first);
+            inet_ntop(AF_INET,&a,ip,sizeof(ip));
+            cidrs[count] = malloc(RULE_DEST_LEN);
+            if(!cidrs[count]) goto cidr_cover_err;
+            if(len==0) cidrs[count][0] = 0;
+            else if(len==32) snprintf(cidrs[count],RULE_DEST_LEN,"%s",ip);
+            else snprintf(cidrs[count],RULE_DEST_LEN,"%s/%d",ip,len);
+            count++;
+            first += size;
+        }
+    }
+    *num_cidrs = count;
+    return cidrs;
+
+cidr_cover_err:
+    for(x=0;x<count;x++) free(cidrs[x]);
+    free(cidrs);
+    return NULL;
+}
+
+static bool _out_add(compile_out_t * out, rule_t * rule)
+{
+    if(out->num_rules==out->max_rules)
+    {
+        int max = out->max_rules ? out->max_rules*2 : 32;
+        rule_t * rules = realloc(out->rules,max*sizeof(rule_t));
+        if(!rules) return false;
+        out->rules = rules;
+        out->max_rules = max;
+    }
+    out->rules[out->num_rules++] = *rule;
+    return true;
+}
+
+static bool _compile_run(rule_t * run, int num, compile_out_t * out)
+{
+    compile_src_t * srcs;
+    compile_dest_t * dests;
+    compile_dest_t ** by_ports;
+    compile_group_t * groups;
+    int num_dests = 0;
+    int num_groups = 0;
+    int x,y,z;
+    bool ret = false;
+
+    srcs = malloc(num*sizeof(compile_src_t));
+    dests = calloc(num,sizeof(compile_dest_t));
+    by_ports = malloc(num*sizeof(compile_dest_t *));
+    groups = malloc(num*sizeof(compile_group_t));
+    if(!srcs || !dests || !by_ports || !groups) goto compile_run_end;
+
+    // Parse every destination once, then bring each one's rules together
+    // ordered by port
+    for(x=0;x<num;x++)
+    {
+        srcs[x].rule = &run[x];
+        srcs[x].parsed = _parse_dest(run[x].dest,&srcs[x].addrs);
+    }
+    qsort(srcs,num,sizeof(compile_src_t),_cmp_src);
+
+    for(x=0;x<num;x++)
+    {
+        compile_src_t * src = &srcs[x];
+        rule_t * rule = src->rule;
+        compile_dest_t * d = num_dests ? &dests[num_dests-1] : NULL;
+
+        if(!d || _cmp_key(d->src,src)!=0)
+        {
+            // At most one range per rule for the destination
+            for(y=x+1;y<num && _cmp_key(src,&srcs[y])==0;y++);
+            d = &dests[num_dests++];
+            d->src = src;
+            d->order = rule-run;
+            d->ports = malloc((y-x)*sizeof(rule_ports_t));
+            if(!d->ports) goto compile_run_end;
+        }
+        if(rule-run < d->order){
+            d->src = src;
+            d->order = rule-run;
+        }
+
+        if(!rule->num_ports){
+            d->any_port = true;
+            continue;
+        }
+
+        // Sorted by first port, so each range either extends the last one
+        // or starts a new one
+        rule_ports_t * last = d->num_ports ? &d->ports[d->num_ports-1] : NULL;
+        if(last && rule->ports[0].first <= (int)last->last+1)
+        {
+            if(rule->ports[0].last > last->last) last->last = rule->ports[0].last;
+        }
+        else d->ports[d->num_ports++] = rule->ports[0];
+    }
+
+    // Drop what an any-port rule already accepts, then gather the
+    // destinations with the same ports
+    for(x=0;x<num_dests;x++) by_ports[x] = &dests[x];
+    qsort(by_ports,num_dests,sizeof(compile_dest_t *),_cmp_dest);
+    _mark_covered(by_ports,num_dests);
+    for(x=0,z=0;x<num_dests;x++) if(!by_ports[x]->covered) by_ports[z++] = by_ports[x];
+    num_dests = z;
+
+    for(x=0;x<num_dests;x+=y)
+    {
+        for(y=1;x+y<num_dests && _same_ports(by_ports[x],by_ports[x+y]);y++);
+        groups[num_groups].dests = &by_ports[x];
+        groups[num_groups].num = y;
+        num_groups++;
+    }
+
+    // Emit the groups in the order of their first rule
+    qsort(groups,num_groups,sizeof(compile_group_t),_cmp_group);
+    for(x=0;x<num_groups;x++)
+    {
+        if(!_emit_group(groups[x].dests,groups[x].num,out)) goto compile_run_end;
+    }
+    ret = true;
+
+compile_run_end:
+    if(!ret) printf("Error, out of memory compiling rules\n");
+    for(x=0;dests && x<num;x++) free(dests[x].ports);
+    free(groups);
+    free(by_ports);
+    free(dests);
+    free(srcs);
+    return ret;
+}
+
+static bool _emit_group(compile_dest_t ** group, int num, compile_out_t * out)
+{
+    compile_dest_t * d = group[0];
+    compile_range_t * ranges;
+    rule_t rule;
+    char ** cidrs = NULL;
+    int num_cidrs = 0;
+    int x = 0;
+    int y, slots;
+    bool ret = false;
+
+    // Earliest rule of the group provides chain, interface and target
+    for(y=1;y<num;y++) if(group[y]->order<d->order) d = group[y];
+    rule = *d->src->rule;
+    rule.dests = NULL;
+    rule.num_dests = 0;
+
+    if(d->src->parsed)
+    {
+        ranges = malloc(num*sizeof(compile_range_t));
+        if(!ranges) return false;
+        for(y=0;y<num;y++) ranges[y] = group[y]->src->addrs;
+        cidrs = _cidr_cover(ranges,_merge_ranges(ranges,num),&num_cidrs);
+        free(ranges);
+        if(!cidrs) return false;
+        if(num_cidrs==1) strcpy(rule.dest,cidrs[0]);
+    }
+
+    do
+    {
+        // Pack as many ports as fit in one rule
+        rule.num_ports = 0;
+        for(slots=0;!d->any_port && x<d->num_ports;x++)
+        {
+            int need = (d->ports[x].first==d->ports[x].last) ? 1 : 2;
+            if(slots+need>RULE_MAX_PORTS) break;
+            rule.ports[rule.num_ports++] = d->ports[x];
+            slots += need;
+        }
+
+        // Each rule owns its own copy of the destination list
+        if(num_cidrs>1)
+        {
+            rule.dest[0] = 0;
+            rule.dests = malloc(num_cidrs*sizeof(char *));
+            if(!rule.dests) goto emit_group_end;
+            for(y=0;y<num_cidrs;y++)
+            {
+                rule.dests[y] = strdup(cidrs[y]);
+                if(!rule.dests[y]) break;
+            }
+            rule.num_dests = y;
+            if(y<num_cidrs || !_out_add(out,&rule))
+            {
+                for(y=0;y<rule.num_dests;y++) free(rule.dests[y]);
+                free(rule.dests);
+                goto emit_group_end;
+            }
+        }
+        else if(!_out_add(out,&rule)) goto emit_group_end;
+    } while(!d->any_port && x<d->num_ports);
+    ret = true;
+
+emit_group_end:
+    for(y=0;y<num_cidrs;y++) free(cidrs[y]);
+    free(cidrs);
+    return ret;
+}
+
+// EOF
@@ -283,17 +283,21 @@ bool conf_load_default()
     return true;
 }
 
-bool conf_load(char * conf_name)
+char * conf_get_fullpath(char * conf_name)
 {
-    char * file;
-
     // If the file exists, use that, if not, use
     // the default location .conf
     if( access( conf_name, F_OK ) != -1 ) {
-        file = conf_name;
-    }else{
-        file = _conf_make_fullpath(conf_name);
+        return conf_name;
     }
+    return _conf_make_fullpath(conf_name);
+}
+
+bool conf_load(char * conf_name)
+{
+    char * file;
+
+    file = conf_get_fullpath(conf_name);
 
     if(g_verbose) printf("Loading '%s'\n",file);
 
@@ -351,74 +355,6 @@ bool conf_save(char * conf_name)
     return true;
 }
 
-
-#include <sys/socket.h>
-#include <sys/ioctl.h>
-#include <netinet/in.h>
-
-// Should prob move these to new 'util' source file
-
-// https://stackoverflow.com/questions/2283494/get-ip-address-of-an-interface-on-linux
-uint32_t get_ip_of_interface(char * iface)
-{
-    int fd;
-    struct ifreq ifr;
-
-    fd = socket(AF_INET, SOCK_DGRAM, 0);
-
-    // get ip4 address
-    ifr.ifr_addr.sa_family = AF_INET;
-    strncpy(ifr.ifr_name, iface, IFNAMSIZ-1);
-
-    // ioctl
-    ioctl(fd, SIOCGIFADDR, &ifr);
-    close(fd);
-
-    return (uint32_t)((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr.s_addr;
-    #if 0
-    strncpy(ip,inet_ntoa(((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr), max_size);
-    return;
-    #endif
-}
-
-uint32_t get_netmask_of_interface(char * iface)
-{
-    int fd;
-    struct ifreq ifr;
-
-    fd = socket(AF_INET, SOCK_DGRAM, 0);
-
-    // get ip4 address
-    ifr.ifr_addr.sa_family = AF_INET;
-    strncpy(ifr.ifr_name, iface, IFNAMSIZ-1);
-
-    // ioctl
-    ioctl(fd, SIOCGIFNETMASK, &ifr);
-    close(fd);
-
-    return (uint32_t)((struct sockaddr_in *)&ifr.ifr_netmask)->sin_addr.s_addr;
-}
-
-uint16_t cidr_from_netmask(uint32_t netmask)
-{
-    int x=0;
-    while(netmask&0x1){
-        x++;
-        netmask>>=1;
-    }
-    return x;
-}
-
-void cidr_of_interface(char * iface, char * out, int max_len)
-{
-    struct in_addr a;
-    int cidr;
-    a.s_addr = (unsigned long)get_ip_of_interface(iface);
-    cidr = cidr_from_netmask(get_netmask_of_interface(iface));
-    snprintf(out,max_len,"%s/%d",inet_ntoa(a),cidr);
-    return;
-}
-
 // Public functions
 // ----------------------------------------------------------------------------
 static char * _conf_make_fullpath(char * name)
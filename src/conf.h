@@ -52,6 +52,9 @@ char * conf_get_path();
 
 bool conf_exists(char * conf_name);
 
+// File a config name loads from, the name itself if that is a file
+char * conf_get_fullpath(char * conf_name);
+
 bool conf_remove(char * conf_name);
 
 bool conf_load_default();
@@ -60,10 +63,4 @@ bool conf_load(char * conf_name);
 
 bool conf_save(char * conf_name);
 
-// MOVE THESE
-uint32_t get_ip_of_interface(char * iface);
-uint32_t get_netmask_of_interface(char * iface);
-uint16_t cidr_from_netmask(uint32_t netmask);
-void cidr_of_interface(char * iface, char * out, int max_len);
-
 #endif
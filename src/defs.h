@@ -18,6 +18,9 @@ extern bool g_verbose;
 
 #define DEFAULT_CONFIG_PATH     "/etc/wgnet"
 
+// Compiled rulesets are cached here, gone after a reboot
+#define CACHE_PATH              "/run/wgnet"
+
 #define USEC_PER_SEC	1000000
 
 // Quick utility macros
@@ -22,7 +22,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define __DEFS_COLORS__
 
 // This header file can be used for setting output console colors
-// on VT100 consoles.
+// on VT100 consoles.  Nothing is printed unless stdout is a terminal
+// and the output format is text, see output.c
+bool output_colors();
 
 
 #define BACKGROUND_COLOR_NORMAL	'4'
@@ -42,8 +44,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define VTCOLOR_GRAY	'7'
 #define VTCOLOR_DEFAULT	'9'
 
-#define FOREGROUND_COLOR(B,C)		printf("%c%c%c%c%c", 0x1B, '[', (B), (C),'m')
-#define BACKGROUND_COLOR(C)		printf("%c%c%c%c%c", 0x1B, '[', BACKGROUND_COLOR_NORMAL, (C),'m')
+#define FOREGROUND_COLOR(B,C)		do{if(output_colors()) printf("%c%c%c%c%c", 0x1B, '[', (B), (C),'m');}while(0)
+#define BACKGROUND_COLOR(C)		do{if(output_colors()) printf("%c%c%c%c%c", 0x1B, '[', BACKGROUND_COLOR_NORMAL, (C),'m');}while(0)
 
 #define RED()		FOREGROUND_COLOR(FGCOLORSET, VTCOLOR_RED)
 #define GREEN()		FOREGROUND_COLOR(FGCOLORSET, VTCOLOR_GREEN)
@@ -53,8 +55,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define MAGENTA()	FOREGROUND_COLOR(FGCOLORSET, VTCOLOR_MAGENTA)
 #define DEFAULT()	FOREGROUND_COLOR(FGCOLORSET, VTCOLOR_GRAY)
 
-#define NORMAL()	printf("%c%c%c%c", 0x1B, '[', '0', 'm')
-#define BOLD()		printf("%c%c%c%c", 0x1B, '[', '1', 'm')
+#define NORMAL()	do{if(output_colors()) printf("%c%c%c%c", 0x1B, '[', '0', 'm');}while(0)
+#define BOLD()		do{if(output_colors()) printf("%c%c%c%c", 0x1B, '[', '1', 'm');}while(0)
 
 
 
@@ -0,0 +1,872 @@
+/*********************************************************************
+wgnet WireGuard network utility
+
+Copyright (C) 2020 - Andrew Gaylo - drew@clisystems.com
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*******************************************************************/
+
+/*********************************************************************
+ *
+ * Overview:
+ *
+ * This file sets up network interfaces over rtnetlink, the same
+ * requests 'ip address', 'ip link' and 'ip route' send, without running
+ * either of them.
+ *
+ * Requests are queued into a batch, each message built in place in one
+ * growing buffer.  Sending writes LINK_BATCH_WINDOW messages at a time
+ * with one sendto, only the last of them asking for an ACK, then reads
+ * until that ACK comes back.  rtnetlink runs the messages in order and
+ * answers a refused one with an error carrying its sequence number, so
+ * each failure is matched back to the request that caused it while the
+ * rest still go through.  Thousands of peer routes cost a handful of
+ * system calls instead of a process each.
+ *
+ * Interface lookups go through a cache filled by one RTM_GETLINK and
+ * one RTM_GETADDR dump over a single socket, the first time anything is
+ * looked up.  Two open addressed hash tables index it by name and by
+ * ifindex, so checking an interface exists or reading its address costs
+ * no socket and no WireGuard peer dump.  Sending a batch flushes it,
+ * anything else changing interfaces calls link_cache_flush().
+ *
+ * Routes are added with a protocol of wgnet's own, LINK_RTPROT, so they
+ * can be told apart from ones an admin or a PostUp hook added with 'ip
+ * route add', which uses 'boot'.  A route sync dumps the interface's
+ * routes of our protocol only and deletes the ones no longer wanted in
+ * the same batch that adds the new ones.
+ *
+ ********************************************************************/
+
+#include "defs.h"
+#include "link.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#include <linux/rtnetlink.h>
+#include <linux/if_addr.h>
+#include <linux/if_link.h>
+
+#include "mnl.h"
+
+// Definitions
+// ----------------------------------------------------------------------------
+
+// Room reserved for each message, all of them are far smaller
+#define LINK_MSG_RESERVE    256
+#define LINK_RECV_BUFFER    16384
+#define LINK_ACK_TIMEOUT    5
+
+// Route protocol marking the routes wgnet added, 'ip route' shows it as
+// 'proto 87'.  Above RTPROT_STATIC is left to user space, and no routing
+// daemon in rt_protos uses this one
+#define LINK_RTPROT         87
+
+// FNV-1a for the name index
+#define FNV_OFFSET          0x811c9dc5U
+#define FNV_PRIME           0x01000193U
+
+// Types
+// ----------------------------------------------------------------------------
+
+// Routes found on the interface by a dump
+typedef struct {
+    int index;
+    link_addr_t * routes;
+    int num;
+    int max;
+} link_dump_t;
+
+// Every interface, with both indexes holding positions in links plus
+// one, 0 for an empty slot.  Sized to a power of two at least twice the
+// number of links so probes stay short
+typedef struct {
+    link_info_t * links;
+    int num;
+    int max;
+    int * by_name;
+    int * by_index;
+    unsigned int mask;
+    bool filled;
+} link_cache_t;
+
+// Variables
+// ----------------------------------------------------------------------------
+static bool b_dryrun = false;
+static link_cache_t cache;
+
+// Local functions
+// ----------------------------------------------------------------------------
+static struct nlmsghdr * _batch_msg(link_batch_t * b, uint16_t type, uint16_t flags,
+                                    link_addr_t * addr, int mtu);
+static bool _batch_route(link_batch_t * b, uint16_t type, uint16_t flags, link_addr_t * addr);
+static int _batch_window(link_batch_t * b, struct mnl_socket * nl, int first, int num, char * rbuf);
+static void _op_string(link_batch_t * b, link_op_t * op, char * out, int max_len);
+static bool _op_failed(link_batch_t * b, link_op_t * op, int error);
+static int _dump_routes(link_dump_t * dump);
+static int _route_cb(const struct nlmsghdr * nlh, void * data);
+static int _route_attr_cb(const struct nlattr * attr, void * data);
+static int _cmp_addr(const void * a, const void * b);
+static int _addr_len(link_addr_t * addr);
+static bool _cache_fill();
+static int _cache_dump(struct mnl_socket * nl, char * buf, uint16_t type, mnl_cb_t cb);
+static int _cache_link_cb(const struct nlmsghdr * nlh, void * data);
+static int _cache_addr_cb(const struct nlmsghdr * nlh, void * data);
+static int _link_attr_cb(const struct nlattr * attr, void * data);
+static int _info_attr_cb(const struct nlattr * attr, void * data);
+static int _addr_attr_cb(const struct nlattr * attr, void * data);
+static bool _cache_index();
+static link_info_t * _find_name(char * name);
+static link_info_t * _find_index(int index);
+static uint32_t _hash_name(const char * name);
+
+// Public functions
+// ----------------------------------------------------------------------------
+void link_enable_dryrun()
+{
+    b_dryrun = true;
+}
+
+void link_addr_string(link_addr_t * addr, char * out, int max_len)
+{
+    char ip[INET6_ADDRSTRLEN];
+
+    inet_ntop(addr->family,&addr->ip6,ip,sizeof(ip));
+    snprintf(out,max_len,"%s/%d",ip,addr->cidr);
+    return;
+}
+
+link_info_t * link_get(char * name)
+{
+    if(!name || !_cache_fill()) return NULL;
+    return _find_name(name);
+}
+
+link_info_t * link_get_index(int index)
+{
+    if(!_cache_fill()) return NULL;
+    return _find_index(index);
+}
+
+void link_cache_flush()
+{
+    free(cache.links);
+    free(cache.by_name);
+    free(cache.by_index);
+    memset(&cache,0,sizeof(cache));
+    return;
+}
+
+uint32_t get_ip_of_interface(char * iface)
+{
+    link_info_t * link = link_get(iface);
+    return link ? link->addr.s_addr : 0;
+}
+
+uint32_t get_netmask_of_interface(char * iface)
+{
+    link_info_t * link = link_get(iface);
+    if(!link || !link->cidr) return 0;
+    return htonl(0xFFFFFFFFU << (32-link->cidr));
+}
+
+uint16_t cidr_from_netmask(uint32_t netmask)
+{
+    int x=0;
+    while(netmask&0x1){
+        x++;
+        netmask>>=1;
+    }
+    return x;
+}
+
+void cidr_of_interface(char * iface, char * out, int max_len)
+{
+    link_info_t * link = link_get(iface);
+    char ip[INET_ADDRSTRLEN] = "0.0.0.0";
+
+    if(link) inet_ntop(AF_INET,&link->addr,ip,sizeof(ip));
+    snprintf(out,max_len,"%s/%d",ip,(link?link->cidr:0));
+    return;
+}
+
+bool link_batch_init(link_batch_t * b, char * iface)
+{
+    link_info_t * link;
+
+    memset(b,0,sizeof(link_batch_t));
+    snprintf(b->iface,sizeof(b->iface),"%s",iface);
+    b->first_seq = time(NULL);
+
+    // In a dry run the interface may only be pretend created
+    link = link_get(iface);
+    b->index = link ? link->index : 0;
+    if(!b->index && !b_dryrun){
+        printf("Error, no interface %s\n",iface);
+        return false;
+    }
+    return true;
+}
+
+void link_batch_free(link_batch_t * b)
+{
+    free(b->buf);
+    free(b->ops);
+    memset(b,0,sizeof(link_batch_t));
+    return;
+}
+
+bool link_batch_add_address(link_batch_t * b, link_addr_t * addr)
+{
+    struct nlmsghdr * nlh;
+    struct ifaddrmsg * ifa;
+
+    nlh = _batch_msg(b,RTM_NEWADDR,NLM_F_CREATE | NLM_F_EXCL,addr,0);
+    if(!nlh) return false;
+    ifa = mnl_nlmsg_put_extra_header(nlh,sizeof(struct ifaddrmsg));
+    ifa->ifa_family = addr->family;
+    ifa->ifa_prefixlen = addr->cidr;
+    ifa->ifa_scope = RT_SCOPE_UNIVERSE;
+    ifa->ifa_index = b->index;
+    mnl_attr_put(nlh,IFA_LOCAL,_addr_len(addr),&addr->ip6);
+    mnl_attr_put(nlh,IFA_ADDRESS,_addr_len(addr),&addr->ip6);
+    b->len += MNL_ALIGN(nlh->nlmsg_len);
+    return true;
+}
+
+bool link_batch_add_route(link_batch_t * b, link_addr_t * addr)
+{
+    return _batch_route(b,RTM_NEWROUTE,NLM_F_CREATE | NLM_F_EXCL,addr);
+}
+
+bool link_batch_del_route(link_batch_t * b, link_addr_t * addr)
+{
+    return _batch_route(b,RTM_DELROUTE,0,addr);
+}
+
+bool link_batch_set_up(link_batch_t * b, int mtu)
+{
+    struct nlmsghdr * nlh;
+    struct ifinfomsg * ifi;
+
+    nlh = _batch_msg(b,RTM_NEWLINK,0,NULL,mtu);
+    if(!nlh) return false;
+    ifi = mnl_nlmsg_put_extra_header(nlh,sizeof(struct ifinfomsg));
+    ifi->ifi_family = AF_UNSPEC;
+    ifi->ifi_index = b->index;
+    ifi->ifi_flags = IFF_UP;
+    ifi->ifi_change = IFF_UP;
+    if(mtu) mnl_attr_put_u32(nlh,IFLA_MTU,mtu);
+    b->len += MNL_ALIGN(nlh->nlmsg_len);
+    return true;
+}
+
+int link_batch_send(link_batch_t * b)
+{
+    struct mnl_socket * nl;
+    char * rbuf;
+    int size;
+    int failed = 0;
+    int ret = 0;
+    int x;
+
+    if(g_verbose) printf("LINK: sending %d messages, %zu bytes\n",b->num_ops,b->len);
+    if(b_dryrun || !b->num_ops) return 0;
+
+    link_cache_flush();
+    nl = mnl_socket_open(NETLINK_ROUTE);
+    if(!nl){
+        printf("Error opening rtnetlink socket: %s\n",strerror(errno));
+        return -errno;
+    }
+    if(mnl_socket_bind(nl,0,MNL_SOCKET_AUTOPID) < 0){
+        ret = -errno;
+        goto send_end;
+    }
+
+    // A whole window of refusals has to fit, and a window has to go in
+    // a single send
+    size = LINK_BATCH_WINDOW*LINK_MSG_RESERVE;
+    if(setsockopt(nl->fd,SOL_SOCKET,SO_RCVBUFFORCE,&size,sizeof(size)) < 0)
+        setsockopt(nl->fd,SOL_SOCKET,SO_RCVBUF,&size,sizeof(size));
+    if(setsockopt(nl->fd,SOL_SOCKET,SO_SNDBUFFORCE,&size,sizeof(size)) < 0)
+        setsockopt(nl->fd,SOL_SOCKET,SO_SNDBUF,&size,sizeof(size));
+
+    rbuf = malloc(LINK_RECV_BUFFER);
+    if(!rbuf){
+        ret = -ENOMEM;
+        goto send_end;
+    }
+
+    for(x=0;x<b->num_ops;x+=LINK_BATCH_WINDOW)
+    {
+        int num = b->num_ops-x;
+        if(num>LINK_BATCH_WINDOW) num = LINK_BATCH_WINDOW;
+        ret = _batch_window(b,nl,x,num,rbuf);
+        if(ret<0) break;
+        failed += ret;
+    }
+    if(ret>=0) ret = failed;
+    free(rbuf);
+
+send_end:
+    if(ret<0) printf("Error sending rtnetlink requests for %s: %s\n",b->iface,strerror(-ret));
+    mnl_socket_close(nl);
+    return ret;
+}
+
+int link_sync_routes(char * iface, link_addr_t * want, int num_want)
+{
+    link_batch_t b;
+    link_dump_t dump;
+    link_addr_t * sorted = NULL;
+    int added = 0, removed = 0, kept = 0;
+    int ret = -ENOMEM;
+    int x,y,cmp;
+
+    if(!link_batch_init(&b,iface)) return -ENODEV;
+    memset(&dump,0,sizeof(dump));
+    dump.index = b.index;
+    if(b.index && _dump_routes(&dump)<0){
+        ret = -errno;
+        printf("Error reading routes of %s: %s\n",iface,strerror(errno));
+        goto sync_end;
+    }
+
+    if(num_want){
+        sorted = malloc(num_want*sizeof(link_addr_t));
+        if(!sorted) goto sync_end;
+        memcpy(sorted,want,num_want*sizeof(link_addr_t));
+        qsort(sorted,num_want,sizeof(link_addr_t),_cmp_addr);
+    }
+    if(dump.num) qsort(dump.routes,dump.num,sizeof(link_addr_t),_cmp_addr);
+
+    // Walk both sorted lists together.  Deletes are queued as they are
+    // found, before any add, so a route can't collide with an old one
+    for(x=0,y=0;x<dump.num;)
+    {
+        cmp = (y<num_want) ? _cmp_addr(&dump.routes[x],&sorted[y]) : -1;
+        if(cmp==0){
+            kept++;
+            x++;
+            y++;
+            continue;
+        }
+        if(cmp>0){
+            y++;
+            continue;
+        }
+        if(!link_batch_del_route(&b,&dump.routes[x])) goto sync_end;
+        removed++;
+        x++;
+    }
+    for(x=0,y=0;y<num_want;y++)
+    {
+        // Skip duplicates in want, and ones already there
+        if(y>0 && _cmp_addr(&sorted[y-1],&sorted[y])==0) continue;
+        while(x<dump.num && _cmp_addr(&dump.routes[x],&sorted[y])<0) x++;
+        if(x<dump.num && _cmp_addr(&dump.routes[x],&sorted[y])==0) continue;
+        if(!link_batch_add_route(&b,&sorted[y])) goto sync_end;
+        added++;
+    }
+
+    ret = link_batch_send(&b);
+    if(ret>=0) printf("%s: %d routes added, %d removed, %d unchanged\n",
+                      iface,added,removed,kept);
+
+sync_end:
+    free(sorted);
+    free(dump.routes);
+    link_batch_free(&b);
+    return ret;
+}
+
+// Private functions
+// ----------------------------------------------------------------------------
+
+// Start a message at the end of the buffer, the caller adds the body and
+// then the message's length to b->len
+static struct nlmsghdr * _batch_msg(link_batch_t * b, uint16_t type, uint16_t flags,
+                                    link_addr_t * addr, int mtu)
+{
+    struct nlmsghdr * nlh;
+    link_op_t * op;
+    char str[200];
+
+    if(b->cap-b->len < LINK_MSG_RESERVE)
+    {
+        size_t cap = b->cap ? b->cap*2 : 64*LINK_MSG_RESERVE;
+        char * buf = realloc(b->buf,cap);
+        if(!buf) goto msg_err;
+        b->buf = buf;
+        b->cap = cap;
+    }
+    if(b->num_ops==b->max_ops)
+    {
+        int max = b->max_ops ? b->max_ops*2 : 64;
+        link_op_t * ops = realloc(b->ops,max*sizeof(link_op_t));
+        if(!ops) goto msg_err;
+        b->ops = ops;
+        b->max_ops = max;
+    }
+
+    op = &b->ops[b->num_ops];
+    memset(op,0,sizeof(link_op_t));
+    op->type = type;
+    if(addr) op->addr = *addr;
+    op->mtu = mtu;
+    op->offset = b->len;
+
+    nlh = mnl_nlmsg_put_header(b->buf+b->len);
+    nlh->nlmsg_type = type;
+    nlh->nlmsg_flags = NLM_F_REQUEST | flags;
+    nlh->nlmsg_seq = b->first_seq+b->num_ops;
+    b->num_ops++;
+
+    if(b_dryrun || g_verbose){
+        _op_string(b,op,str,sizeof(str));
+        printf("LINK: %s\n",str);
+    }
+    return nlh;
+
+msg_err:
+    printf("Error, out of memory building rtnetlink requests\n");
+    return NULL;
+}
+
+static bool _batch_route(link_batch_t * b, uint16_t type, uint16_t flags, link_addr_t * addr)
+{
+    struct nlmsghdr * nlh;
+    struct rtmsg * rtm;
+
+    nlh = _batch_msg(b,type,flags,addr,0);
+    if(!nlh) return false;
+    rtm = mnl_nlmsg_put_extra_header(nlh,sizeof(struct rtmsg));
+    rtm->rtm_family = addr->family;
+    rtm->rtm_dst_len = addr->cidr;
+    rtm->rtm_table = RT_TABLE_MAIN;
+    rtm->rtm_protocol = LINK_RTPROT;
+    rtm->rtm_scope = RT_SCOPE_LINK;
+    rtm->rtm_type = RTN_UNICAST;
+    mnl_attr_put(nlh,RTA_DST,_addr_len(addr),&addr->ip6);
+    mnl_attr_put_u32(nlh,RTA_OIF,b->index);
+    b->len += MNL_ALIGN(nlh->nlmsg_len);
+    return true;
+}
+
+// Send num messages from op first in one go and read back until the last
+// one is ACKed.  Returns how many were refused, or -errno
+static int _batch_window(link_batch_t * b, struct mnl_socket * nl, int first, int num, char * rbuf)
+{
+    struct timeval tv = { LINK_ACK_TIMEOUT, 0 };
+    struct nlmsghdr * nlh;
+    size_t start, end;
+    uint32_t ack_seq;
+    ssize_t len;
+    int failed = 0;
+
+    start = b->ops[first].offset;
+    end = (first+num<b->num_ops) ? b->ops[first+num].offset : b->len;
+    nlh = (struct nlmsghdr *)(b->buf+b->ops[first+num-1].offset);
+    nlh->nlmsg_flags |= NLM_F_ACK;
+    ack_seq = nlh->nlmsg_seq;
+
+    setsockopt(nl->fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+    if(mnl_socket_sendto(nl,b->buf+start,end-start) < 0) return -errno;
+
+    while((len = mnl_socket_recvfrom(nl,rbuf,LINK_RECV_BUFFER)) > 0)
+    {
+        int left = len;
+        nlh = (struct nlmsghdr *)rbuf;
+        while(mnl_nlmsg_ok(nlh,left))
+        {
+            if(nlh->nlmsg_type==NLMSG_ERROR)
+            {
+                const struct nlmsgerr * err = mnl_nlmsg_get_payload(nlh);
+                uint32_t x = nlh->nlmsg_seq-b->first_seq;
+
+                if(err->error && x<(uint32_t)b->num_ops && _op_failed(b,&b->ops[x],-err->error))
+                    failed++;
+                if(nlh->nlmsg_seq==ack_seq) return failed;
+            }
+            nlh = mnl_nlmsg_next(nlh,&left);
+        }
+    }
+    return (len<0) ? -errno : -EPROTO;
+}
+
+static void _op_string(link_batch_t * b, link_op_t * op, char * out, int max_len)
+{
+    char addr[INET6_ADDRSTRLEN+4];
+
+    link_addr_string(&op->addr,addr,sizeof(addr));
+    switch(op->type)
+    {
+    case RTM_NEWADDR:
+        snprintf(out,max_len,"address add %s dev %s",addr,b->iface);
+        break;
+    case RTM_NEWROUTE:
+        snprintf(out,max_len,"route add %s dev %s",addr,b->iface);
+        break;
+    case RTM_DELROUTE:
+        snprintf(out,max_len,"route del %s dev %s",addr,b->iface);
+        break;
+    case RTM_NEWLINK:
+        if(op->mtu) snprintf(out,max_len,"link set dev %s mtu %d up",b->iface,op->mtu);
+        else snprintf(out,max_len,"link set dev %s up",b->iface);
+        break;
+    default:
+        snprintf(out,max_len,"message %d for %s",op->type,b->iface);
+        break;
+    }
+    return;
+}
+
+// Report a refused request, true if it counts as a failure
+static bool _op_failed(link_batch_t * b, link_op_t * op, int error)
+{
+    char str[200];
+
+    if(op->type==RTM_NEWROUTE && error==EEXIST) return false;
+    if(op->type==RTM_DELROUTE && error==ESRCH) return false;
+
+    _op_string(b,op,str,sizeof(str));
+    printf("Error, %s: %s\n",str,strerror(error));
+    return true;
+}
+
+static int _dump_routes(link_dump_t * dump)
+{
+    struct mnl_socket * nl;
+    struct nlmsghdr * nlh;
+    struct rtmsg * rtm;
+    struct timeval tv = { LINK_ACK_TIMEOUT, 0 };
+    char * buf;
+    uint32_t seq = time(NULL);
+    ssize_t len;
+    int ret = -1;
+
+    buf = malloc(LINK_RECV_BUFFER);
+    if(!buf) return -1;
+
+    nl = mnl_socket_open(NETLINK_ROUTE);
+    if(!nl){
+        free(buf);
+        return -1;
+    }
+    if(mnl_socket_bind(nl,0,MNL_SOCKET_AUTOPID) < 0) goto dump_end;
+    setsockopt(nl->fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+
+    nlh = mnl_nlmsg_put_header(buf);
+    nlh->nlmsg_type = RTM_GETROUTE;
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    nlh->nlmsg_seq = seq;
+    rtm = mnl_nlmsg_put_extra_header(nlh,sizeof(struct rtmsg));
+    rtm->rtm_family = AF_UNSPEC;
+    if(mnl_socket_sendto(nl,nlh,nlh->nlmsg_len) < 0) goto dump_end;
+
+    while((len = mnl_socket_recvfrom(nl,buf,LINK_RECV_BUFFER)) > 0)
+    {
+        ret = mnl_cb_run(buf,len,seq,mnl_socket_get_portid(nl),_route_cb,dump);
+        if(ret<=0) break;
+    }
+
+dump_end:
+    mnl_socket_close(nl);
+    free(buf);
+    return ret;
+}
+
+// Keep the interface's main table routes that wgnet added
+static int _route_cb(const struct nlmsghdr * nlh, void * data)
+{
+    link_dump_t * dump = data;
+    struct rtmsg * rtm = mnl_nlmsg_get_payload(nlh);
+    const struct nlattr * tb[RTA_MAX+1];
+    link_addr_t * route;
+
+    if(rtm->rtm_table!=RT_TABLE_MAIN || rtm->rtm_protocol!=LINK_RTPROT ||
+       rtm->rtm_type!=RTN_UNICAST) return MNL_CB_OK;
+    if(rtm->rtm_family!=AF_INET && rtm->rtm_family!=AF_INET6) return MNL_CB_OK;
+
+    memset(tb,0,sizeof(tb));
+    mnl_attr_parse(nlh,sizeof(struct rtmsg),_route_attr_cb,tb);
+    if(!tb[RTA_OIF] || (int)mnl_attr_get_u32(tb[RTA_OIF])!=dump->index) return MNL_CB_OK;
+
+    if(dump->num==dump->max)
+    {
+        int max = dump->max ? dump->max*2 : 64;
+        link_addr_t * routes = realloc(dump->routes,max*sizeof(link_addr_t));
+        if(!routes){
+            errno = ENOMEM;
+            return MNL_CB_ERROR;
+        }
+        dump->routes = routes;
+        dump->max = max;
+    }
+    route = &dump->routes[dump->num++];
+    memset(route,0,sizeof(link_addr_t));
+    route->family = rtm->rtm_family;
+    route->cidr = rtm->rtm_dst_len;
+    if(tb[RTA_DST]) memcpy(&route->ip6,mnl_attr_get_payload(tb[RTA_DST]),_addr_len(route));
+    return MNL_CB_OK;
+}
+
+static int _route_attr_cb(const struct nlattr * attr, void * data)
+{
+    const struct nlattr ** tb = data;
+    uint16_t type = mnl_attr_get_type(attr);
+
+    if(mnl_attr_type_valid(attr,RTA_MAX) < 0) return MNL_CB_OK;
+    if(type==RTA_DST && mnl_attr_get_payload_len(attr)>sizeof(struct in6_addr)) return MNL_CB_OK;
+    tb[type] = attr;
+    return MNL_CB_OK;
+}
+
+// Orders by family, prefix length then address
+static int _cmp_addr(const void * a, const void * b)
+{
+    const link_addr_t * x = a;
+    const link_addr_t * y = b;
+
+    if(x->family!=y->family) return (x->family<y->family) ? -1 : 1;
+    if(x->cidr!=y->cidr) return (x->cidr<y->cidr) ? -1 : 1;
+    return memcmp(&x->ip6,&y->ip6,(x->family==AF_INET)?sizeof(x->ip4):sizeof(x->ip6));
+}
+
+static int _addr_len(link_addr_t * addr)
+{
+    return (addr->family==AF_INET) ? sizeof(addr->ip4) : sizeof(addr->ip6);
+}
+
+// Dump every link and IPv4 address into the cache, once
+static bool _cache_fill()
+{
+    struct mnl_socket * nl;
+    struct timeval tv = { LINK_ACK_TIMEOUT, 0 };
+    char * buf;
+    bool ret = false;
+
+    if(cache.filled) return true;
+
+    buf = malloc(LINK_RECV_BUFFER);
+    if(!buf) return false;
+    nl = mnl_socket_open(NETLINK_ROUTE);
+    if(!nl) goto fill_end;
+    if(mnl_socket_bind(nl,0,MNL_SOCKET_AUTOPID) < 0) goto fill_close;
+    setsockopt(nl->fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+
+    // Addresses after links, they are matched to them by index
+    if(_cache_dump(nl,buf,RTM_GETLINK,_cache_link_cb)<0) goto fill_close;
+    if(!_cache_index()) goto fill_close;
+    if(_cache_dump(nl,buf,RTM_GETADDR,_cache_addr_cb)<0) goto fill_close;
+    if(g_verbose) printf("LINK: %d interfaces cached\n",cache.num);
+    cache.filled = true;
+    ret = true;
+
+fill_close:
+    mnl_socket_close(nl);
+fill_end:
+    if(!ret){
+        printf("Error reading network interfaces: %s\n",strerror(errno));
+        link_cache_flush();
+    }
+    free(buf);
+    return ret;
+}
+
+static int _cache_dump(struct mnl_socket * nl, char * buf, uint16_t type, mnl_cb_t cb)
+{
+    struct nlmsghdr * nlh;
+    struct rtgenmsg * rtg;
+    uint32_t seq = time(NULL)+type;
+    ssize_t len;
+    int ret = -1;
+
+    nlh = mnl_nlmsg_put_header(buf);
+    nlh->nlmsg_type = type;
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    nlh->nlmsg_seq = seq;
+    rtg = mnl_nlmsg_put_extra_header(nlh,sizeof(struct rtgenmsg));
+    rtg->rtgen_family = (type==RTM_GETADDR) ? AF_INET : AF_UNSPEC;
+    if(mnl_socket_sendto(nl,nlh,nlh->nlmsg_len) < 0) return -1;
+
+    while((len = mnl_socket_recvfrom(nl,buf,LINK_RECV_BUFFER)) > 0)
+    {
+        ret = mnl_cb_run(buf,len,seq,mnl_socket_get_portid(nl),cb,NULL);
+        if(ret<=0) break;
+    }
+    return ret;
+}
+
+static int _cache_link_cb(const struct nlmsghdr * nlh, void * data)
+{
+    struct ifinfomsg * ifi = mnl_nlmsg_get_payload(nlh);
+    const struct nlattr * tb[IFLA_MAX+1];
+    const struct nlattr * info[IFLA_INFO_MAX+1];
+    link_info_t * link;
+
+    memset(tb,0,sizeof(tb));
+    mnl_attr_parse(nlh,sizeof(struct ifinfomsg),_link_attr_cb,tb);
+    if(!tb[IFLA_IFNAME]) return MNL_CB_OK;
+
+    if(cache.num==cache.max)
+    {
+        int max = cache.max ? cache.max*2 : 16;
+        link_info_t * links = realloc(cache.links,max*sizeof(link_info_t));
+        if(!links){
+            errno = ENOMEM;
+            return MNL_CB_ERROR;
+        }
+        cache.links = links;
+        cache.max = max;
+    }
+    link = &cache.links[cache.num++];
+    memset(link,0,sizeof(link_info_t));
+    snprintf(link->name,sizeof(link->name),"%s",mnl_attr_get_str(tb[IFLA_IFNAME]));
+    link->index = ifi->ifi_index;
+    link->flags = ifi->ifi_flags;
+    if(tb[IFLA_MTU]) link->mtu = mnl_attr_get_u32(tb[IFLA_MTU]);
+    if(tb[IFLA_LINKINFO])
+    {
+        memset(info,0,sizeof(info));
+        mnl_attr_parse_nested(tb[IFLA_LINKINFO],_info_attr_cb,info);
+        if(info[IFLA_INFO_KIND])
+            snprintf(link->kind,sizeof(link->kind),"%s",mnl_attr_get_str(info[IFLA_INFO_KIND]));
+    }
+    return MNL_CB_OK;
+}
+
+// First address of each interface that isn't a secondary one
+static int _cache_addr_cb(const struct nlmsghdr * nlh, void * data)
+{
+    struct ifaddrmsg * ifa = mnl_nlmsg_get_payload(nlh);
+    const struct nlattr * tb[IFA_MAX+1];
+    link_info_t * link;
+
+    if(ifa->ifa_family!=AF_INET || (ifa->ifa_flags & IFA_F_SECONDARY)) return MNL_CB_OK;
+    link = _find_index(ifa->ifa_index);
+    if(!link || link->addr.s_addr) return MNL_CB_OK;
+
+    memset(tb,0,sizeof(tb));
+    mnl_attr_parse(nlh,sizeof(struct ifaddrmsg),_addr_attr_cb,tb);
+    if(tb[IFA_LOCAL]) memcpy(&link->addr,mnl_attr_get_payload(tb[IFA_LOCAL]),sizeof(link->addr));
+    else if(tb[IFA_ADDRESS]) memcpy(&link->addr,mnl_attr_get_payload(tb[IFA_ADDRESS]),sizeof(link->addr));
+    link->cidr = ifa->ifa_prefixlen;
+    return MNL_CB_OK;
+}
+
+static int _link_attr_cb(const struct nlattr * attr, void * data)
+{
+    const struct nlattr ** tb = data;
+    uint16_t type = mnl_attr_get_type(attr);
+
+    if(mnl_attr_type_valid(attr,IFLA_MAX) < 0) return MNL_CB_OK;
+    if(type==IFLA_IFNAME && mnl_attr_validate(attr,MNL_TYPE_STRING) < 0) return MNL_CB_OK;
+    if(type==IFLA_MTU && mnl_attr_validate(attr,MNL_TYPE_U32) < 0) return MNL_CB_OK;
+    tb[type] = attr;
+    return MNL_CB_OK;
+}
+
+static int _info_attr_cb(const struct nlattr * attr, void * data)
+{
+    const struct nlattr ** tb = data;
+    uint16_t type = mnl_attr_get_type(attr);
+
+    if(mnl_attr_type_valid(attr,IFLA_INFO_MAX) < 0) return MNL_CB_OK;
+    if(type==IFLA_INFO_KIND && mnl_attr_validate(attr,MNL_TYPE_STRING) < 0) return MNL_CB_OK;
+    tb[type] = attr;
+    return MNL_CB_OK;
+}
+
+static int _addr_attr_cb(const struct nlattr * attr, void * data)
+{
+    const struct nlattr ** tb = data;
+    uint16_t type = mnl_attr_get_type(attr);
+
+    if(mnl_attr_type_valid(attr,IFA_MAX) < 0) return MNL_CB_OK;
+    if((type==IFA_LOCAL || type==IFA_ADDRESS) &&
+       mnl_attr_get_payload_len(attr)!=sizeof(struct in_addr)) return MNL_CB_OK;
+    tb[type] = attr;
+    return MNL_CB_OK;
+}
+
+// Build both hash indexes over the dumped links
+static bool _cache_index()
+{
+    unsigned int size = 16;
+    unsigned int slot;
+    int x;
+
+    while(size < (unsigned int)cache.num*2) size *= 2;
+    cache.by_name = calloc(size,sizeof(int));
+    cache.by_index = calloc(size,sizeof(int));
+    if(!cache.by_name || !cache.by_index){
+        errno = ENOMEM;
+        return false;
+    }
+    cache.mask = size-1;
+
+    for(x=0;x<cache.num;x++)
+    {
+        for(slot=_hash_name(cache.links[x].name)&cache.mask;cache.by_name[slot];slot=(slot+1)&cache.mask);
+        cache.by_name[slot] = x+1;
+        for(slot=cache.links[x].index&cache.mask;cache.by_index[slot];slot=(slot+1)&cache.mask);
+        cache.by_index[slot] = x+1;
+    }
+    return true;
+}
+
+static link_info_t * _find_name(char * name)
+{
+    unsigned int slot;
+    int pos;
+
+    if(!cache.num) return NULL;
+    for(slot=_hash_name(name)&cache.mask;(pos=cache.by_name[slot]);slot=(slot+1)&cache.mask)
+        if(strcmp(cache.links[pos-1].name,name)==0) return &cache.links[pos-1];
+    return NULL;
+}
+
+static link_info_t * _find_index(int index)
+{
+    unsigned int slot;
+    int pos;
+
+    if(!cache.num) return NULL;
+    for(slot=index&cache.mask;(pos=cache.by_index[slot]);slot=(slot+1)&cache.mask)
+        if(cache.links[pos-1].index==index) return &cache.links[pos-1];
+    return NULL;
+}
+
+static uint32_t _hash_name(const char * name)
+{
+    uint32_t hash = FNV_OFFSET;
+
+    while(*name)
+    {
+        hash ^= (uint8_t)*name++;
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+// EOF
@@ -0,0 +1,117 @@
+/*********************************************************************
+wgnet WireGuard network utility
+
+Copyright (C) 2020 - Andrew Gaylo - drew@clisystems.com
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*******************************************************************/
+#ifndef __LINK_H__
+#define __LINK_H__
+
+#include <netinet/in.h>
+#include <net/if.h>
+
+// Messages sent before waiting for the kernel, only the last asks for an
+// ACK.  A refused request is reported whatever its flags
+#define LINK_BATCH_WINDOW   256
+
+// An interface address, or a route to a peer's allowed IPs
+typedef struct {
+    uint16_t family;            // AF_INET or AF_INET6
+    union {
+        struct in_addr ip4;
+        struct in6_addr ip6;
+    };
+    uint8_t cidr;
+} link_addr_t;
+
+// What the link cache knows about an interface
+typedef struct {
+    char name[IFNAMSIZ];
+    int index;
+    unsigned int flags;         // IFF_UP, IFF_RUNNING, ...
+    int mtu;
+    char kind[16];              // "wireguard", "veth", ... empty if none
+    struct in_addr addr;        // Primary IPv4 address, 0 if none
+    uint8_t cidr;
+} link_info_t;
+
+// One queued request, kept to report it if the kernel refuses it
+typedef struct {
+    uint16_t type;              // RTM_NEWADDR, RTM_NEWROUTE, ...
+    link_addr_t addr;
+    int mtu;
+    size_t offset;              // Of the message in the batch buffer
+} link_op_t;
+
+// Requests for one interface, packed into one buffer and sent in windows
+// of LINK_BATCH_WINDOW messages without waiting on each other
+typedef struct {
+    char iface[IFNAMSIZ];
+    int index;
+    uint32_t first_seq;
+    char * buf;
+    size_t len;
+    size_t cap;
+    link_op_t * ops;            // What each message does, by sequence number
+    int num_ops;
+    int max_ops;
+} link_batch_t;
+
+void link_enable_dryrun();
+
+// "address/cidr" of an address
+void link_addr_string(link_addr_t * addr, char * out, int max_len);
+
+// Interfaces by name or index, from one link and address dump made on
+// the first lookup.  NULL if there is no such interface.  Flush after
+// changing interfaces so the next lookup dumps them again
+link_info_t * link_get(char * name);
+link_info_t * link_get_index(int index);
+void link_cache_flush();
+
+// Start a batch for an existing interface, or one dry run will create
+bool link_batch_init(link_batch_t * b, char * iface);
+void link_batch_free(link_batch_t * b);
+
+// Queue requests, false only if out of memory.  The kernel runs them in
+// the order they were added
+bool link_batch_add_address(link_batch_t * b, link_addr_t * addr);
+bool link_batch_add_route(link_batch_t * b, link_addr_t * addr);
+bool link_batch_del_route(link_batch_t * b, link_addr_t * addr);
+
+// Set the MTU, unless 0, and bring the interface up
+bool link_batch_set_up(link_batch_t * b, int mtu);
+
+// Send everything queued and report each request the kernel refused.
+// Returns how many were refused, or -errno if the batch couldn't be sent.
+// A route that is already there counts as added, one already gone as
+// deleted
+int link_batch_send(link_batch_t * b);
+
+// Bring the interface's routes in line with want, deleting the ones wgnet
+// added that aren't wanted and adding the missing ones in one batch.
+// Routes added any other way are left alone.  Returns as link_batch_send()
+int link_sync_routes(char * iface, link_addr_t * want, int num_want);
+
+// Address lookups through the link cache, 0 if the interface or its
+// address is missing
+uint32_t get_ip_of_interface(char * iface);
+uint32_t get_netmask_of_interface(char * iface);
+uint16_t cidr_from_netmask(uint32_t netmask);
+void cidr_of_interface(char * iface, char * out, int max_len);
+
+#endif
@@ -81,10 +81,18 @@ void usage()
     printf("        new               Create a new config\n");
     printf("        up                Bring up the named config\n");
     printf("        down              Tear down the named config\n");
-    printf("        restart           Restart the named config, (reloads all parameters from config file)\n");
+    printf("        restart           Restart the named config, only applying what changed\n");
+    printf("        optimize          Reorder the accept rules so the busiest match first\n");
     printf("\n");
     printf("   --dryrun, -D     Dry run, don't actually do changes\n");
     printf("   --path, -P       Set the path of the config files\n");
+    printf("   --backend, -B    Firewall backend, iptables (default), restore or nft\n");
+    printf("   --sets, -S       Match firewall hosts and ports with one set lookup\n");
+    printf("   --hints, -H      With optimize, save the rule order for later 'up's\n");
+    printf("   --native, -N     Set up interfaces over netlink instead of wg-quick\n");
+    printf("   --format, -O     Status and listing output, text (default), json or csv\n");
+    printf("   --recv, -R       Netlink dump reads, batch=<n>,rcvbuf=<bytes>,peek,pipeline\n");
+    printf("   --all, -A        Show the status of every config's interface, and exit\n");
     printf("   -L               List config files and directory, and exit\n");
     printf("   -F               Force operations (overwrite for 'new' command)\n");
     printf("   --version, -V    Print version info and exit\n");
@@ -107,12 +115,20 @@ int main(int argc,char** argv)
     char command[20] = "status";
     bool force = false;
     bool list_files = false;
+    bool all = false;
     
     
     struct option longopts[] = {
     { "verbose", no_argument,       0, 'v' },
     { "dryrun", no_argument,       0, 'D' },
     { "path", required_argument,       0, 'P' },
+    { "backend", required_argument,       0, 'B' },
+    { "sets", no_argument,       0, 'S' },
+    { "hints", no_argument,       0, 'H' },
+    { "native", no_argument,       0, 'N' },
+    { "all", no_argument,       0, 'A' },
+    { "format", required_argument,       0, 'O' },
+    { "recv", required_argument,       0, 'R' },
     { "version", no_argument,       0, 'V' },
     { 0, 0, 0, 0 }
     };
@@ -147,7 +163,7 @@ int main(int argc,char** argv)
     // TODO: Loop over args once to get -v before processing others?
     
     // Process the command line options
-    while ((optchar = getopt_long(argc, argv, "DLFVvh?", \
+    while ((optchar = getopt_long(argc, argv, "DB:SHNAO:R:LFVvh?", \
            longopts, NULL)) != -1)
     {
        switch (optchar)
@@ -158,10 +174,31 @@ int main(int argc,char** argv)
        case 'P':
             conf_set_path(optarg);
             break;
+       case 'B':
+            if(!cmd_set_backend(optarg)) exit(1);
+            break;
+       case 'S':
+            cmd_enable_sets();
+            break;
+       case 'H':
+            cmd_enable_hints();
+            break;
+       case 'N':
+            cmd_enable_native();
+            break;
        case 'F':
             force = true;
             if(g_verbose) printf("Force = true\n");
             break;
+       case 'O':
+            if(!cmd_set_format(optarg)) exit(1);
+            break;
+       case 'R':
+            if(!cmd_set_recv(optarg)) exit(1);
+            break;
+       case 'A':
+           all = true;
+           break;
        case 'L':
            list_files = true;
            break;
@@ -184,6 +221,13 @@ int main(int argc,char** argv)
     signal(SIGINT, sigint_handler);
     signal(SIGTERM, sigint_handler);
 
+    // Status of every config at once, in place of any one config
+    if(all)
+    {
+        cmd_status_all();
+        exit(0);
+    }
+
     // Special case, no args, just list files and exit
     if(list_files)
     {
@@ -208,6 +252,8 @@ int main(int argc,char** argv)
         cmd_net_down(config, force);
     }else if(cmp_const(command,"restart")){
         cmd_net_restart(config, force);
+    }else if(cmp_const(command,"optimize")){
+        cmd_optimize(config);
 
     // Run tests?
     }else if(cmp_const(command,"test")){
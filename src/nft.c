@@ -0,0 +1,1171 @@
+/*********************************************************************
+wgnet WireGuard network utility
+
+Copyright (C) 2020 - Andrew Gaylo - drew@clisystems.com
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*******************************************************************/
+
+/*********************************************************************
+ *
+ * Overview:
+ *
+ * This file is the nftables firewall backend.  It talks to the kernel
+ * directly over NETLINK_NETFILTER using the mnl mini library from the
+ * wireguard source, no nft or iptables binary is involved.
+ *
+ * Each interface gets its own 'ip' family table holding a forward and
+ * an input base chain.  Every message for a ruleset is packed into one
+ * buffer between NFNL_MSG_BATCH_BEGIN and NFNL_MSG_BATCH_END, so the
+ * kernel applies the whole ruleset as a single transaction.
+ *
+ * If the ruleset has a host set it becomes a hashed 'ip daddr . tcp
+ * dport' set in the same table, and the rule marked match_set looks the
+ * packet up in it with a single lookup expression.
+ *
+ * Every rule carries its ID from ruleset_rule_id() as an nft comment in
+ * its userdata.  A reconcile dumps the table's rules, and in a single
+ * transaction deletes the ones no longer wanted by handle and inserts
+ * the new ones at their position, so rules that didn't change are never
+ * touched.
+ *
+ * Every rule also gets a counter, which 'optimize' reads back to put the
+ * busiest accept rules first.
+ *
+ * Compiled rules with a list of destinations or several ports match them
+ * with anonymous sets, 'ip daddr { a, b }' and 'tcp dport { 22, 80-90 }',
+ * so a merged rule stays a single rule here.
+ *
+ ********************************************************************/
+
+#include "defs.h"
+#include "nft.h"
+
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/time.h>
+#include <endian.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nf_tables.h>
+
+#include "mnl.h"
+
+// Definitions
+// ----------------------------------------------------------------------------
+
+// Room reserved for each message in the batch, rules are far smaller
+#define NFT_MSG_RESERVE     4096
+#define NFT_RECV_BUFFER     16384
+#define NFT_ACK_TIMEOUT     5
+
+// Header offsets for the payload expressions
+#define IPV4_DADDR_OFFSET   16
+#define TCP_DPORT_OFFSET    2
+
+// Name and key type of the host set, the type is the concatenation of
+// nft's ipv4_addr and inet_service types, each field padded to 32 bits
+#define NFT_SET_NAME        "hosts"
+#define NFT_SET_ID          1
+#define NFT_TYPE_IPADDR     7
+#define NFT_TYPE_SERVICE    13
+#define NFT_TYPE_BITS       6
+#define NFT_SET_KEY_LEN     8
+
+// The kernel numbers anonymous sets itself, rules find them by ID
+#define NFT_ANON_SET_NAME   "__set%d"
+#define NFT_ANON_SET_FLAGS  (NFT_SET_ANONYMOUS | NFT_SET_CONSTANT)
+
+// Elements per NEWSETELEM message, keeps each under NFT_MSG_RESERVE
+#define NFT_SET_CHUNK       100
+
+// Userdata TLV type nft uses for a rule comment
+#define NFT_UDATA_COMMENT   0
+#define NUM_BASE_CHAINS     ((int)(sizeof(base_chains)/sizeof(base_chains[0])))
+
+// Types
+// ----------------------------------------------------------------------------
+typedef struct {
+    char * buf;
+    size_t len;
+    size_t cap;
+    uint32_t first_seq;
+    uint32_t seq;
+    size_t last_msg;    // Offset of the last object message
+    int err_msg;        // Index of the message the kernel rejected
+    uint32_t set_id;    // Last set ID used in the batch
+    bool dryrun;
+} nft_batch_t;
+
+typedef struct {
+    const char * name;
+    uint32_t hook;
+} nft_chain_t;
+
+// What _rule_cb() fills, and the table its rules have to be in
+typedef struct {
+    const char * table;
+    ruleset_list_t * live;
+} nft_dump_t;
+
+// Variables
+// ----------------------------------------------------------------------------
+
+// Base chains created in every table, iptables chain names map onto these
+static const nft_chain_t base_chains[] = {
+    { "forward", NF_INET_FORWARD },
+    { "input", NF_INET_LOCAL_IN },
+};
+
+// Local functions
+// ----------------------------------------------------------------------------
+static bool _batch_init(nft_batch_t * b, bool dryrun);
+static void _batch_free(nft_batch_t * b);
+static struct nlmsghdr * _batch_msg(nft_batch_t * b, uint16_t type, uint16_t flags);
+static void _batch_msg_end(nft_batch_t * b, struct nlmsghdr * nlh);
+static int _batch_send(nft_batch_t * b);
+static int _dump_rules(char * table, ruleset_list_t * live);
+static int _rule_attr_cb(const struct nlattr * attr, void * data);
+static int _rule_cb(const struct nlmsghdr * nlh, void * data);
+static uint64_t _rule_packets(const struct nlattr * exprs);
+
+static void _table_name(ruleset_t * rs, char * out, int max_len);
+static const nft_chain_t * _base_chain(char * chain);
+static bool _parse_dest(char * dest, uint32_t * addr, uint32_t * mask);
+
+static void _put_expr_meta(struct nlmsghdr * nlh, uint32_t key, uint32_t dreg);
+static void _put_expr_cmp(struct nlmsghdr * nlh, uint32_t sreg, const void * data, size_t len);
+static void _put_expr_payload(struct nlmsghdr * nlh, uint32_t base, uint32_t offset, uint32_t len, uint32_t dreg);
+static void _put_expr_bitwise(struct nlmsghdr * nlh, uint32_t reg, const void * mask, size_t len);
+static void _put_expr_verdict(struct nlmsghdr * nlh, uint32_t verdict);
+static void _put_expr_counter(struct nlmsghdr * nlh);
+static void _put_expr_lookup(struct nlmsghdr * nlh, uint32_t sreg, const char * set, uint32_t set_id);
+
+static bool _add_table(nft_batch_t * b, char * table);
+static bool _add_set(nft_batch_t * b, char * table, const char * name, uint32_t id,
+                     uint32_t flags, uint32_t key_type, uint32_t key_len, int size);
+static bool _add_elems(nft_batch_t * b, char * table, const char * name, uint32_t id,
+                       const uint8_t * keys, const uint32_t * flags, uint32_t key_len, int num);
+static bool _add_host_set(nft_batch_t * b, char * table, ruleset_t * rs, bool refill);
+static uint32_t _add_dest_set(nft_batch_t * b, char * table, rule_t * rule);
+static uint32_t _add_port_set(nft_batch_t * b, char * table, rule_t * rule);
+static bool _add_rule(nft_batch_t * b, char * table, rule_t * rule, uint64_t before);
+static bool _del_rule(nft_batch_t * b, char * table, const char * chain, uint64_t handle);
+
+// Public functions
+// ----------------------------------------------------------------------------
+int nft_apply(ruleset_t * rs, bool dryrun)
+{
+    struct timespec start;
+    nft_batch_t b;
+    char table[NFT_TABLE_MAXNAMELEN];
+    int x;
+    int ret;
+
+    _table_name(rs,table,sizeof(table));
+    if(!_batch_init(&b,dryrun)) return -1;
+
+    if(!_add_table(&b,table)) goto nft_apply_err;
+    if(rs->num_set && !_add_host_set(&b,table,rs,false)) goto nft_apply_err;
+    for(x=0;x<rs->num_rules;x++)
+    {
+        if(!_add_rule(&b,table,&rs->rules[x],0)) goto nft_apply_err;
+    }
+
+    // The old table is deleted and the new one created in the same
+    // transaction, packets see one or the other
+    clock_gettime(CLOCK_MONOTONIC,&start);
+    ret = _batch_send(&b);
+    if(ret<0){
+        printf("Error, nftables rejected message %d of the batch: %s\n",b.err_msg,strerror(-ret));
+    }
+    else if(!dryrun) printf("Firewall: ruleset swapped in one transaction, %.3f ms\n",ruleset_elapsed_ms(&start));
+    _batch_free(&b);
+    return ret;
+
+nft_apply_err:
+    _batch_free(&b);
+    return -1;
+}
+
+int nft_reconcile(ruleset_t * rs, bool dryrun)
+{
+    struct timespec start;
+    nft_batch_t b;
+    ruleset_list_t live[NUM_BASE_CHAINS] = {{0}};
+    ruleset_list_t want[NUM_BASE_CHAINS] = {{0}};
+    char table[NFT_TABLE_MAXNAMELEN];
+    char id[RULESET_ID_LEN];
+    uint64_t before;
+    int added = 0, removed = 0, kept = 0;
+    int installed = 0;
+    int x,y,z;
+    int ret = -1;
+
+    _table_name(rs,table,sizeof(table));
+    if(_dump_rules(table,live)<0) goto reconcile_end;
+    for(x=0;x<NUM_BASE_CHAINS;x++) installed += live[x].num;
+
+    for(x=0;x<rs->num_rules;x++)
+    {
+        const nft_chain_t * chain = _base_chain(rs->rules[x].chain);
+        if(!chain){
+            printf("Error, chain '%s' has no nftables equivalent\n",rs->rules[x].chain);
+            goto reconcile_end;
+        }
+        ruleset_rule_id(&rs->rules[x],-1,id,sizeof(id));
+        y = chain-base_chains;
+        if(!ruleset_list_add(&want[y],"",id)) goto reconcile_end;
+        want[y].entries[want[y].num-1].rule = &rs->rules[x];
+    }
+
+    // Nothing there yet, or the rules staying would have to move, so
+    // replace the whole table.  That is one transaction as well
+    for(x=0;x<NUM_BASE_CHAINS && installed;x++)
+    {
+        if(!ruleset_diff(&live[x],&want[x])) installed = 0;
+    }
+    if(!installed)
+    {
+        if(g_verbose) printf("Table %s needs replacing, installing everything\n",table);
+        ret = nft_apply(rs,dryrun);
+        goto reconcile_end;
+    }
+
+    if(!_batch_init(&b,dryrun)) goto reconcile_end;
+
+    // Refill the host set in place, the new elements take effect together
+    // with the rule changes
+    if(rs->num_set && !_add_host_set(&b,table,rs,true)) goto reconcile_err;
+
+    for(x=0;x<NUM_BASE_CHAINS;x++)
+    {
+        for(y=0;y<live[x].num;y++)
+        {
+            if(live[x].entries[y].keep) continue;
+            if(!_del_rule(&b,table,base_chains[x].name,live[x].entries[y].handle)) goto reconcile_err;
+            removed++;
+        }
+
+        // New rules go in front of the next rule that stays, or at the
+        // end if none does
+        for(y=0;y<want[x].num;y++)
+        {
+            if(want[x].entries[y].keep){ kept++; continue; }
+            before = 0;
+            for(z=y+1;z<want[x].num && !before;z++)
+            {
+                if(want[x].entries[z].keep) before = want[x].entries[z].handle;
+            }
+            if(!_add_rule(&b,table,want[x].entries[y].rule,before)) goto reconcile_err;
+            added++;
+        }
+    }
+
+    printf("Firewall: %d rules added, %d removed, %d unchanged\n",added,removed,kept);
+    if(!added && !removed && !rs->num_set){
+        ret = 0;
+        goto reconcile_err;
+    }
+
+    // A rejected batch changed nothing, the set may just have outgrown
+    // the size it was created with, so replace the table instead
+    clock_gettime(CLOCK_MONOTONIC,&start);
+    ret = _batch_send(&b);
+    if(ret==0 && !dryrun) printf("Firewall: changes committed in one transaction, %.3f ms\n",ruleset_elapsed_ms(&start));
+    if(ret<0){
+        printf("nftables rejected the update (%s), replacing table %s\n",strerror(-ret),table);
+        ret = nft_apply(rs,dryrun);
+    }
+
+reconcile_err:
+    _batch_free(&b);
+reconcile_end:
+    for(x=0;x<NUM_BASE_CHAINS;x++)
+    {
+        ruleset_list_free(&live[x]);
+        ruleset_list_free(&want[x]);
+    }
+    return ret;
+}
+
+int nft_count_hits(ruleset_t * rs)
+{
+    ruleset_list_t live[NUM_BASE_CHAINS] = {{0}};
+    char table[NFT_TABLE_MAXNAMELEN];
+    char id[RULESET_ID_LEN];
+    int installed = 0;
+    int x,y,z;
+    int ret = -1;
+
+    _table_name(rs,table,sizeof(table));
+    if(_dump_rules(table,live)<0) goto count_end;
+    for(x=0;x<NUM_BASE_CHAINS;x++) installed += live[x].num;
+    if(!installed){
+        printf("No rules installed in table %s\n",table);
+        goto count_end;
+    }
+
+    // A handful of chains with few rules each after compiling, a plain
+    // search is enough
+    for(x=0;x<rs->num_rules;x++)
+    {
+        rs->rules[x].hits = 0;
+        ruleset_rule_id(&rs->rules[x],-1,id,sizeof(id));
+        for(y=0;y<NUM_BASE_CHAINS;y++)
+        {
+            for(z=0;z<live[y].num;z++)
+            {
+                if(strcmp(live[y].entries[z].id,id)==0) rs->rules[x].hits += live[y].entries[z].packets;
+            }
+        }
+    }
+    ret = 0;
+
+count_end:
+    for(x=0;x<NUM_BASE_CHAINS;x++) ruleset_list_free(&live[x]);
+    return ret;
+}
+
+int nft_remove(ruleset_t * rs, bool dryrun)
+{
+    nft_batch_t b;
+    struct nlmsghdr * nlh;
+    char table[NFT_TABLE_MAXNAMELEN];
+    int ret;
+
+    _table_name(rs,table,sizeof(table));
+    if(!_batch_init(&b,dryrun)) return -1;
+
+    // Deleting the table takes its chains and rules with it
+    if(b.dryrun || g_verbose) printf("NFT: delete table ip %s\n",table);
+    nlh = _batch_msg(&b,NFT_MSG_DELTABLE,0);
+    if(!nlh){ _batch_free(&b); return -1; }
+    mnl_attr_put_strz(nlh,NFTA_TABLE_NAME,table);
+    _batch_msg_end(&b,nlh);
+
+    ret = _batch_send(&b);
+    _batch_free(&b);
+
+    // Nothing to remove is not an error
+    if(ret==-ENOENT) ret = 0;
+    if(ret<0) printf("Error removing nftables table %s: %s\n",table,strerror(-ret));
+    return ret;
+}
+
+// Private functions
+// ----------------------------------------------------------------------------
+static bool _batch_init(nft_batch_t * b, bool dryrun)
+{
+    struct nlmsghdr * nlh;
+
+    memset(b,0,sizeof(nft_batch_t));
+    b->dryrun = dryrun;
+    b->first_seq = b->seq = time(NULL);
+    b->set_id = NFT_SET_ID;
+
+    nlh = _batch_msg(b,NFNL_MSG_BATCH_BEGIN,0);
+    if(!nlh) return false;
+    _batch_msg_end(b,nlh);
+    return true;
+}
+
+static void _batch_free(nft_batch_t * b)
+{
+    free(b->buf);
+    memset(b,0,sizeof(nft_batch_t));
+    return;
+}
+
+static struct nlmsghdr * _batch_msg(nft_batch_t * b, uint16_t type, uint16_t flags)
+{
+    struct nlmsghdr * nlh;
+    struct nfgenmsg * nfg;
+    bool batch = (type==NFNL_MSG_BATCH_BEGIN || type==NFNL_MSG_BATCH_END);
+
+    // Make sure the whole message fits before building it in place
+    if(b->cap-b->len < NFT_MSG_RESERVE)
+    {
+        size_t cap = b->cap ? b->cap*2 : 8*NFT_MSG_RESERVE;
+        char * buf = realloc(b->buf,cap);
+        if(!buf){
+            printf("Error, out of memory building nftables batch\n");
+            return NULL;
+        }
+        b->buf = buf;
+        b->cap = cap;
+    }
+
+    nlh = mnl_nlmsg_put_header(b->buf+b->len);
+    nlh->nlmsg_type = batch ? type : (NFNL_SUBSYS_NFTABLES << 8) | type;
+    nlh->nlmsg_flags = NLM_F_REQUEST | flags;
+    nlh->nlmsg_seq = b->seq++;
+
+    nfg = mnl_nlmsg_put_extra_header(nlh,sizeof(struct nfgenmsg));
+    nfg->nfgen_family = batch ? AF_UNSPEC : NFPROTO_IPV4;
+    nfg->version = NFNETLINK_V0;
+    nfg->res_id = batch ? htons(NFNL_SUBSYS_NFTABLES) : 0;
+    return nlh;
+}
+
+static void _batch_msg_end(nft_batch_t * b, struct nlmsghdr * nlh)
+{
+    if(nlh->nlmsg_type!=NFNL_MSG_BATCH_BEGIN && nlh->nlmsg_type!=NFNL_MSG_BATCH_END)
+        b->last_msg = b->len;
+    b->len += MNL_ALIGN(nlh->nlmsg_len);
+    return;
+}
+
+static int _batch_send(nft_batch_t * b)
+{
+    struct mnl_socket * nl;
+    struct nlmsghdr * nlh;
+    struct timeval tv = { NFT_ACK_TIMEOUT, 0 };
+    char * rbuf;
+    int on = 1;
+    int size;
+    int ret;
+    ssize_t len;
+    uint32_t ack_seq;
+
+    // Only the last message asks for an ACK, the kernel reports errors
+    // for any message in the batch regardless
+    nlh = (struct nlmsghdr *)(b->buf+b->last_msg);
+    nlh->nlmsg_flags |= NLM_F_ACK;
+    ack_seq = nlh->nlmsg_seq;
+    nlh = _batch_msg(b,NFNL_MSG_BATCH_END,0);
+    if(!nlh) return -ENOMEM;
+    _batch_msg_end(b,nlh);
+
+    if(g_verbose) printf("NFT: sending %d messages, %zu bytes\n",b->seq-b->first_seq,b->len);
+    if(b->dryrun) return 0;
+
+    nl = mnl_socket_open(NETLINK_NETFILTER);
+    if(!nl){
+        printf("Error opening netfilter socket, are you root?\n");
+        return -errno;
+    }
+    if(mnl_socket_bind(nl,0,MNL_SOCKET_AUTOPID) < 0){
+        ret = -errno;
+        goto nft_send_end;
+    }
+
+    // The batch has to go in a single send, make room for it
+    size = b->len + NFT_MSG_RESERVE;
+    if(setsockopt(nl->fd,SOL_SOCKET,SO_SNDBUFFORCE,&size,sizeof(size)) < 0)
+        setsockopt(nl->fd,SOL_SOCKET,SO_SNDBUF,&size,sizeof(size));
+    setsockopt(nl->fd,SOL_NETLINK,NETLINK_CAP_ACK,&on,sizeof(on));
+    setsockopt(nl->fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+
+    if(mnl_socket_sendto(nl,b->buf,b->len) < 0){
+        ret = -errno;
+        goto nft_send_end;
+    }
+
+    rbuf = malloc(NFT_RECV_BUFFER);
+    if(!rbuf){
+        ret = -ENOMEM;
+        goto nft_send_end;
+    }
+
+    // Wait for the ACK of the last message, or the first error
+    ret = -ETIMEDOUT;
+    while((len = mnl_socket_recvfrom(nl,rbuf,NFT_RECV_BUFFER)) > 0)
+    {
+        int left = len;
+        nlh = (struct nlmsghdr *)rbuf;
+        while(mnl_nlmsg_ok(nlh,left))
+        {
+            if(nlh->nlmsg_type==NLMSG_ERROR)
+            {
+                const struct nlmsgerr * err = mnl_nlmsg_get_payload(nlh);
+                if(err->error){
+                    ret = err->error;
+                    b->err_msg = nlh->nlmsg_seq-b->first_seq;
+                    goto nft_send_done;
+                }
+                if(nlh->nlmsg_seq==ack_seq){
+                    ret = 0;
+                    goto nft_send_done;
+                }
+            }
+            nlh = mnl_nlmsg_next(nlh,&left);
+        }
+    }
+    if(len<0) ret = -errno;
+
+nft_send_done:
+    free(rbuf);
+nft_send_end:
+    mnl_socket_close(nl);
+    return ret;
+}
+
+// Fills one list per base chain with the table's rules, in chain order.
+// A missing table leaves them empty
+static int _dump_rules(char * table, ruleset_list_t * live)
+{
+    struct mnl_socket * nl;
+    struct nlmsghdr * nlh;
+    struct nfgenmsg * nfg;
+    struct timeval tv = { NFT_ACK_TIMEOUT, 0 };
+    char * buf;
+    uint32_t seq = time(NULL);
+    nft_dump_t dump = { table, live };
+    ssize_t len;
+    int ret = -1;
+
+    buf = malloc(NFT_RECV_BUFFER);
+    if(!buf){
+        printf("Error, out of memory reading nftables rules\n");
+        return -1;
+    }
+
+    nl = mnl_socket_open(NETLINK_NETFILTER);
+    if(!nl){
+        printf("Error opening netfilter socket, are you root?\n");
+        free(buf);
+        return -1;
+    }
+    if(mnl_socket_bind(nl,0,MNL_SOCKET_AUTOPID) < 0) goto dump_end;
+    setsockopt(nl->fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+
+    nlh = mnl_nlmsg_put_header(buf);
+    nlh->nlmsg_type = (NFNL_SUBSYS_NFTABLES << 8) | NFT_MSG_GETRULE;
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    nlh->nlmsg_seq = seq;
+    nfg = mnl_nlmsg_put_extra_header(nlh,sizeof(struct nfgenmsg));
+    nfg->nfgen_family = NFPROTO_IPV4;
+    nfg->version = NFNETLINK_V0;
+    mnl_attr_put_strz(nlh,NFTA_RULE_TABLE,table);
+    if(mnl_socket_sendto(nl,nlh,nlh->nlmsg_len) < 0) goto dump_end;
+
+    while((len = mnl_socket_recvfrom(nl,buf,NFT_RECV_BUFFER)) > 0)
+    {
+        ret = mnl_cb_run(buf,len,seq,mnl_socket_get_portid(nl),_rule_cb,&dump);
+        if(ret<=0) break;
+    }
+    // No table, nothing installed
+    if(ret<0 && errno==ENOENT) ret = 0;
+    if(ret<0) printf("Error reading nftables rules of %s: %s\n",table,strerror(errno));
+
+dump_end:
+    mnl_socket_close(nl);
+    free(buf);
+    return ret;
+}
+
+static int _rule_attr_cb(const struct nlattr * attr, void * data)
+{
+    const struct nlattr ** tb = data;
+    int type = mnl_attr_get_type(attr);
+
+    if(type<=NFTA_RULE_MAX) tb[type] = attr;
+    return MNL_CB_OK;
+}
+
+static int _rule_cb(const struct nlmsghdr * nlh, void * data)
+{
+    nft_dump_t * dump = data;
+    ruleset_list_t * live = dump->live;
+    const struct nlattr * tb[NFTA_RULE_MAX+1] = {0};
+    const uint8_t * udata;
+    char id[RULESET_ID_LEN] = "";
+    const char * chain;
+    int len;
+    int x;
+
+    if(mnl_attr_parse(nlh,sizeof(struct nfgenmsg),_rule_attr_cb,tb) < 0) return MNL_CB_ERROR;
+    if(!tb[NFTA_RULE_CHAIN] || !tb[NFTA_RULE_HANDLE]) return MNL_CB_OK;
+
+    // Older kernels ignore the table in the dump request and send every
+    // rule, other tables can have forward and input chains too
+    if(!tb[NFTA_RULE_TABLE] || strcmp(mnl_attr_get_str(tb[NFTA_RULE_TABLE]),dump->table)!=0)
+        return MNL_CB_OK;
+    chain = mnl_attr_get_str(tb[NFTA_RULE_CHAIN]);
+
+    // Pick the comment out of the userdata TLVs
+    if(tb[NFTA_RULE_USERDATA])
+    {
+        udata = mnl_attr_get_payload(tb[NFTA_RULE_USERDATA]);
+        len = mnl_attr_get_payload_len(tb[NFTA_RULE_USERDATA]);
+        for(x=0;x+2<=len && x+2+udata[x+1]<=len;x+=2+udata[x+1])
+        {
+            if(udata[x]!=NFT_UDATA_COMMENT || udata[x+1]>sizeof(id)) continue;
+            memcpy(id,udata+x+2,udata[x+1]);
+            id[sizeof(id)-1] = 0;
+            if(strncmp(id,RULESET_ID_TAG,strlen(RULESET_ID_TAG))!=0) id[0] = 0;
+        }
+    }
+
+    for(x=0;x<NUM_BASE_CHAINS;x++)
+    {
+        if(strcmp(chain,base_chains[x].name)!=0) continue;
+        if(!ruleset_list_add(&live[x],"",id)) return MNL_CB_ERROR;
+        live[x].entries[live[x].num-1].handle = be64toh(mnl_attr_get_u64(tb[NFTA_RULE_HANDLE]));
+        if(tb[NFTA_RULE_EXPRESSIONS])
+            live[x].entries[live[x].num-1].packets = _rule_packets(tb[NFTA_RULE_EXPRESSIONS]);
+    }
+    return MNL_CB_OK;
+}
+
+// Packets seen by the rule's counter expression, if it has one
+static uint64_t _rule_packets(const struct nlattr * exprs)
+{
+    const struct nlattr * elem, * attr, * data, * counter;
+    bool is_counter;
+
+    mnl_attr_for_each_nested(elem,exprs)
+    {
+        is_counter = false;
+        data = NULL;
+        mnl_attr_for_each_nested(attr,elem)
+        {
+            if(mnl_attr_get_type(attr)==NFTA_EXPR_NAME)
+                is_counter = (strcmp(mnl_attr_get_str(attr),"counter")==0);
+            else if(mnl_attr_get_type(attr)==NFTA_EXPR_DATA)
+                data = attr;
+        }
+        if(!is_counter || !data) continue;
+        mnl_attr_for_each_nested(counter,data)
+        {
+            if(mnl_attr_get_type(counter)==NFTA_COUNTER_PACKETS)
+                return be64toh(mnl_attr_get_u64(counter));
+        }
+    }
+    return 0;
+}
+
+static void _table_name(ruleset_t * rs, char * out, int max_len)
+{
+    snprintf(out,max_len,NFT_TABLE_PREFIX "%s",rs->iface);
+    return;
+}
+
+static const nft_chain_t * _base_chain(char * chain)
+{
+    int x;
+    for(x=0;x<NUM_BASE_CHAINS;x++)
+    {
+        if(strcasecmp(chain,base_chains[x].name)==0) return &base_chains[x];
+    }
+    return NULL;
+}
+
+static bool _parse_dest(char * dest, uint32_t * addr, uint32_t * mask)
+{
+    char ip[RULE_DEST_LEN];
+    char * slash;
+    struct in_addr a;
+    int cidr = 32;
+
+    strncpy(ip,dest,sizeof(ip)-1);
+    ip[sizeof(ip)-1] = 0;
+    slash = strchr(ip,'/');
+    if(slash){
+        *slash = 0;
+        cidr = atoi(slash+1);
+        if(cidr<0 || cidr>32) return false;
+    }
+    if(inet_pton(AF_INET,ip,&a)!=1) return false;
+
+    *mask = cidr ? htonl(0xFFFFFFFFu << (32-cidr)) : 0;
+    *addr = a.s_addr & *mask;
+    return true;
+}
+
+static void _put_expr_meta(struct nlmsghdr * nlh, uint32_t key, uint32_t dreg)
+{
+    struct nlattr * elem, * data;
+
+    elem = mnl_attr_nest_start(nlh,NFTA_LIST_ELEM);
+    mnl_attr_put_strz(nlh,NFTA_EXPR_NAME,"meta");
+    data = mnl_attr_nest_start(nlh,NFTA_EXPR_DATA);
+    mnl_attr_put_u32(nlh,NFTA_META_KEY,htonl(key));
+    mnl_attr_put_u32(nlh,NFTA_META_DREG,htonl(dreg));
+    mnl_attr_nest_end(nlh,data);
+    mnl_attr_nest_end(nlh,elem);
+    return;
+}
+
+static void _put_expr_cmp(struct nlmsghdr * nlh, uint32_t sreg, const void * value, size_t len)
+{
+    struct nlattr * elem, * data, * nest;
+
+    elem = mnl_attr_nest_start(nlh,NFTA_LIST_ELEM);
+    mnl_attr_put_strz(nlh,NFTA_EXPR_NAME,"cmp");
+    data = mnl_attr_nest_start(nlh,NFTA_EXPR_DATA);
+    mnl_attr_put_u32(nlh,NFTA_CMP_SREG,htonl(sreg));
+    mnl_attr_put_u32(nlh,NFTA_CMP_OP,htonl(NFT_CMP_EQ));
+    nest = mnl_attr_nest_start(nlh,NFTA_CMP_DATA);
+    mnl_attr_put(nlh,NFTA_DATA_VALUE,len,value);
+    mnl_attr_nest_end(nlh,nest);
+    mnl_attr_nest_end(nlh,data);
+    mnl_attr_nest_end(nlh,elem);
+    return;
+}
+
+static void _put_expr_payload(struct nlmsghdr * nlh, uint32_t base, uint32_t offset, uint32_t len, uint32_t dreg)
+{
+    struct nlattr * elem, * data;
+
+    elem = mnl_attr_nest_start(nlh,NFTA_LIST_ELEM);
+    mnl_attr_put_strz(nlh,NFTA_EXPR_NAME,"payload");
+    data = mnl_attr_nest_start(nlh,NFTA_EXPR_DATA);
+    mnl_attr_put_u32(nlh,NFTA_PAYLOAD_DREG,htonl(dreg));
+    mnl_attr_put_u32(nlh,NFTA_PAYLOAD_BASE,htonl(base));
+    mnl_attr_put_u32(nlh,NFTA_PAYLOAD_OFFSET,htonl(offset));
+    mnl_attr_put_u32(nlh,NFTA_PAYLOAD_LEN,htonl(len));
+    mnl_attr_nest_end(nlh,data);
+    mnl_attr_nest_end(nlh,elem);
+    return;
+}
+
+static void _put_expr_bitwise(struct nlmsghdr * nlh, uint32_t reg, const void * mask, size_t len)
+{
+    struct nlattr * elem, * data, * nest;
+    uint8_t zero[16] = {0};
+
+    elem = mnl_attr_nest_start(nlh,NFTA_LIST_ELEM);
+    mnl_attr_put_strz(nlh,NFTA_EXPR_NAME,"bitwise");
+    data = mnl_attr_nest_start(nlh,NFTA_EXPR_DATA);
+    mnl_attr_put_u32(nlh,NFTA_BITWISE_SREG,htonl(reg));
+    mnl_attr_put_u32(nlh,NFTA_BITWISE_DREG,htonl(reg));
+    mnl_attr_put_u32(nlh,NFTA_BITWISE_LEN,htonl(len));
+    nest = mnl_attr_nest_start(nlh,NFTA_BITWISE_MASK);
+    mnl_attr_put(nlh,NFTA_DATA_VALUE,len,mask);
+    mnl_attr_nest_end(nlh,nest);
+    nest = mnl_attr_nest_start(nlh,NFTA_BITWISE_XOR);
+    mnl_attr_put(nlh,NFTA_DATA_VALUE,len,zero);
+    mnl_attr_nest_end(nlh,nest);
+    mnl_attr_nest_end(nlh,data);
+    mnl_attr_nest_end(nlh,elem);
+    return;
+}
+
+static void _put_expr_verdict(struct nlmsghdr * nlh, uint32_t verdict)
+{
+    struct nlattr * elem, * data, * nest, * vnest;
+
+    elem = mnl_attr_nest_start(nlh,NFTA_LIST_ELEM);
+    mnl_attr_put_strz(nlh,NFTA_EXPR_NAME,"immediate");
+    data = mnl_attr_nest_start(nlh,NFTA_EXPR_DATA);
+    mnl_attr_put_u32(nlh,NFTA_IMMEDIATE_DREG,htonl(NFT_REG_VERDICT));
+    nest = mnl_attr_nest_start(nlh,NFTA_IMMEDIATE_DATA);
+    vnest = mnl_attr_nest_start(nlh,NFTA_DATA_VERDICT);
+    mnl_attr_put_u32(nlh,NFTA_VERDICT_CODE,htonl(verdict));
+    mnl_attr_nest_end(nlh,vnest);
+    mnl_attr_nest_end(nlh,nest);
+    mnl_attr_nest_end(nlh,data);
+    mnl_attr_nest_end(nlh,elem);
+    return;
+}
+
+static void _put_expr_counter(struct nlmsghdr * nlh)
+{
+    struct nlattr * elem;
+
+    elem = mnl_attr_nest_start(nlh,NFTA_LIST_ELEM);
+    mnl_attr_put_strz(nlh,NFTA_EXPR_NAME,"counter");
+    mnl_attr_nest_end(nlh,elem);
+    return;
+}
+
+static void _put_expr_lookup(struct nlmsghdr * nlh, uint32_t sreg, const char * set, uint32_t set_id)
+{
+    struct nlattr * elem, * data;
+
+    elem = mnl_attr_nest_start(nlh,NFTA_LIST_ELEM);
+    mnl_attr_put_strz(nlh,NFTA_EXPR_NAME,"lookup");
+    data = mnl_attr_nest_start(nlh,NFTA_EXPR_DATA);
+    mnl_attr_put_strz(nlh,NFTA_LOOKUP_SET,set);
+    mnl_attr_put_u32(nlh,NFTA_LOOKUP_SET_ID,htonl(set_id));
+    mnl_attr_put_u32(nlh,NFTA_LOOKUP_SREG,htonl(sreg));
+    mnl_attr_nest_end(nlh,data);
+    mnl_attr_nest_end(nlh,elem);
+    return;
+}
+
+static bool _add_table(nft_batch_t * b, char * table)
+{
+    struct nlmsghdr * nlh;
+    struct nlattr * nest;
+    int x;
+
+    if(b->dryrun || g_verbose) printf("NFT: add table ip %s (replacing any old one)\n",table);
+
+    // Create the table if it is missing, then delete it and start over
+    // so a repeated 'up' replaces the old rules inside the transaction
+    nlh = _batch_msg(b,NFT_MSG_NEWTABLE,NLM_F_CREATE);
+    if(!nlh) return false;
+    mnl_attr_put_strz(nlh,NFTA_TABLE_NAME,table);
+    _batch_msg_end(b,nlh);
+
+    nlh = _batch_msg(b,NFT_MSG_DELTABLE,0);
+    if(!nlh) return false;
+    mnl_attr_put_strz(nlh,NFTA_TABLE_NAME,table);
+    _batch_msg_end(b,nlh);
+
+    nlh = _batch_msg(b,NFT_MSG_NEWTABLE,NLM_F_CREATE);
+    if(!nlh) return false;
+    mnl_attr_put_strz(nlh,NFTA_TABLE_NAME,table);
+    _batch_msg_end(b,nlh);
+
+    // Base chains, accept policy so only our own drop rules apply
+    for(x=0;x<NUM_BASE_CHAINS;x++)
+    {
+        if(b->dryrun || g_verbose)
+            printf("NFT: add chain ip %s %s { type filter hook %s priority 0; policy accept; }\n",
+                   table,base_chains[x].name,base_chains[x].name);
+        nlh = _batch_msg(b,NFT_MSG_NEWCHAIN,NLM_F_CREATE);
+        if(!nlh) return false;
+        mnl_attr_put_strz(nlh,NFTA_CHAIN_TABLE,table);
+        mnl_attr_put_strz(nlh,NFTA_CHAIN_NAME,base_chains[x].name);
+        nest = mnl_attr_nest_start(nlh,NFTA_CHAIN_HOOK);
+        mnl_attr_put_u32(nlh,NFTA_HOOK_HOOKNUM,htonl(base_chains[x].hook));
+        mnl_attr_put_u32(nlh,NFTA_HOOK_PRIORITY,htonl(0));
+        mnl_attr_nest_end(nlh,nest);
+        mnl_attr_put_u32(nlh,NFTA_CHAIN_POLICY,htonl(NF_ACCEPT));
+        mnl_attr_put_strz(nlh,NFTA_CHAIN_TYPE,"filter");
+        _batch_msg_end(b,nlh);
+    }
+    return true;
+}
+
+static bool _add_set(nft_batch_t * b, char * table, const char * name, uint32_t id,
+                     uint32_t flags, uint32_t key_type, uint32_t key_len, int size)
+{
+    struct nlmsghdr * nlh;
+    struct nlattr * nest;
+
+    nlh = _batch_msg(b,NFT_MSG_NEWSET,NLM_F_CREATE);
+    if(!nlh) return false;
+    mnl_attr_put_strz(nlh,NFTA_SET_TABLE,table);
+    mnl_attr_put_strz(nlh,NFTA_SET_NAME,name);
+    mnl_attr_put_u32(nlh,NFTA_SET_ID,htonl(id));
+    mnl_attr_put_u32(nlh,NFTA_SET_FLAGS,htonl(flags));
+    mnl_attr_put_u32(nlh,NFTA_SET_KEY_TYPE,htonl(key_type));
+    mnl_attr_put_u32(nlh,NFTA_SET_KEY_LEN,htonl(key_len));
+    nest = mnl_attr_nest_start(nlh,NFTA_SET_DESC);
+    mnl_attr_put_u32(nlh,NFTA_SET_DESC_SIZE,htonl(size));
+    mnl_attr_nest_end(nlh,nest);
+    _batch_msg_end(b,nlh);
+    return true;
+}
+
+static bool _add_elems(nft_batch_t * b, char * table, const char * name, uint32_t id,
+                       const uint8_t * keys, const uint32_t * flags, uint32_t key_len, int num)
+{
+    struct nlmsghdr * nlh = NULL;
+    struct nlattr * list = NULL, * elem, * key;
+    int x;
+
+    for(x=0;x<num;x++)
+    {
+        // Start a new message every NFT_SET_CHUNK elements
+        if(!nlh)
+        {
+            nlh = _batch_msg(b,NFT_MSG_NEWSETELEM,NLM_F_CREATE);
+            if(!nlh) return false;
+            mnl_attr_put_strz(nlh,NFTA_SET_ELEM_LIST_TABLE,table);
+            mnl_attr_put_strz(nlh,NFTA_SET_ELEM_LIST_SET,name);
+            mnl_attr_put_u32(nlh,NFTA_SET_ELEM_LIST_SET_ID,htonl(id));
+            list = mnl_attr_nest_start(nlh,NFTA_SET_ELEM_LIST_ELEMENTS);
+        }
+
+        elem = mnl_attr_nest_start(nlh,NFTA_LIST_ELEM);
+        if(flags && flags[x]) mnl_attr_put_u32(nlh,NFTA_SET_ELEM_FLAGS,htonl(flags[x]));
+        key = mnl_attr_nest_start(nlh,NFTA_SET_ELEM_KEY);
+        mnl_attr_put(nlh,NFTA_DATA_VALUE,key_len,keys+x*key_len);
+        mnl_attr_nest_end(nlh,key);
+        mnl_attr_nest_end(nlh,elem);
+
+        if((x+1)%NFT_SET_CHUNK==0 || x==num-1)
+        {
+            mnl_attr_nest_end(nlh,list);
+            _batch_msg_end(b,nlh);
+            nlh = NULL;
+        }
+    }
+    return true;
+}
+
+static bool _add_host_set(nft_batch_t * b, char * table, ruleset_t * rs, bool refill)
+{
+    struct nlmsghdr * nlh;
+    uint8_t * keys;
+    char ip[INET_ADDRSTRLEN];
+    uint16_t port;
+    bool ret;
+    int x;
+
+    if(b->dryrun || g_verbose)
+        printf("NFT: add set ip %s %s { type ipv4_addr . inet_service; size %d; }\n",
+               table,NFT_SET_NAME,rs->num_set);
+
+    // Address then port, the port zero padded to 32 bits
+    keys = calloc(rs->num_set,NFT_SET_KEY_LEN);
+    if(!keys) return false;
+    for(x=0;x<rs->num_set;x++)
+    {
+        if(b->dryrun || g_verbose){
+            inet_ntop(AF_INET,&rs->set[x].addr,ip,sizeof(ip));
+            printf("NFT: add element ip %s %s { %s . %d }\n",table,NFT_SET_NAME,ip,rs->set[x].port);
+        }
+        port = htons(rs->set[x].port);
+        memcpy(keys+x*NFT_SET_KEY_LEN,&rs->set[x].addr,sizeof(uint32_t));
+        memcpy(keys+x*NFT_SET_KEY_LEN+sizeof(uint32_t),&port,sizeof(port));
+    }
+
+    ret = _add_set(b,table,NFT_SET_NAME,NFT_SET_ID,0,
+                   (NFT_TYPE_IPADDR<<NFT_TYPE_BITS)|NFT_TYPE_SERVICE,NFT_SET_KEY_LEN,rs->num_set);
+
+    // An existing set is emptied first, a DELSETELEM without elements
+    // flushes it
+    if(ret && refill)
+    {
+        if(b->dryrun || g_verbose) printf("NFT: flush set ip %s %s\n",table,NFT_SET_NAME);
+        nlh = _batch_msg(b,NFT_MSG_DELSETELEM,0);
+        if(nlh){
+            mnl_attr_put_strz(nlh,NFTA_SET_ELEM_LIST_TABLE,table);
+            mnl_attr_put_strz(nlh,NFTA_SET_ELEM_LIST_SET,NFT_SET_NAME);
+            _batch_msg_end(b,nlh);
+        }
+        else ret = false;
+    }
+
+    ret = ret && _add_elems(b,table,NFT_SET_NAME,NFT_SET_ID,keys,NULL,NFT_SET_KEY_LEN,rs->num_set);
+    free(keys);
+    return ret;
+}
+
+static uint32_t _add_dest_set(nft_batch_t * b, char * table, rule_t * rule)
+{
+    uint32_t * keys, * flags;
+    uint32_t addr, mask, end;
+    uint32_t id = ++b->set_id;
+    bool interval = false;
+    bool ret = false;
+    int num = 0;
+    int x;
+
+    keys = calloc(rule->num_dests*2,sizeof(uint32_t));
+    flags = calloc(rule->num_dests*2,sizeof(uint32_t));
+    if(!keys || !flags) goto dest_set_end;
+
+    for(x=0;x<rule->num_dests;x++)
+    {
+        if(!_parse_dest(rule->dests[x],&addr,&mask)){
+            printf("Error, '%s' is not an IPv4 address or network\n",rule->dests[x]);
+            goto dest_set_end;
+        }
+        if(mask!=0xFFFFFFFF) interval = true;
+    }
+
+    for(x=0;x<rule->num_dests;x++)
+    {
+        _parse_dest(rule->dests[x],&addr,&mask);
+        if(!interval){
+            keys[num++] = addr;
+            continue;
+        }
+
+        // Networks need an interval set, each is its first address and an
+        // end flagged element one past its last.  The compiler hands the
+        // list over sorted, so a network starting where the last one ended
+        // just continues it
+        if(num && flags[num-1]==NFT_SET_ELEM_INTERVAL_END && keys[num-1]==addr) num--;
+        else{
+            keys[num] = addr;
+            flags[num++] = 0;
+        }
+        end = ntohl(addr | ~mask)+1;
+        if(end==0) continue;
+        keys[num] = htonl(end);
+        flags[num++] = NFT_SET_ELEM_INTERVAL_END;
+    }
+
+    ret = _add_set(b,table,NFT_ANON_SET_NAME,id,NFT_ANON_SET_FLAGS | (interval ? NFT_SET_INTERVAL : 0),
+                   NFT_TYPE_IPADDR,sizeof(uint32_t),num) &&
+          _add_elems(b,table,NFT_ANON_SET_NAME,id,(uint8_t *)keys,(interval ? flags : NULL),sizeof(uint32_t),num);
+
+dest_set_end:
+    free(keys);
+    free(flags);
+    return ret ? id : 0;
+}
+
+static uint32_t _add_port_set(nft_batch_t * b, char * table, rule_t * rule)
+{
+    uint16_t keys[RULE_MAX_PORTS*2];
+    uint32_t flags[RULE_MAX_PORTS*2];
+    uint32_t id = ++b->set_id;
+    int num = 0;
+    int x;
+
+    // An interval set holds each range as its start, and an end flagged
+    // element one past its last port
+    for(x=0;x<rule->num_ports;x++)
+    {
+        keys[num] = htons(rule->ports[x].first);
+        flags[num++] = 0;
+        if(rule->ports[x].last==0xFFFF) continue;
+        keys[num] = htons(rule->ports[x].last+1);
+        flags[num++] = NFT_SET_ELEM_INTERVAL_END;
+    }
+
+    if(!_add_set(b,table,NFT_ANON_SET_NAME,id,NFT_ANON_SET_FLAGS | NFT_SET_INTERVAL,
+                 NFT_TYPE_SERVICE,sizeof(uint16_t),num) ||
+       !_add_elems(b,table,NFT_ANON_SET_NAME,id,(uint8_t *)keys,flags,sizeof(uint16_t),num))
+        return 0;
+    return id;
+}
+
+static bool _add_rule(nft_batch_t * b, char * table, rule_t * rule, uint64_t before)
+{
+    struct nlmsghdr * nlh;
+    struct nlattr * exprs;
+    const nft_chain_t * chain;
+    uint8_t udata[2+RULESET_ID_LEN];
+    uint32_t addr = 0, mask = 0;
+    uint32_t dest_set = 0, port_set = 0;
+    uint16_t port;
+    uint8_t proto = IPPROTO_TCP;
+    int x;
+
+    chain = _base_chain(rule->chain);
+    if(!chain){
+        printf("Error, chain '%s' has no nftables equivalent\n",rule->chain);
+        return false;
+    }
+    if(rule->dest[0] && !_parse_dest(rule->dest,&addr,&mask)){
+        printf("Error, '%s' is not an IPv4 address or network\n",rule->dest);
+        return false;
+    }
+
+    if(b->dryrun || g_verbose){
+        printf("NFT: add rule ip %s %s",table,chain->name);
+        if(rule->iface[0]) printf(" iifname \"%s\"",rule->iface);
+        if(rule->dest[0]) printf(" ip daddr %s",rule->dest);
+        for(x=0;x<rule->num_dests;x++)
+            printf("%s%s",(x?", ":" ip daddr { "),rule->dests[x]);
+        if(rule->num_dests) printf(" }");
+        for(x=0;x<rule->num_ports;x++)
+        {
+            printf("%s%d",(x?", ":((rule->num_ports>1)?" tcp dport { ":" tcp dport ")),rule->ports[x].first);
+            if(rule->ports[x].last!=rule->ports[x].first) printf("-%d",rule->ports[x].last);
+        }
+        if(rule->num_ports>1) printf(" }");
+        if(rule->match_set) printf(" ip daddr . tcp dport @%s",NFT_SET_NAME);
+        printf(" counter %s",((rule->target==RULE_DROP)?"drop":"accept"));
+        if(before) printf(" (before handle %llu)",(unsigned long long)before);
+        printf("\n");
+    }
+
+    // Any sets the rule looks up go in the batch ahead of it
+    if(rule->num_dests && !(dest_set = _add_dest_set(b,table,rule))) return false;
+    if((rule->num_ports>1 || (rule->num_ports==1 && rule->ports[0].first!=rule->ports[0].last)) &&
+       !(port_set = _add_port_set(b,table,rule))) return false;
+
+    // Without NLM_F_APPEND a position inserts the rule in front of it
+    nlh = _batch_msg(b,NFT_MSG_NEWRULE,NLM_F_CREATE | (before ? 0 : NLM_F_APPEND));
+    if(!nlh) return false;
+    mnl_attr_put_strz(nlh,NFTA_RULE_TABLE,table);
+    mnl_attr_put_strz(nlh,NFTA_RULE_CHAIN,chain->name);
+    if(before){
+        before = htobe64(before);
+        mnl_attr_put(nlh,NFTA_RULE_POSITION,sizeof(before),&before);
+    }
+
+    // The ID goes in as a comment, which 'nft list' shows as well
+    ruleset_rule_id(rule,-1,(char *)udata+2,RULESET_ID_LEN);
+    udata[0] = NFT_UDATA_COMMENT;
+    udata[1] = strlen((char *)udata+2)+1;
+    mnl_attr_put(nlh,NFTA_RULE_USERDATA,2+udata[1],udata);
+
+    exprs = mnl_attr_nest_start(nlh,NFTA_RULE_EXPRESSIONS);
+
+    // iifname, compared over the whole zero padded name
+    if(rule->iface[0])
+    {
+        _put_expr_meta(nlh,NFT_META_IIFNAME,NFT_REG_1);
+        _put_expr_cmp(nlh,NFT_REG_1,rule->iface,sizeof(rule->iface));
+    }
+
+    // ip daddr, masked down to the network for anything but a host
+    if(rule->dest[0] && mask)
+    {
+        _put_expr_payload(nlh,NFT_PAYLOAD_NETWORK_HEADER,IPV4_DADDR_OFFSET,sizeof(addr),NFT_REG_1);
+        if(mask!=0xFFFFFFFF) _put_expr_bitwise(nlh,NFT_REG_1,&mask,sizeof(mask));
+        _put_expr_cmp(nlh,NFT_REG_1,&addr,sizeof(addr));
+    }
+
+    // ip daddr { ... }
+    if(dest_set)
+    {
+        _put_expr_payload(nlh,NFT_PAYLOAD_NETWORK_HEADER,IPV4_DADDR_OFFSET,sizeof(addr),NFT_REG_1);
+        _put_expr_lookup(nlh,NFT_REG_1,NFT_ANON_SET_NAME,dest_set);
+    }
+
+    // tcp dport, or tcp dport { ... }
+    if(rule->num_ports)
+    {
+        port = htons(rule->ports[0].first);
+        _put_expr_meta(nlh,NFT_META_L4PROTO,NFT_REG_1);
+        _put_expr_cmp(nlh,NFT_REG_1,&proto,sizeof(proto));
+        _put_expr_payload(nlh,NFT_PAYLOAD_TRANSPORT_HEADER,TCP_DPORT_OFFSET,sizeof(port),NFT_REG_1);
+        if(port_set) _put_expr_lookup(nlh,NFT_REG_1,NFT_ANON_SET_NAME,port_set);
+        else _put_expr_cmp(nlh,NFT_REG_1,&port,sizeof(port));
+    }
+
+    // ip daddr . tcp dport, loaded into consecutive 32 bit registers
+    if(rule->match_set)
+    {
+        _put_expr_meta(nlh,NFT_META_L4PROTO,NFT_REG_1);
+        _put_expr_cmp(nlh,NFT_REG_1,&proto,sizeof(proto));
+        _put_expr_payload(nlh,NFT_PAYLOAD_NETWORK_HEADER,IPV4_DADDR_OFFSET,sizeof(uint32_t),NFT_REG32_00);
+        _put_expr_payload(nlh,NFT_PAYLOAD_TRANSPORT_HEADER,TCP_DPORT_OFFSET,sizeof(uint16_t),NFT_REG32_01);
+        _put_expr_lookup(nlh,NFT_REG32_00,NFT_SET_NAME,NFT_SET_ID);
+    }
+
+    _put_expr_counter(nlh);
+    _put_expr_verdict(nlh,((rule->target==RULE_DROP)?NF_DROP:NF_ACCEPT));
+    mnl_attr_nest_end(nlh,exprs);
+    _batch_msg_end(b,nlh);
+    return true;
+}
+
+static bool _del_rule(nft_batch_t * b, char * table, const char * chain, uint64_t handle)
+{
+    struct nlmsghdr * nlh;
+
+    if(b->dryrun || g_verbose) printf("NFT: delete rule ip %s %s handle %llu\n",table,chain,(unsigned long long)handle);
+    nlh = _batch_msg(b,NFT_MSG_DELRULE,0);
+    if(!nlh) return false;
+    mnl_attr_put_strz(nlh,NFTA_RULE_TABLE,table);
+    mnl_attr_put_strz(nlh,NFTA_RULE_CHAIN,chain);
+    handle = htobe64(handle);
+    mnl_attr_put(nlh,NFTA_RULE_HANDLE,sizeof(handle),&handle);
+    _batch_msg_end(b,nlh);
+    return true;
+}
+
+// EOF
@@ -0,0 +1,42 @@
+/*********************************************************************
+wgnet WireGuard network utility
+
+Copyright (C) 2020 - Andrew Gaylo - drew@clisystems.com
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*******************************************************************/
+#ifndef __NFT_H__
+#define __NFT_H__
+
+#include "ruleset.h"
+
+// Each interface gets its own table, wgnet-<iface>
+#define NFT_TABLE_PREFIX    "wgnet-"
+
+// Replace the interface's table with the ruleset in one transaction
+int nft_apply(ruleset_t * rs, bool dryrun);
+
+// Update the interface's table to the ruleset in one transaction, only
+// touching the rules that changed.  Replaces the table if it is missing
+int nft_reconcile(ruleset_t * rs, bool dryrun);
+
+// Fill in each rule's hits from the counters of the installed rules
+int nft_count_hits(ruleset_t * rs);
+
+// Delete the interface's table, and every rule in it
+int nft_remove(ruleset_t * rs, bool dryrun);
+
+#endif
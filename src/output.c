@@ -0,0 +1,492 @@
+/*********************************************************************
+wgnet WireGuard network utility
+
+Copyright (C) 2020 - Andrew Gaylo - drew@clisystems.com
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*******************************************************************/
+
+/*********************************************************************
+ *
+ * Overview:
+ *
+ * This file formats interfaces and peers for status and the listing.
+ * Everything goes into one large buffer that is written to stdout with
+ * a single write() whenever it fills, integers, addresses and keys are
+ * formatted straight into it.  A device with 100k peers is a few dozen
+ * writes, not a stdio call per field.  The same records come out as wg
+ * style text, JSON or CSV, and the text is only colored on a terminal.
+ *
+ ********************************************************************/
+
+#include "defs.h"
+#include "output.h"
+#include "defs_colors.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <arpa/inet.h>
+
+// Definitions
+// ----------------------------------------------------------------------------
+#define OUTPUT_BUFFER_SIZE  (64*1024)
+
+#define CSV_HEADER  "type,interface,public_key,endpoint,allowed_ips,listen_port,fwmark," \
+                    "latest_handshake,rx_bytes,tx_bytes,persistent_keepalive\n"
+
+// Types
+// ----------------------------------------------------------------------------
+
+// Variables
+// ----------------------------------------------------------------------------
+static output_format_t format = OUTPUT_TEXT;
+static bool b_colors = false;
+
+static char buffer[OUTPUT_BUFFER_SIZE];
+static size_t buffer_len = 0;
+
+static const char * format_names[] = {
+    [OUTPUT_TEXT] = "text",
+    [OUTPUT_JSON] = "json",
+    [OUTPUT_CSV] = "csv",
+};
+
+// Where the document is, for separators and the CSV peer row
+static bool first_device;
+static bool first_peer;
+static bool first_allowedip;
+static char device_name[IFNAMSIZ];
+static int64_t peer_handshake;
+static uint64_t peer_rx, peer_tx;
+static uint16_t peer_keepalive;
+
+// Local functions
+// ----------------------------------------------------------------------------
+static char * _reserve(size_t len);
+static void _char(char c);
+static void _label(const char * label);
+static void _quoted(const char * str);
+static void _ip(uint16_t family, const void * addr);
+static bool _endpoint(const struct sockaddr * endpoint);
+
+// Public functions
+// ----------------------------------------------------------------------------
+void output_init()
+{
+    b_colors = isatty(STDOUT_FILENO);
+    atexit(output_flush);
+}
+
+bool output_set_format(char * name)
+{
+    int x;
+    for(x=0;x<(int)(sizeof(format_names)/sizeof(format_names[0]));x++)
+    {
+        if(strcmp(name,format_names[x])==0)
+        {
+            format = x;
+            if(g_verbose) printf("Output format = %s\n",name);
+            return true;
+        }
+    }
+    return false;
+}
+
+output_format_t output_get_format()
+{
+    return format;
+}
+
+bool output_colors()
+{
+    return b_colors && format==OUTPUT_TEXT;
+}
+
+void output_flush()
+{
+    size_t done = 0;
+    ssize_t ret;
+
+    if(!buffer_len) return;
+
+    // Whatever stdio holds was printed first
+    fflush(stdout);
+    while(done<buffer_len)
+    {
+        ret = write(STDOUT_FILENO,buffer+done,buffer_len-done);
+        if(ret<0 && errno==EINTR) continue;
+        // Reader went away, drop the rest
+        if(ret<=0) break;
+        done += ret;
+    }
+    buffer_len = 0;
+}
+
+void output_str(const char * str)
+{
+    size_t len = strlen(str);
+    size_t chunk;
+
+    while(len)
+    {
+        if(buffer_len==OUTPUT_BUFFER_SIZE) output_flush();
+        chunk = OUTPUT_BUFFER_SIZE-buffer_len;
+        if(chunk>len) chunk = len;
+        memcpy(buffer+buffer_len,str,chunk);
+        buffer_len += chunk;
+        str += chunk;
+        len -= chunk;
+    }
+}
+
+void output_u64(uint64_t value)
+{
+    char digits[20];
+    char * ptr;
+    int len = 0;
+
+    do{
+        digits[len++] = '0'+value%10;
+        value /= 10;
+    }while(value);
+    ptr = _reserve(len);
+    while(len) *ptr++ = digits[--len];
+}
+
+void output_color(char color)
+{
+    char * ptr;
+
+    if(!output_colors()) return;
+    ptr = _reserve(5);
+    memcpy(ptr,"\x1b[3",3);
+    ptr[3] = color;
+    ptr[4] = 'm';
+}
+
+void output_bold()
+{
+    if(output_colors()) output_str("\x1b[1m");
+}
+
+void output_normal()
+{
+    if(output_colors()) output_str("\x1b[0m");
+}
+
+// Base64 of a 32 byte key, 43 characters and the padding
+void output_key(const uint8_t * key)
+{
+    static const char b64[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char * ptr = _reserve(44);
+    uint32_t val;
+    int x;
+
+    for(x=0;x<30;x+=3){
+        val = key[x]<<16 | key[x+1]<<8 | key[x+2];
+        *ptr++ = b64[val>>18];
+        *ptr++ = b64[(val>>12)&0x3F];
+        *ptr++ = b64[(val>>6)&0x3F];
+        *ptr++ = b64[val&0x3F];
+    }
+    val = key[30]<<16 | key[31]<<8;
+    *ptr++ = b64[val>>18];
+    *ptr++ = b64[(val>>12)&0x3F];
+    *ptr++ = b64[(val>>6)&0x3F];
+    *ptr = '=';
+}
+
+void output_begin()
+{
+    first_device = true;
+    if(format==OUTPUT_JSON) _char('[');
+    else if(format==OUTPUT_CSV) output_str(CSV_HEADER);
+}
+
+void output_device_begin(const char * name, const uint8_t * public_key,
+                         uint16_t listen_port, uint32_t fwmark)
+{
+    strncpy(device_name,name,IFNAMSIZ-1);
+    device_name[IFNAMSIZ-1] = '\0';
+    first_peer = true;
+
+    switch(format)
+    {
+    case OUTPUT_JSON:
+        output_str(first_device ? "\n{\"interface\":" : ",\n{\"interface\":");
+        _quoted(name);
+        output_str(",\"public_key\":\"");
+        output_key(public_key);
+        output_str("\",\"listen_port\":");
+        output_u64(listen_port);
+        output_str(",\"fwmark\":");
+        output_u64(fwmark);
+        output_str(",\"peers\":[");
+        break;
+    case OUTPUT_CSV:
+        output_str("interface,");
+        _quoted(name);
+        _char(',');
+        output_key(public_key);
+        output_str(",,,");
+        output_u64(listen_port);
+        _char(',');
+        output_u64(fwmark);
+        output_str(",,,,\n");
+        break;
+    default:
+        // Match wg output
+        output_color(VTCOLOR_GREEN); output_bold(); output_str("interface: "); output_normal(); output_color(VTCOLOR_GREEN);
+        output_str(name); _char('\n');
+        output_color(VTCOLOR_GRAY);
+        _label("  public key: "); output_key(public_key); _char('\n');
+        _label("  private key: "); output_str("(hidden)\n");
+        _label("  listening port: "); output_u64(listen_port); _char('\n');
+        _char('\n');
+        break;
+    }
+    first_device = false;
+}
+
+void output_peer_begin(const uint8_t * public_key, const struct sockaddr * endpoint,
+                       int64_t last_handshake, uint64_t rx_bytes, uint64_t tx_bytes,
+                       uint16_t keepalive)
+{
+    peer_handshake = last_handshake;
+    peer_rx = rx_bytes;
+    peer_tx = tx_bytes;
+    peer_keepalive = keepalive;
+    first_allowedip = true;
+
+    switch(format)
+    {
+    case OUTPUT_JSON:
+        output_str(first_peer ? "{\"public_key\":\"" : ",{\"public_key\":\"");
+        output_key(public_key);
+        output_str("\",\"endpoint\":");
+        if(endpoint->sa_family==AF_INET || endpoint->sa_family==AF_INET6){
+            _char('"');
+            _endpoint(endpoint);
+            _char('"');
+        }else{
+            output_str("null");
+        }
+        output_str(",\"latest_handshake\":");
+        output_u64(last_handshake>0 ? last_handshake : 0);
+        output_str(",\"rx_bytes\":");
+        output_u64(rx_bytes);
+        output_str(",\"tx_bytes\":");
+        output_u64(tx_bytes);
+        output_str(",\"persistent_keepalive\":");
+        output_u64(keepalive);
+        output_str(",\"allowed_ips\":[");
+        break;
+    case OUTPUT_CSV:
+        output_str("peer,");
+        _quoted(device_name);
+        _char(',');
+        output_key(public_key);
+        _char(',');
+        _endpoint(endpoint);
+        _char(',');
+        break;
+    default:
+        output_color(VTCOLOR_YELLOW); output_bold(); output_str("peer: "); output_normal(); output_color(VTCOLOR_YELLOW);
+        output_key(public_key); _char('\n');
+        output_color(VTCOLOR_GRAY);
+        _label("  endpoint: ");
+        if(!_endpoint(endpoint)) output_str("(none)");
+        _char('\n');
+        break;
+    }
+    first_peer = false;
+}
+
+void output_allowedip(uint16_t family, const void * addr, uint8_t cidr)
+{
+    switch(format)
+    {
+    case OUTPUT_JSON:
+        output_str(first_allowedip ? "\"" : ",\"");
+        _ip(family,addr);
+        _char('/');
+        output_u64(cidr);
+        _char('"');
+        break;
+    case OUTPUT_CSV:
+        // Space separated, so the field never needs quoting
+        if(!first_allowedip) _char(' ');
+        _ip(family,addr);
+        _char('/');
+        output_u64(cidr);
+        break;
+    default:
+        _label("  allowed ips: ");
+        _ip(family,addr);
+        _char('/');
+        output_u64(cidr);
+        _char('\n');
+        break;
+    }
+    first_allowedip = false;
+}
+
+void output_peer_end()
+{
+    if(format==OUTPUT_JSON){
+        output_str("]}");
+    }else if(format==OUTPUT_CSV){
+        output_str(",,,");
+        output_u64(peer_handshake>0 ? peer_handshake : 0);
+        _char(',');
+        output_u64(peer_rx);
+        _char(',');
+        output_u64(peer_tx);
+        _char(',');
+        output_u64(peer_keepalive);
+        _char('\n');
+    }
+}
+
+void output_device_end()
+{
+    if(format==OUTPUT_JSON) output_str("]}");
+    else if(format==OUTPUT_TEXT) _char('\n');
+}
+
+void output_end()
+{
+    if(format==OUTPUT_JSON) output_str(first_device ? "]\n" : "\n]\n");
+    output_flush();
+}
+
+// Private functions
+// ----------------------------------------------------------------------------
+// Room for len more bytes, flushing first if they don't fit
+static char * _reserve(size_t len)
+{
+    char * ptr;
+
+    if(buffer_len+len>OUTPUT_BUFFER_SIZE) output_flush();
+    ptr = buffer+buffer_len;
+    buffer_len += len;
+    return ptr;
+}
+
+static void _char(char c)
+{
+    *_reserve(1) = c;
+}
+
+static void _label(const char * label)
+{
+    output_bold(); output_str(label); output_normal();
+}
+
+// A name as a JSON string or CSV field, quoted and escaped as needed
+static void _quoted(const char * str)
+{
+    static const char hex[] = "0123456789abcdef";
+    char * ptr;
+
+    if(format==OUTPUT_CSV){
+        if(!strpbrk(str,",\"\r\n")){
+            output_str(str);
+            return;
+        }
+        _char('"');
+        for(;*str;str++){
+            if(*str=='"') _char('"');
+            _char(*str);
+        }
+        _char('"');
+        return;
+    }
+
+    _char('"');
+    for(;*str;str++){
+        if(*str=='"' || *str=='\\'){
+            ptr = _reserve(2);
+            ptr[0] = '\\';
+            ptr[1] = *str;
+        }else if((unsigned char)*str<0x20){
+            ptr = _reserve(6);
+            memcpy(ptr,"\\u00",4);
+            ptr[4] = hex[(unsigned char)*str>>4];
+            ptr[5] = hex[*str&0xF];
+        }else{
+            _char(*str);
+        }
+    }
+    _char('"');
+}
+
+static void _ip(uint16_t family, const void * addr)
+{
+    const uint8_t * octets = addr;
+    char * ptr;
+    int x;
+
+    if(family==AF_INET6){
+        char ip6[INET6_ADDRSTRLEN];
+        inet_ntop(AF_INET6,addr,ip6,sizeof(ip6));
+        output_str(ip6);
+        return;
+    }
+
+    for(x=0;x<4;x++){
+        if(x) _char('.');
+        if(octets[x]>=100){
+            ptr = _reserve(3);
+            ptr[0] = '0'+octets[x]/100;
+            ptr[1] = '0'+octets[x]/10%10;
+            ptr[2] = '0'+octets[x]%10;
+        }else if(octets[x]>=10){
+            ptr = _reserve(2);
+            ptr[0] = '0'+octets[x]/10;
+            ptr[1] = '0'+octets[x]%10;
+        }else{
+            _char('0'+octets[x]);
+        }
+    }
+}
+
+// Address and port, IPv6 in brackets.  False, with nothing written, if
+// the peer has no endpoint
+static bool _endpoint(const struct sockaddr * endpoint)
+{
+    if(endpoint->sa_family==AF_INET){
+        const struct sockaddr_in * in = (const struct sockaddr_in *)endpoint;
+        _ip(AF_INET,&in->sin_addr);
+        _char(':');
+        output_u64(ntohs(in->sin_port));
+        return true;
+    }
+    if(endpoint->sa_family==AF_INET6){
+        const struct sockaddr_in6 * in6 = (const struct sockaddr_in6 *)endpoint;
+        _char('[');
+        _ip(AF_INET6,&in6->sin6_addr);
+        output_str("]:");
+        output_u64(ntohs(in6->sin6_port));
+        return true;
+    }
+    return false;
+}
+
+// EOF
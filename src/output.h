@@ -0,0 +1,68 @@
+/*********************************************************************
+wgnet WireGuard network utility
+
+Copyright (C) 2020 - Andrew Gaylo - drew@clisystems.com
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*******************************************************************/
+#ifndef __OUTPUT_H__
+#define __OUTPUT_H__
+
+#include "defs.h"
+#include "wireguard.h"
+
+typedef enum {
+    OUTPUT_TEXT = 0,        // wg style text, colored on a terminal
+    OUTPUT_JSON,            // One array of interface objects
+    OUTPUT_CSV,             // One row per interface and per peer
+} output_format_t;
+
+// Call once before any output, colors are only used if stdout is a
+// terminal
+void output_init();
+bool output_set_format(char * name);
+output_format_t output_get_format();
+bool output_colors();
+
+// Write the buffer out.  Anything printed with stdio has to come after
+// this, the buffer bypasses it
+void output_flush();
+
+// Raw text into the buffer
+void output_str(const char * str);
+void output_u64(uint64_t value);
+void output_key(const uint8_t * key);
+
+// Terminal attributes, nothing unless output_colors()
+void output_color(char color);
+void output_bold();
+void output_normal();
+
+// A document of interfaces and their peers, in the chosen format.  Each
+// peer's allowed IPs come one at a time between its begin and end, and
+// all of it is streamed out as the buffer fills
+void output_begin();
+void output_device_begin(const char * name, const uint8_t * public_key,
+                         uint16_t listen_port, uint32_t fwmark);
+void output_peer_begin(const uint8_t * public_key, const struct sockaddr * endpoint,
+                       int64_t last_handshake, uint64_t rx_bytes, uint64_t tx_bytes,
+                       uint16_t keepalive);
+void output_allowedip(uint16_t family, const void * addr, uint8_t cidr);
+void output_peer_end();
+void output_device_end();
+void output_end();
+
+#endif
@@ -0,0 +1,1484 @@
+/*********************************************************************
+wgnet WireGuard network utility
+
+Copyright (C) 2020 - Andrew Gaylo - drew@clisystems.com
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*******************************************************************/
+
+/*********************************************************************
+ *
+ * Overview:
+ *
+ * This file holds the firewall rules generated for a config.  The cmd.c
+ * source adds every rule for a config to a ruleset, and the ruleset is
+ * then installed or removed as a whole by the selected backend.
+ *
+ * With the iptables backends all of an interface's rules live in its own
+ * chains, WGNET-<iface>-FWD and WGNET-<iface>-IN, reached by a single
+ * jump from FORWARD and INPUT.  Teardown only has to unlink, flush and
+ * delete those chains, it doesn't need to know what rules are in them.
+ *
+ * Before installing, compile.c merges the firewall accept rules into as
+ * few as it can, so each rule may carry a list of destinations and port
+ * ranges.  The iptables backends match the ports with multiport, and
+ * write a rule per destination, iptables has no list of addresses short
+ * of an ipset.
+ *
+ * With sets enabled, the run of single host and port ACCEPT rules is
+ * pulled out of the rule list into the ruleset's set, and replaced by one
+ * rule matching destination and port against it.  The kernel looks the
+ * pair up in a hash instead of walking a rule per pair.  The iptables
+ * backends load the set into ipset, nft puts it in the interface's table.
+ *
+ * Every installed rule carries its ID, a hash of what it matches, in an
+ * iptables comment or nftables rule userdata.  A reconcile reads the
+ * IDs back from the live chains, deletes the rules no longer generated
+ * and inserts the new ones in place, leaving the rest untouched.  If the
+ * rules that stay would end up in a different order, the whole ruleset
+ * is installed again instead.
+ *
+ * The accept rules in a run between two drops can go in any order, so
+ * 'optimize' reads the installed rules' packet counters and moves the
+ * busiest to the front of their run, shortening the walk for most
+ * packets.  The learned order can be saved next to the config and is
+ * used again by later installs.
+ *
+ * The iptables backend runs one iptables process per rule.  Replacing a
+ * ruleset that is already installed, it fills staging chains next to
+ * the live ones and then repoints each jump at them with a single '-R',
+ * so the interface is never left without its rules.  The old chains are
+ * deleted afterwards and the staging ones renamed into their place.
+ * The restore backend renders the ruleset into a single iptables-restore
+ * transaction, so the kernel either takes every rule or none of them.  The nft
+ * backend (nft.c) sends the same ruleset as one nftables transaction over
+ * netlink without starting any process at all.
+ *
+ ********************************************************************/
+
+#include "defs.h"
+#include "ruleset.h"
+#include "nft.h"
+#include "compile.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// Definitions
+// ----------------------------------------------------------------------------
+#define RULESET_FILE_MAGIC      "wgnet-ruleset 1"
+
+#define IPTABLES_CMD            "iptables -t filter"
+#define IPTABLES_RESTORE_CMD    "iptables-restore --noflush"
+#define IPSET_CMD               "ipset"
+#define IPSET_RESTORE_CMD       "ipset restore"
+
+// ipset's own default, raised when a set is bigger
+#define IPSET_MAXELEM           65536
+
+// 64 bit FNV-1a, for rule IDs
+#define FNV_OFFSET              0xcbf29ce484222325ull
+#define FNV_PRIME               0x100000001b3ull
+
+// Types
+// ----------------------------------------------------------------------------
+typedef struct {
+    char * buf;
+    size_t len;
+    size_t cap;
+} textbuf_t;
+
+typedef struct {
+    const char * hook;      // Built in chain the interface chain hangs off
+    const char * suffix;
+} ruleset_chain_t;
+
+// Variables
+// ----------------------------------------------------------------------------
+static bool b_dryrun = false;
+static bool b_sets = false;
+static ruleset_backend_t backend = BACKEND_IPTABLES;
+
+static const char * backend_names[] = {
+    [BACKEND_IPTABLES] = "iptables",
+    [BACKEND_RESTORE] = "restore",
+    [BACKEND_NFT] = "nft",
+};
+
+static const ruleset_chain_t chains[] = {
+    { "FORWARD", "FWD" },
+    { "INPUT", "IN" },
+};
+#define NUM_CHAINS  ((int)(sizeof(chains)/sizeof(chains[0])))
+
+// Local functions
+// ----------------------------------------------------------------------------
+static bool _textbuf_printf(textbuf_t * tb, const char * fmt, ...);
+static int _rule_num_dests(rule_t * rule);
+static char * _rule_dest(rule_t * rule, int idx);
+static void _rule_spec(ruleset_t * rs, rule_t * rule, int dest, char * out, int max_len);
+static bool _prepare(ruleset_t * rs);
+static uint64_t _fnv(uint64_t hash, const void * data, size_t len);
+static int _cmp_entry(const void * a, const void * b);
+static int _cmp_hits(const void * a, const void * b);
+static int _iptables_count_hits(ruleset_t * rs);
+static bool _live_rules(char * chain, ruleset_list_t * live, bool counters);
+static bool _want_rules(ruleset_t * rs, int chain, ruleset_list_t * want);
+static int _iptables_reconcile(ruleset_t * rs);
+static char * _render(ruleset_t * rs, bool add, const bool * link);
+static bool _jump_exists(ruleset_t * rs, int chain);
+static void _staging_chain_name(ruleset_t * rs, int chain, char * out, int max_len);
+static int _iptables_fill(ruleset_t * rs, bool staging);
+static int _iptables_swap(ruleset_t * rs);
+static bool _set_candidate(ruleset_t * rs, rule_t * rule, uint32_t * addr);
+static bool _set_add(ruleset_t * rs, uint32_t addr, uint16_t port);
+static bool _rule_grow(ruleset_t * rs);
+static bool _build_set(ruleset_t * rs);
+static void _set_name(ruleset_t * rs, bool staging, char * out, int max_len);
+static int _ipset_load(ruleset_t * rs);
+static void _ipset_destroy(ruleset_t * rs);
+static int _run_command(char * command);
+static bool _command_ok(int ret);
+static int _run_restore(char * command, char * input, bool quiet);
+static int _iptables_apply(ruleset_t * rs);
+static int _iptables_remove(ruleset_t * rs);
+
+// Public functions
+// ----------------------------------------------------------------------------
+void ruleset_enable_dryrun()
+{
+    b_dryrun = true;
+}
+
+void ruleset_enable_sets()
+{
+    if(g_verbose) printf("Set matching = true\n");
+    b_sets = true;
+}
+
+bool ruleset_set_backend(char * name)
+{
+    int x;
+    for(x=0;x<(int)(sizeof(backend_names)/sizeof(backend_names[0]));x++)
+    {
+        if(strcmp(name,backend_names[x])==0)
+        {
+            backend = x;
+            if(g_verbose) printf("Firewall backend = %s\n",name);
+            return true;
+        }
+    }
+    return false;
+}
+
+ruleset_backend_t ruleset_get_backend()
+{
+    return backend;
+}
+
+bool ruleset_sets_enabled()
+{
+    return b_sets;
+}
+
+void ruleset_init(ruleset_t * rs, char * iface)
+{
+    memset(rs,0,sizeof(ruleset_t));
+    if(iface) strncpy(rs->iface,iface,sizeof(rs->iface)-1);
+    return;
+}
+
+void ruleset_free(ruleset_t * rs)
+{
+    int x,y;
+
+    for(x=0;x<rs->num_rules;x++)
+    {
+        for(y=0;y<rs->rules[x].num_dests;y++) free(rs->rules[x].dests[y]);
+        free(rs->rules[x].dests);
+    }
+    free(rs->rules);
+    rs->rules = NULL;
+    rs->num_rules = rs->max_rules = 0;
+    free(rs->set);
+    rs->set = NULL;
+    rs->num_set = rs->max_set = 0;
+    return;
+}
+
+bool ruleset_add(ruleset_t * rs, char * chain, char * iface, char * dest,
+                 uint16_t port, rule_target_t target)
+{
+    rule_t * rule;
+
+    if(!_rule_grow(rs)) return false;
+
+    rule = &rs->rules[rs->num_rules];
+    memset(rule,0,sizeof(rule_t));
+    strncpy(rule->chain,chain,sizeof(rule->chain)-1);
+    if(iface) strncpy(rule->iface,iface,sizeof(rule->iface)-1);
+    if(dest) strncpy(rule->dest,dest,sizeof(rule->dest)-1);
+    if(port)
+    {
+        rule->ports[0].first = rule->ports[0].last = port;
+        rule->num_ports = 1;
+    }
+    rule->target = target;
+    rs->num_rules++;
+    return true;
+}
+
+void ruleset_rule_id(rule_t * rule, int dest, char * out, int max_len)
+{
+    uint64_t hash = FNV_OFFSET;
+    int x;
+
+    // Everything that decides what the rule matches, strings with their
+    // terminators so neighbouring fields can't run together
+    hash = _fnv(hash,rule->chain,strlen(rule->chain)+1);
+    hash = _fnv(hash,rule->iface,strlen(rule->iface)+1);
+    if(dest>=0){
+        hash = _fnv(hash,_rule_dest(rule,dest),strlen(_rule_dest(rule,dest))+1);
+    }else{
+        hash = _fnv(hash,rule->dest,strlen(rule->dest)+1);
+        for(x=0;x<rule->num_dests;x++) hash = _fnv(hash,rule->dests[x],strlen(rule->dests[x])+1);
+    }
+    for(x=0;x<rule->num_ports;x++)
+    {
+        hash = _fnv(hash,&rule->ports[x].first,sizeof(uint16_t));
+        hash = _fnv(hash,&rule->ports[x].last,sizeof(uint16_t));
+    }
+    hash = _fnv(hash,&rule->target,sizeof(rule->target));
+    hash = _fnv(hash,&rule->match_set,sizeof(rule->match_set));
+
+    snprintf(out,max_len,RULESET_ID_TAG "%016llx",(unsigned long long)hash);
+    return;
+}
+
+void ruleset_chain_name(ruleset_t * rs, char * hook, char * out, int max_len)
+{
+    int x;
+    for(x=0;x<NUM_CHAINS;x++)
+    {
+        if(strcmp(hook,chains[x].hook)==0)
+        {
+            snprintf(out,max_len,RULESET_CHAIN_PREFIX "%s-%s",rs->iface,chains[x].suffix);
+            return;
+        }
+    }
+
+    // Not one of ours, the rule goes straight into the named chain
+    snprintf(out,max_len,"%s",hook);
+    return;
+}
+
+bool ruleset_write(ruleset_t * rs, FILE * fp)
+{
+    rule_t * rule;
+    char ip[INET_ADDRSTRLEN];
+    int x,y;
+
+    if(!_prepare(rs)) return false;
+
+    // One line per rule, '-' stands in for an empty field
+    fprintf(fp,RULESET_FILE_MAGIC " %d %d\n",rs->num_rules,rs->num_set);
+    for(x=0;x<rs->num_rules;x++)
+    {
+        rule = &rs->rules[x];
+        fprintf(fp,"%s %s %s %d %d %d",rule->chain,(rule->iface[0]?rule->iface:"-"),
+                (rule->dest[0]?rule->dest:"-"),rule->target,rule->match_set,rule->num_ports);
+        for(y=0;y<rule->num_ports;y++) fprintf(fp," %u %u",rule->ports[y].first,rule->ports[y].last);
+        fprintf(fp," %d",rule->num_dests);
+        for(y=0;y<rule->num_dests;y++) fprintf(fp," %s",rule->dests[y]);
+        fprintf(fp,"\n");
+    }
+    for(x=0;x<rs->num_set;x++)
+    {
+        inet_ntop(AF_INET,&rs->set[x].addr,ip,sizeof(ip));
+        fprintf(fp,"%s %u\n",ip,rs->set[x].port);
+    }
+    return !ferror(fp);
+}
+
+bool ruleset_read(ruleset_t * rs, FILE * fp)
+{
+    rule_t rule;
+    char dest[RULE_DEST_LEN];
+    char ip[INET_ADDRSTRLEN];
+    unsigned int first, last;
+    int target, match_set;
+    int num_rules, num_set;
+    int x,y;
+
+    if(fscanf(fp," " RULESET_FILE_MAGIC " %d %d",&num_rules,&num_set)!=2) return false;
+    for(x=0;x<num_rules;x++)
+    {
+        memset(&rule,0,sizeof(rule));
+        if(fscanf(fp," %28s %15s %49s %d %d %d",rule.chain,rule.iface,rule.dest,
+                  &target,&match_set,&rule.num_ports)!=6) goto read_err;
+        if(rule.num_ports<0 || rule.num_ports>RULE_MAX_PORTS) goto read_err;
+        if(strcmp(rule.iface,"-")==0) rule.iface[0] = 0;
+        if(strcmp(rule.dest,"-")==0) rule.dest[0] = 0;
+        rule.target = target;
+        rule.match_set = match_set;
+        for(y=0;y<rule.num_ports;y++)
+        {
+            if(fscanf(fp," %u %u",&first,&last)!=2) goto read_err;
+            rule.ports[y].first = first;
+            rule.ports[y].last = last;
+        }
+        if(fscanf(fp," %d",&rule.num_dests)!=1 || rule.num_dests<0) goto read_err;
+
+        // Added first, so a short file still leaves nothing to leak
+        y = rule.num_dests;
+        rule.num_dests = 0;
+        if(y){
+            rule.dests = calloc(y,sizeof(char *));
+            if(!rule.dests) goto read_err;
+        }
+        if(!_rule_grow(rs)){
+            free(rule.dests);
+            goto read_err;
+        }
+        rs->rules[rs->num_rules++] = rule;
+        for(;y>0;y--)
+        {
+            rule_t * added = &rs->rules[rs->num_rules-1];
+            if(fscanf(fp," %49s",dest)!=1) goto read_err;
+            added->dests[added->num_dests] = strdup(dest);
+            if(!added->dests[added->num_dests]) goto read_err;
+            added->num_dests++;
+        }
+    }
+    for(x=0;x<num_set;x++)
+    {
+        uint32_t addr;
+        if(fscanf(fp," %15s %u",ip,&first)!=2) goto read_err;
+        if(inet_pton(AF_INET,ip,&addr)!=1 || !_set_add(rs,addr,first)) goto read_err;
+    }
+
+    // Already gone through the set building and compiling when saved
+    rs->compiled = true;
+    return true;
+
+read_err:
+    ruleset_free(rs);
+    return false;
+}
+
+int ruleset_apply(ruleset_t * rs)
+{
+    struct timespec start;
+    char * text;
+    int ret;
+    int x;
+    bool link[NUM_CHAINS];
+
+    if(!_prepare(rs)) return -1;
+
+    if(backend==BACKEND_IPTABLES) return _iptables_apply(rs);
+    if(backend==BACKEND_NFT) return nft_apply(rs,b_dryrun);
+
+    // The rules refer to the set, so it has to be there first
+    if(_ipset_load(rs)<0) return -1;
+
+    // Only add the jumps into our chains that aren't there from an
+    // earlier 'up', the chains themselves get flushed by the restore.  A
+    // second jump would keep the chain in use when it is removed
+    for(x=0;x<NUM_CHAINS;x++)
+    {
+        link[x] = !_jump_exists(rs,x);
+    }
+
+    text = _render(rs,true,link);
+    if(!text){
+        printf("Error rendering ruleset\n");
+        return -1;
+    }
+
+    // Declaring the chains flushes and refills them in the same commit,
+    // the old rules apply right up to the new ones
+    clock_gettime(CLOCK_MONOTONIC,&start);
+    ret = _run_restore(IPTABLES_RESTORE_CMD,text,false);
+    free(text);
+    if(ret!=0){
+        printf("Error, iptables-restore failed, no rules were changed\n");
+        return -1;
+    }
+    if(!b_dryrun) printf("Firewall: ruleset swapped in one transaction, %.3f ms\n",ruleset_elapsed_ms(&start));
+    return 0;
+}
+
+int ruleset_reconcile(ruleset_t * rs)
+{
+    if(!_prepare(rs)) return -1;
+    if(backend==BACKEND_NFT) return nft_reconcile(rs,b_dryrun);
+    return _iptables_reconcile(rs);
+}
+
+int ruleset_count_hits(ruleset_t * rs)
+{
+    if(!_prepare(rs)) return -1;
+    if(backend==BACKEND_NFT) return nft_count_hits(rs);
+    return _iptables_count_hits(rs);
+}
+
+int ruleset_order_by_hits(ruleset_t * rs)
+{
+    rule_t ** run;
+    rule_t * sorted;
+    int * slots;
+    int num, moved = 0;
+    int x,y,z;
+
+    if(!_prepare(rs)) return -1;
+
+    run = malloc(rs->num_rules*sizeof(rule_t *)+1);
+    sorted = malloc(rs->num_rules*sizeof(rule_t)+1);
+    slots = malloc(rs->num_rules*sizeof(int)+1);
+    if(!run || !sorted || !slots){
+        printf("Error, out of memory ordering rules\n");
+        moved = -1;
+        goto order_end;
+    }
+
+    // A run is the accept rules of one chain between two of its drops, the
+    // rules of other chains in between don't matter.  Each run is sorted
+    // by hits and put back into the slots it came from
+    for(x=0;x<NUM_CHAINS;x++)
+    {
+        num = 0;
+        for(y=0;y<=rs->num_rules;y++)
+        {
+            if(y<rs->num_rules && strcmp(rs->rules[y].chain,chains[x].hook)!=0) continue;
+            if(y<rs->num_rules && rs->rules[y].target==RULE_ACCEPT){
+                slots[num] = y;
+                run[num++] = &rs->rules[y];
+                continue;
+            }
+
+            // A drop, or the end of the rules, closes the run
+            if(num>1)
+            {
+                qsort(run,num,sizeof(rule_t *),_cmp_hits);
+                for(z=0;z<num;z++)
+                {
+                    sorted[z] = *run[z];
+                    if(run[z]!=&rs->rules[slots[z]]) moved++;
+                }
+                for(z=0;z<num;z++) rs->rules[slots[z]] = sorted[z];
+            }
+            num = 0;
+        }
+    }
+
+order_end:
+    free(run);
+    free(sorted);
+    free(slots);
+    return moved;
+}
+
+bool ruleset_save_order(ruleset_t * rs, char * path)
+{
+    FILE * fp;
+    char id[RULESET_ID_LEN];
+    int x;
+
+    if(!_prepare(rs)) return false;
+    if(b_dryrun || g_verbose) printf("Saving rule order to '%s'\n",path);
+    if(b_dryrun) return true;
+
+    fp = fopen(path,"w");
+    if(!fp){
+        printf("Error, can't write '%s'\n",path);
+        return false;
+    }
+    fprintf(fp,"# wgnet rule order, written by 'optimize': <rule ID> <packets>\n");
+    for(x=0;x<rs->num_rules;x++)
+    {
+        ruleset_rule_id(&rs->rules[x],-1,id,sizeof(id));
+        fprintf(fp,"%s %llu\n",id,(unsigned long long)rs->rules[x].hits);
+    }
+    fclose(fp);
+    return true;
+}
+
+bool ruleset_load_order(ruleset_t * rs, char * path)
+{
+    ruleset_list_t ids = {0};
+    ruleset_entry_t ** sorted = NULL;
+    ruleset_entry_t key, * pkey = &key, ** found;
+    FILE * fp;
+    char line[100];
+    int rank = 0;
+    int x;
+    bool ret = false;
+
+    if(!_prepare(rs)) return false;
+    fp = fopen(path,"r");
+    if(!fp){
+        printf("Error, can't read '%s'\n",path);
+        return false;
+    }
+    if(g_verbose) printf("Ordering rules from '%s'\n",path);
+
+    // Look the saved IDs up among the rule IDs, rules the file doesn't
+    // know keep their place at the end of their run
+    for(x=0;x<rs->num_rules;x++)
+    {
+        ruleset_rule_id(&rs->rules[x],-1,key.id,sizeof(key.id));
+        if(!ruleset_list_add(&ids,"",key.id)) goto load_end;
+        ids.entries[x].rule = &rs->rules[x];
+        rs->rules[x].hits = 0;
+    }
+    sorted = malloc(ids.num*sizeof(ruleset_entry_t *)+1);
+    if(!sorted) goto load_end;
+    for(x=0;x<ids.num;x++) sorted[x] = &ids.entries[x];
+    qsort(sorted,ids.num,sizeof(ruleset_entry_t *),_cmp_entry);
+
+    while(fgets(line,sizeof(line),fp)) rank++;
+    rewind(fp);
+    while(fgets(line,sizeof(line),fp))
+    {
+        rank--;
+        if(sscanf(line,"%22s",key.id)!=1 || strncmp(key.id,RULESET_ID_TAG,strlen(RULESET_ID_TAG))!=0) continue;
+        found = bsearch(&pkey,sorted,ids.num,sizeof(ruleset_entry_t *),_cmp_entry);
+        if(found) (*found)->rule->hits = rank+1;
+    }
+    ret = true;
+
+load_end:
+    fclose(fp);
+    free(sorted);
+    ruleset_list_free(&ids);
+    return ret;
+}
+
+int ruleset_remove(ruleset_t * rs)
+{
+    char * text;
+    int ret;
+    int x;
+    bool link[NUM_CHAINS];
+
+    if(backend==BACKEND_IPTABLES) return _iptables_remove(rs);
+    if(backend==BACKEND_NFT) return nft_remove(rs,b_dryrun);
+
+    for(x=0;x<NUM_CHAINS;x++) link[x] = true;
+    text = _render(rs,false,link);
+    if(!text){
+        printf("Error rendering ruleset\n");
+        return -1;
+    }
+    ret = _run_restore(IPTABLES_RESTORE_CMD,text,true);
+    free(text);
+    if(ret!=0){
+        // The transaction fails if a chain or jump is already gone, so fall
+        // back to removing whatever is left one command at a time
+        if(g_verbose) printf("Not all chains are installed, removing individually\n");
+        return _iptables_remove(rs);
+    }
+    _ipset_destroy(rs);
+    return 0;
+}
+
+double ruleset_elapsed_ms(struct timespec * start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    return (now.tv_sec-start->tv_sec)*1000.0 + (now.tv_nsec-start->tv_nsec)/1000000.0;
+}
+
+bool ruleset_list_add(ruleset_list_t * list, char * line, char * id)
+{
+    ruleset_entry_t * e;
+
+    if(list->num==list->max)
+    {
+        int max = list->max ? list->max*2 : 32;
+        ruleset_entry_t * entries = realloc(list->entries,max*sizeof(ruleset_entry_t));
+        if(!entries) return false;
+        list->entries = entries;
+        list->max = max;
+    }
+    e = &list->entries[list->num];
+    memset(e,0,sizeof(ruleset_entry_t));
+    e->line = strdup(line);
+    if(!e->line) return false;
+    if(id) snprintf(e->id,sizeof(e->id),"%s",id);
+    list->num++;
+    return true;
+}
+
+void ruleset_list_free(ruleset_list_t * list)
+{
+    int x;
+    for(x=0;x<list->num;x++) free(list->entries[x].line);
+    free(list->entries);
+    memset(list,0,sizeof(ruleset_list_t));
+    return;
+}
+
+bool ruleset_diff(ruleset_list_t * live, ruleset_list_t * want)
+{
+    ruleset_entry_t ** a, ** b;
+    int x,y;
+    bool ret = false;
+
+    // Sort both sides by ID and walk them together to find the rules in
+    // both.  The same ID twice on one side can't be matched up, so that
+    // means starting over
+    a = malloc((live->num+1)*sizeof(ruleset_entry_t *));
+    b = malloc((want->num+1)*sizeof(ruleset_entry_t *));
+    if(!a || !b) goto diff_end;
+    for(x=0;x<live->num;x++) a[x] = &live->entries[x];
+    for(x=0;x<want->num;x++) b[x] = &want->entries[x];
+    qsort(a,live->num,sizeof(ruleset_entry_t *),_cmp_entry);
+    qsort(b,want->num,sizeof(ruleset_entry_t *),_cmp_entry);
+    for(x=1;x<live->num;x++) if(a[x]->id[0] && _cmp_entry(&a[x-1],&a[x])==0) goto diff_end;
+    for(x=1;x<want->num;x++) if(_cmp_entry(&b[x-1],&b[x])==0) goto diff_end;
+
+    for(x=0,y=0;x<live->num && y<want->num;)
+    {
+        int cmp = _cmp_entry(&a[x],&b[y]);
+        if(!a[x]->id[0] || cmp<0) x++;
+        else if(cmp>0) y++;
+        else{
+            a[x]->keep = b[y]->keep = true;
+            b[y++]->handle = a[x++]->handle;
+        }
+    }
+
+    // The rules that stay have to be in the same order on both sides
+    for(x=0,y=0;;x++,y++)
+    {
+        while(x<live->num && !live->entries[x].keep) x++;
+        while(y<want->num && !want->entries[y].keep) y++;
+        if(x==live->num || y==want->num) break;
+        if(strcmp(live->entries[x].id,want->entries[y].id)!=0) goto diff_end;
+    }
+    ret = true;
+
+diff_end:
+    free(a);
+    free(b);
+    return ret;
+}
+
+// Private functions
+// ----------------------------------------------------------------------------
+static bool _textbuf_printf(textbuf_t * tb, const char * fmt, ...)
+{
+    va_list args;
+    int len;
+
+    for(;;)
+    {
+        if(tb->cap-tb->len > 1)
+        {
+            va_start(args,fmt);
+            len = vsnprintf(tb->buf+tb->len,tb->cap-tb->len,fmt,args);
+            va_end(args);
+            if(len<0) break;
+            if((size_t)len < tb->cap-tb->len)
+            {
+                tb->len += len;
+                return true;
+            }
+        }
+
+        // Not enough room, grow and try again
+        size_t cap = tb->cap ? tb->cap*2 : 4096;
+        char * buf = realloc(tb->buf,cap);
+        if(!buf) break;
+        tb->buf = buf;
+        tb->cap = cap;
+    }
+
+    free(tb->buf);
+    memset(tb,0,sizeof(textbuf_t));
+    return false;
+}
+
+static int _rule_num_dests(rule_t * rule)
+{
+    return rule->num_dests ? rule->num_dests : 1;
+}
+
+static char * _rule_dest(rule_t * rule, int idx)
+{
+    return rule->num_dests ? rule->dests[idx] : rule->dest;
+}
+
+static void _rule_spec(ruleset_t * rs, rule_t * rule, int idx, char * out, int max_len)
+{
+    char * dest = _rule_dest(rule,idx);
+    char id[RULESET_ID_LEN];
+    int len = 0;
+    int x;
+
+    // The jump into the interface's chains already matched the interface
+    out[0] = 0;
+    if(rule->iface[0] && strcmp(rule->iface,rs->iface)!=0)
+        len += snprintf(out+len,max_len-len,"-i %s ",rule->iface);
+    if(rule->match_set)
+    {
+        char set[RULE_CHAIN_LEN];
+        _set_name(rs,false,set,sizeof(set));
+        len += snprintf(out+len,max_len-len,"-p tcp -m set --match-set %s dst,dst ",set);
+    }
+    if(dest[0])
+        len += snprintf(out+len,max_len-len,"-d %s ",dest);
+    if(rule->num_ports==1)
+    {
+        len += snprintf(out+len,max_len-len,"-p tcp --dport %d",rule->ports[0].first);
+        if(rule->ports[0].last!=rule->ports[0].first)
+            len += snprintf(out+len,max_len-len,":%d",rule->ports[0].last);
+        len += snprintf(out+len,max_len-len," ");
+    }
+    else if(rule->num_ports>1)
+    {
+        len += snprintf(out+len,max_len-len,"-p tcp -m multiport --dports ");
+        for(x=0;x<rule->num_ports;x++)
+        {
+            len += snprintf(out+len,max_len-len,"%s%d",(x?",":""),rule->ports[x].first);
+            if(rule->ports[x].last!=rule->ports[x].first)
+                len += snprintf(out+len,max_len-len,":%d",rule->ports[x].last);
+        }
+        len += snprintf(out+len,max_len-len," ");
+    }
+    ruleset_rule_id(rule,idx,id,sizeof(id));
+    len += snprintf(out+len,max_len-len,"-m comment --comment %s ",id);
+    snprintf(out+len,max_len-len,"-j %s",((rule->target==RULE_DROP)?"DROP":"ACCEPT"));
+    return;
+}
+
+static bool _prepare(ruleset_t * rs)
+{
+    // Done already, the set can only be pulled out once
+    if(rs->compiled) return true;
+    if(b_sets && !_build_set(rs)){
+        printf("Error building the host set\n");
+        return false;
+    }
+    if(!compile_ruleset(rs)){
+        printf("Error compiling the ruleset\n");
+        return false;
+    }
+    return true;
+}
+
+static uint64_t _fnv(uint64_t hash, const void * data, size_t len)
+{
+    const uint8_t * p = data;
+    while(len--)
+    {
+        hash ^= *p++;
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+static int _cmp_entry(const void * a, const void * b)
+{
+    const ruleset_entry_t * ea = *(ruleset_entry_t **)a;
+    const ruleset_entry_t * eb = *(ruleset_entry_t **)b;
+    return strcmp(ea->id,eb->id);
+}
+
+// Most hits first, ties keep their order
+static int _cmp_hits(const void * a, const void * b)
+{
+    const rule_t * ra = *(rule_t **)a;
+    const rule_t * rb = *(rule_t **)b;
+    if(ra->hits!=rb->hits) return (ra->hits > rb->hits) ? -1 : 1;
+    return (ra > rb) - (ra < rb);
+}
+
+static int _iptables_count_hits(ruleset_t * rs)
+{
+    ruleset_list_t live = {0};
+    ruleset_entry_t ** sorted;
+    ruleset_entry_t key, * pkey = &key, ** found;
+    char chain[RULE_CHAIN_LEN];
+    int x,y,z;
+
+    for(x=0;x<rs->num_rules;x++) rs->rules[x].hits = 0;
+    for(x=0;x<NUM_CHAINS;x++)
+    {
+        ruleset_chain_name(rs,(char *)chains[x].hook,chain,sizeof(chain));
+        if(!_live_rules(chain,&live,true)){
+            printf("%s isn't installed\n",chain);
+            ruleset_list_free(&live);
+            return -1;
+        }
+
+        // A rule with several destinations is installed as one per
+        // destination, its hits are theirs added up
+        sorted = malloc(live.num*sizeof(ruleset_entry_t *)+1);
+        if(!sorted){
+            ruleset_list_free(&live);
+            return -1;
+        }
+        for(y=0;y<live.num;y++) sorted[y] = &live.entries[y];
+        qsort(sorted,live.num,sizeof(ruleset_entry_t *),_cmp_entry);
+        for(y=0;y<rs->num_rules;y++)
+        {
+            if(strcmp(rs->rules[y].chain,chains[x].hook)!=0) continue;
+            for(z=0;z<_rule_num_dests(&rs->rules[y]);z++)
+            {
+                ruleset_rule_id(&rs->rules[y],z,key.id,sizeof(key.id));
+                found = bsearch(&pkey,sorted,live.num,sizeof(ruleset_entry_t *),_cmp_entry);
+                if(found) rs->rules[y].hits += (*found)->packets;
+            }
+        }
+        free(sorted);
+        ruleset_list_free(&live);
+    }
+    return 0;
+}
+
+static bool _live_rules(char * chain, ruleset_list_t * live, bool counters)
+{
+    FILE * fp;
+    char cmd[100];
+    char * line = NULL;
+    char * count;
+    size_t size = 0;
+    ssize_t len;
+    unsigned long long packets;
+    int skip;
+    bool found = false;
+
+    // Only reads, so this runs in dry run mode as well
+    snprintf(cmd,sizeof(cmd),IPTABLES_CMD "%s -S %s 2> /dev/null",(counters?" -v":""),chain);
+    if(g_verbose) printf("SYS: '%s'\n",cmd);
+    fp = popen(cmd,"r");
+    if(!fp) return false;
+
+    while((len = getline(&line,&size,fp)) > 0)
+    {
+        char id[RULESET_ID_LEN] = "";
+        char * tag;
+
+        if(line[len-1]=='\n') line[len-1] = 0;
+        if(strncmp(line,"-N ",3)==0) found = true;
+        if(strncmp(line,"-A ",3)!=0) continue;
+
+        // With -v the counters show up as '-c <packets> <bytes>', taken
+        // back out so the line is still a rule spec
+        packets = 0;
+        count = counters ? strstr(line," -c ") : NULL;
+        if(count && sscanf(count," -c %llu %*u%n",&packets,&skip)==1)
+            memmove(count,count+skip,strlen(count+skip)+1);
+
+        // Rules we didn't tag get no ID and so always go
+        tag = strstr(line,"--comment " RULESET_ID_TAG);
+        if(tag) sscanf(tag+strlen("--comment "),"%22[^ \"]",id);
+        if(!ruleset_list_add(live,line,id)){
+            found = false;
+            break;
+        }
+        live->entries[live->num-1].packets = packets;
+    }
+    free(line);
+    pclose(fp);
+    return found;
+}
+
+static bool _want_rules(ruleset_t * rs, int chain, ruleset_list_t * want)
+{
+    char spec[300];
+    char id[RULESET_ID_LEN];
+    int x,y;
+
+    for(x=0;x<rs->num_rules;x++)
+    {
+        if(strcmp(rs->rules[x].chain,chains[chain].hook)!=0) continue;
+        for(y=0;y<_rule_num_dests(&rs->rules[x]);y++)
+        {
+            _rule_spec(rs,&rs->rules[x],y,spec,sizeof(spec));
+            ruleset_rule_id(&rs->rules[x],y,id,sizeof(id));
+            if(!ruleset_list_add(want,spec,id)) return false;
+        }
+    }
+    return true;
+}
+
+static int _iptables_reconcile(ruleset_t * rs)
+{
+    ruleset_list_t live[NUM_CHAINS] = {{0}};
+    ruleset_list_t want[NUM_CHAINS] = {{0}};
+    textbuf_t tb = {0};
+    struct timespec start;
+    char chain[RULE_CHAIN_LEN];
+    int added = 0, removed = 0, kept = 0;
+    int x,y,pos;
+    int ret = -1;
+
+    for(x=0;x<NUM_CHAINS;x++)
+    {
+        ruleset_chain_name(rs,(char *)chains[x].hook,chain,sizeof(chain));
+        if(!_live_rules(chain,&live[x],false) || !_jump_exists(rs,x))
+        {
+            if(g_verbose) printf("%s isn't installed, installing everything\n",chain);
+            goto reconcile_full;
+        }
+        if(!_want_rules(rs,x,&want[x])) goto reconcile_end;
+        if(!ruleset_diff(&live[x],&want[x]))
+        {
+            if(g_verbose) printf("%s has changed order, installing everything\n",chain);
+            goto reconcile_full;
+        }
+    }
+
+    // Deletes go first, then inserts counted on what is left.  Each
+    // insert goes right after the kept or inserted rule before it
+    if(backend==BACKEND_RESTORE && !_textbuf_printf(&tb,"*filter\n")) goto reconcile_end;
+    for(x=0;x<NUM_CHAINS;x++)
+    {
+        ruleset_chain_name(rs,(char *)chains[x].hook,chain,sizeof(chain));
+        for(y=0;y<live[x].num;y++)
+        {
+            if(live[x].entries[y].keep) continue;
+            if(!_textbuf_printf(&tb,"-D %s\n",live[x].entries[y].line+3)) goto reconcile_end;
+            removed++;
+        }
+        for(y=0,pos=1;y<want[x].num;y++,pos++)
+        {
+            if(want[x].entries[y].keep){ kept++; continue; }
+            if(!_textbuf_printf(&tb,"-I %s %d %s\n",chain,pos,want[x].entries[y].line)) goto reconcile_end;
+            added++;
+        }
+    }
+    if(backend==BACKEND_RESTORE && !_textbuf_printf(&tb,"COMMIT\n")) goto reconcile_end;
+
+    printf("Firewall: %d rules added, %d removed, %d unchanged\n",added,removed,kept);
+
+    // Refresh the set before any rule can use it, swapping it in is
+    // atomic on its own
+    ret = _ipset_load(rs);
+    if(ret<0 || (!added && !removed)) goto reconcile_end;
+
+    if(backend==BACKEND_RESTORE)
+    {
+        clock_gettime(CLOCK_MONOTONIC,&start);
+        if(_run_restore(IPTABLES_RESTORE_CMD,tb.buf,false)!=0){
+            printf("Error, iptables-restore failed, no rules were changed\n");
+            ret = -1;
+        }
+        else if(!b_dryrun) printf("Firewall: changes committed in one transaction, %.3f ms\n",ruleset_elapsed_ms(&start));
+    }
+    else
+    {
+        char * line, * next;
+        char cmd[400];
+        for(line=tb.buf;line && *line;line=next)
+        {
+            next = strchr(line,'\n');
+            if(next) *next++ = 0;
+            snprintf(cmd,sizeof(cmd),IPTABLES_CMD " %s",line);
+            // The positions of the rest depend on this one, rebuild
+            // the whole ruleset rather than carry on
+            if(!_command_ok(_run_command(cmd))){
+                printf("Error updating rule '%s', installing the whole ruleset\n",line);
+                goto reconcile_full;
+            }
+        }
+    }
+    goto reconcile_end;
+
+reconcile_full:
+    ret = ruleset_apply(rs);
+
+reconcile_end:
+    for(x=0;x<NUM_CHAINS;x++)
+    {
+        ruleset_list_free(&live[x]);
+        ruleset_list_free(&want[x]);
+    }
+    free(tb.buf);
+    return ret;
+}
+
+static char * _render(ruleset_t * rs, bool add, const bool * link)
+{
+    textbuf_t tb = {0};
+    char chain[RULE_CHAIN_LEN];
+    char spec[300];
+    int x,y;
+
+    if(!_textbuf_printf(&tb,"*filter\n")) return NULL;
+
+    if(add)
+    {
+        // Declaring the chains creates them, or flushes them if they exist
+        for(x=0;x<NUM_CHAINS;x++)
+        {
+            ruleset_chain_name(rs,(char *)chains[x].hook,chain,sizeof(chain));
+            if(!_textbuf_printf(&tb,":%s - [0:0]\n",chain)) return NULL;
+        }
+        for(x=0;x<rs->num_rules;x++)
+        {
+            ruleset_chain_name(rs,rs->rules[x].chain,chain,sizeof(chain));
+            for(y=0;y<_rule_num_dests(&rs->rules[x]);y++)
+            {
+                _rule_spec(rs,&rs->rules[x],y,spec,sizeof(spec));
+                if(!_textbuf_printf(&tb,"-A %s %s\n",chain,spec)) return NULL;
+            }
+        }
+    }
+
+    for(x=0;x<NUM_CHAINS;x++)
+    {
+        if(!link[x]) continue;
+        ruleset_chain_name(rs,(char *)chains[x].hook,chain,sizeof(chain));
+        if(!_textbuf_printf(&tb,"%s %s -i %s -j %s\n",(add?"-A":"-D"),chains[x].hook,rs->iface,chain))
+            return NULL;
+    }
+
+    if(!add)
+    {
+        for(x=0;x<NUM_CHAINS;x++)
+        {
+            ruleset_chain_name(rs,(char *)chains[x].hook,chain,sizeof(chain));
+            if(!_textbuf_printf(&tb,"-F %s\n-X %s\n",chain,chain)) return NULL;
+        }
+    }
+
+    if(!_textbuf_printf(&tb,"COMMIT\n")) return NULL;
+    return tb.buf;
+}
+
+static bool _jump_exists(ruleset_t * rs, int chain)
+{
+    char cmd[200];
+    char name[RULE_CHAIN_LEN];
+
+    if(b_dryrun) return false;
+
+    ruleset_chain_name(rs,(char *)chains[chain].hook,name,sizeof(name));
+    snprintf(cmd,sizeof(cmd),IPTABLES_CMD " -C %s -i %s -j %s 2> /dev/null",chains[chain].hook,rs->iface,name);
+    if(g_verbose) printf("SYS: '%s'\n",cmd);
+    return system(cmd)==0;
+}
+
+static bool _set_candidate(ruleset_t * rs, rule_t * rule, uint32_t * addr)
+{
+    char ip[RULE_DEST_LEN];
+    char * slash;
+    struct in_addr a;
+
+    if(rule->target!=RULE_ACCEPT || !rule->dest[0] || rule->num_dests) return false;
+    if(rule->num_ports!=1 || rule->ports[0].first!=rule->ports[0].last) return false;
+    if(strcmp(rule->iface,rs->iface)!=0) return false;
+
+    // Only single hosts go in the set, networks stay as rules
+    strncpy(ip,rule->dest,sizeof(ip)-1);
+    ip[sizeof(ip)-1] = 0;
+    slash = strchr(ip,'/');
+    if(slash){
+        if(atoi(slash+1)!=32) return false;
+        *slash = 0;
+    }
+    if(inet_pton(AF_INET,ip,&a)!=1) return false;
+    *addr = a.s_addr;
+    return true;
+}
+
+// Make room for one more rule in the list
+static bool _rule_grow(ruleset_t * rs)
+{
+    if(rs->num_rules==rs->max_rules)
+    {
+        int max = rs->max_rules ? rs->max_rules*2 : 32;
+        rule_t * rules = realloc(rs->rules,max*sizeof(rule_t));
+        if(!rules) return false;
+        rs->rules = rules;
+        rs->max_rules = max;
+    }
+    return true;
+}
+
+static bool _set_add(ruleset_t * rs, uint32_t addr, uint16_t port)
+{
+    int x;
+
+    for(x=0;x<rs->num_set;x++)
+    {
+        if(rs->set[x].addr==addr && rs->set[x].port==port) return true;
+    }
+
+    // Grow the set
+    if(rs->num_set==rs->max_set)
+    {
+        int max = rs->max_set ? rs->max_set*2 : 64;
+        ruleset_elem_t * set = realloc(rs->set,max*sizeof(ruleset_elem_t));
+        if(!set) return false;
+        rs->set = set;
+        rs->max_set = max;
+    }
+    rs->set[rs->num_set].addr = addr;
+    rs->set[rs->num_set].port = port;
+    rs->num_set++;
+    return true;
+}
+
+static bool _build_set(ruleset_t * rs)
+{
+    rule_t * first = NULL;
+    uint32_t addr;
+    int x;
+    int out = 0;
+
+    for(x=0;x<rs->num_rules;x++)
+    {
+        rule_t rule = rs->rules[x];
+
+        // Accepts can't be moved up past a drop, so the set only takes
+        // the run of them up to the next drop in the same chain
+        if(first && rule.target==RULE_DROP && strcmp(rule.chain,first->chain)==0) break;
+
+        if(_set_candidate(rs,&rule,&addr) && (!first || strcmp(rule.chain,first->chain)==0))
+        {
+            if(!_set_add(rs,addr,rule.ports[0].first)) return false;
+            if(first) continue;
+
+            // The first one becomes the lookup for the whole set
+            rule.dest[0] = 0;
+            rule.num_ports = 0;
+            rule.match_set = true;
+            first = &rs->rules[out];
+        }
+        rs->rules[out++] = rule;
+    }
+
+    // Everything past the drop stays as it was
+    for(;x<rs->num_rules;x++) rs->rules[out++] = rs->rules[x];
+    rs->num_rules = out;
+    if(g_verbose) printf("%d host/port pairs moved to the set\n",rs->num_set);
+    return true;
+}
+
+static void _set_name(ruleset_t * rs, bool staging, char * out, int max_len)
+{
+    snprintf(out,max_len,RULESET_SET_PREFIX "%s%s",rs->iface,(staging?"-new":""));
+    return;
+}
+
+static int _ipset_load(ruleset_t * rs)
+{
+    textbuf_t tb = {0};
+    char set[RULE_CHAIN_LEN];
+    char staging[RULE_CHAIN_LEN];
+    char ip[INET_ADDRSTRLEN];
+    int maxelem = IPSET_MAXELEM;
+    int ret;
+    int x;
+
+    if(!rs->num_set) return 0;
+
+    // Fill a staging set and swap it in, so a set that is already in use
+    // is replaced in one step
+    _set_name(rs,false,set,sizeof(set));
+    _set_name(rs,true,staging,sizeof(staging));
+    if(rs->num_set>maxelem) maxelem = rs->num_set;
+    if(!_textbuf_printf(&tb,"create %s hash:ip,port family inet maxelem %d -exist\nflush %s\n",
+                        staging,maxelem,staging)) goto ipset_load_err;
+    for(x=0;x<rs->num_set;x++)
+    {
+        inet_ntop(AF_INET,&rs->set[x].addr,ip,sizeof(ip));
+        if(!_textbuf_printf(&tb,"add %s %s,tcp:%d\n",staging,ip,rs->set[x].port)) goto ipset_load_err;
+    }
+    if(!_textbuf_printf(&tb,"create %s hash:ip,port family inet maxelem %d -exist\nswap %s %s\ndestroy %s\n",
+                        set,maxelem,staging,set,staging)) goto ipset_load_err;
+
+    ret = _run_restore(IPSET_RESTORE_CMD,tb.buf,false);
+    free(tb.buf);
+    if(ret!=0){
+        printf("Error, loading ipset %s failed\n",set);
+        return -1;
+    }
+    return 0;
+
+ipset_load_err:
+    printf("Error rendering ipset %s\n",set);
+    return -1;
+}
+
+static void _ipset_destroy(ruleset_t * rs)
+{
+    char cmd[100];
+    char set[RULE_CHAIN_LEN];
+
+    // Only there if sets were enabled, and can only go once nothing
+    // refers to it
+    _set_name(rs,false,set,sizeof(set));
+    snprintf(cmd,sizeof(cmd),IPSET_CMD " destroy %s 2> /dev/null",set);
+    _run_command(cmd);
+    return;
+}
+
+static int _run_command(char * command)
+{
+    if(b_dryrun || g_verbose){
+        printf("SYS: '%s'\n",command);
+        if(b_dryrun ) return 0;
+    }
+    int ret;
+    ret = system(command);
+    return ret;
+}
+
+// system() only fails below zero if it couldn't run the command, a
+// rejected rule shows up in the exit status
+static bool _command_ok(int ret)
+{
+    return ret==0 || (ret>0 && WIFEXITED(ret) && WEXITSTATUS(ret)==0);
+}
+
+static int _run_restore(char * command, char * input, bool quiet)
+{
+    FILE * fp;
+    char cmd[100];
+    int ret;
+
+    if(b_dryrun || g_verbose){
+        printf("SYS: '%s'\n%s",command,input);
+        if(b_dryrun) return 0;
+    }
+
+    snprintf(cmd,sizeof(cmd),"%s%s",command,(quiet?" 2> /dev/null":""));
+    fp = popen(cmd,"w");
+    if(!fp) return -1;
+    fputs(input,fp);
+    ret = pclose(fp);
+    return ret;
+}
+
+static void _staging_chain_name(ruleset_t * rs, int chain, char * out, int max_len)
+{
+    // Short suffix, iptables chain names stop at 28 characters
+    snprintf(out,max_len,RULESET_CHAIN_PREFIX "%s-%s-N",rs->iface,chains[chain].suffix);
+    return;
+}
+
+// Create the interface chains, or the staging ones next to them, empty
+// and fill them with the ruleset
+static int _iptables_fill(ruleset_t * rs, bool staging)
+{
+    char cmd[400];
+    char chain[RULE_CHAIN_LEN];
+    char spec[300];
+    int x,y,z;
+
+    for(x=0;x<NUM_CHAINS;x++)
+    {
+        if(staging) _staging_chain_name(rs,x,chain,sizeof(chain));
+        else ruleset_chain_name(rs,(char *)chains[x].hook,chain,sizeof(chain));
+        snprintf(cmd,sizeof(cmd),IPTABLES_CMD " -N %s 2> /dev/null",chain);
+        _run_command(cmd);
+        snprintf(cmd,sizeof(cmd),IPTABLES_CMD " -F %s",chain);
+        if(!_command_ok(_run_command(cmd))){
+            printf("Error creating chain %s\n",chain);
+            return -1;
+        }
+    }
+
+    for(x=0;x<rs->num_rules;x++)
+    {
+        for(z=0;z<NUM_CHAINS && strcmp(rs->rules[x].chain,chains[z].hook)!=0;z++);
+        if(z==NUM_CHAINS){
+            printf("Error, chain '%s' isn't one of ours\n",rs->rules[x].chain);
+            return -1;
+        }
+        if(staging) _staging_chain_name(rs,z,chain,sizeof(chain));
+        else ruleset_chain_name(rs,rs->rules[x].chain,chain,sizeof(chain));
+        for(y=0;y<_rule_num_dests(&rs->rules[x]);y++)
+        {
+            _rule_spec(rs,&rs->rules[x],y,spec,sizeof(spec));
+            snprintf(cmd,sizeof(cmd),IPTABLES_CMD " -A %s %s",chain,spec);
+            // A chain missing a rule must never be swapped in
+            if(!_command_ok(_run_command(cmd))){
+                printf("Error adding rule '%s'\n",spec);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Repoint the jumps at the filled staging chains, then drop the old
+// chains and give the staging ones their names
+static int _iptables_swap(ruleset_t * rs)
+{
+    ruleset_list_t live = {0};
+    struct timespec start;
+    char cmd[400];
+    char jump[200];
+    char chain[RULE_CHAIN_LEN];
+    char staging[RULE_CHAIN_LEN];
+    int pos[NUM_CHAINS];
+    bool hooked[NUM_CHAINS];
+    int swapped;
+    double ms = 0;
+    int x;
+
+    // Same spot in the built in chain the old jump had.  Built in chains
+    // have no -N line, so only the rules it read count
+    for(x=0;x<NUM_CHAINS;x++)
+    {
+        ruleset_chain_name(rs,(char *)chains[x].hook,chain,sizeof(chain));
+        snprintf(jump,sizeof(jump),"-A %s -i %s -j %s",chains[x].hook,rs->iface,chain);
+        _live_rules((char *)chains[x].hook,&live,false);
+        for(pos[x]=0;pos[x]<live.num && strcmp(live.entries[pos[x]].line,jump)!=0;pos[x]++);
+        if(pos[x]==live.num && !b_dryrun){
+            printf("Error, jump to %s went missing\n",chain);
+            ruleset_list_free(&live);
+            return -1;
+        }
+        ruleset_list_free(&live);
+    }
+
+    // One rule replaced in place, packets see either chain and never
+    // neither of them
+    for(swapped=0;swapped<NUM_CHAINS;swapped++)
+    {
+        x = swapped;
+        _staging_chain_name(rs,x,staging,sizeof(staging));
+        snprintf(cmd,sizeof(cmd),IPTABLES_CMD " -R %s %d -i %s -j %s",chains[x].hook,pos[x]+1,rs->iface,staging);
+        clock_gettime(CLOCK_MONOTONIC,&start);
+        if(!_command_ok(_run_command(cmd))){
+            printf("Error swapping in %s\n",staging);
+            break;
+        }
+        ms += ruleset_elapsed_ms(&start);
+    }
+    for(x=0;x<NUM_CHAINS;x++) hooked[x] = (x<swapped);
+    if(swapped==NUM_CHAINS && !b_dryrun) printf("Firewall: ruleset swapped in, %.3f ms\n",ms);
+
+    // Never leave one hook on the new rules and the other on the old,
+    // point the ones already swapped back at the old chains
+    for(x=0;x<swapped && swapped<NUM_CHAINS;x++)
+    {
+        ruleset_chain_name(rs,(char *)chains[x].hook,chain,sizeof(chain));
+        snprintf(cmd,sizeof(cmd),IPTABLES_CMD " -R %s %d -i %s -j %s",chains[x].hook,pos[x]+1,rs->iface,chain);
+        if(_command_ok(_run_command(cmd))) hooked[x] = false;
+        else printf("Error, %s is left on the new rules\n",chains[x].hook);
+    }
+
+    for(x=0;x<NUM_CHAINS;x++)
+    {
+        ruleset_chain_name(rs,(char *)chains[x].hook,chain,sizeof(chain));
+        _staging_chain_name(rs,x,staging,sizeof(staging));
+
+        // Not hooked in, so it can just go
+        if(!hooked[x]){
+            snprintf(cmd,sizeof(cmd),IPTABLES_CMD " -F %s 2> /dev/null; " IPTABLES_CMD " -X %s 2> /dev/null",staging,staging);
+            _run_command(cmd);
+            continue;
+        }
+
+        // Nothing refers to the old chain any more.  A rename keeps the
+        // jump, it points at the chain and not its name
+        snprintf(cmd,sizeof(cmd),IPTABLES_CMD " -F %s && " IPTABLES_CMD " -X %s && " IPTABLES_CMD " -E %s %s",
+                 chain,chain,staging,chain);
+        if(!_command_ok(_run_command(cmd))) printf("Error renaming %s to %s\n",staging,chain);
+    }
+    return (swapped==NUM_CHAINS) ? 0 : -1;
+}
+
+static int _iptables_apply(ruleset_t * rs)
+{
+    char cmd[400];
+    char chain[RULE_CHAIN_LEN];
+    bool swap = true;
+    int x;
+
+    if(_ipset_load(rs)<0) return -1;
+
+    // Already hooked in from an earlier 'up', build the new rules beside
+    // the old ones and swap them over
+    for(x=0;x<NUM_CHAINS;x++)
+    {
+        if(!_jump_exists(rs,x)) swap = false;
+    }
+    if(swap)
+    {
+        if(_iptables_fill(rs,true)<0)
+        {
+            printf("Error, the old rules are still in place\n");
+            for(x=0;x<NUM_CHAINS;x++)
+            {
+                _staging_chain_name(rs,x,chain,sizeof(chain));
+                snprintf(cmd,sizeof(cmd),IPTABLES_CMD " -F %s 2> /dev/null; " IPTABLES_CMD " -X %s 2> /dev/null",chain,chain);
+                _run_command(cmd);
+            }
+            return -1;
+        }
+        return _iptables_swap(rs);
+    }
+
+    if(_iptables_fill(rs,false)<0) goto iptables_apply_err;
+
+    // Hook the chains in, once
+    for(x=0;x<NUM_CHAINS;x++)
+    {
+        ruleset_chain_name(rs,(char *)chains[x].hook,chain,sizeof(chain));
+        snprintf(cmd,sizeof(cmd),IPTABLES_CMD " -C %s -i %s -j %s 2> /dev/null || "
+                 IPTABLES_CMD " -A %s -i %s -j %s",
+                 chains[x].hook,rs->iface,chain,chains[x].hook,rs->iface,chain);
+        if(!_command_ok(_run_command(cmd))) goto iptables_apply_err;
+    }
+    return 0;
+
+iptables_apply_err:
+    // Take back out what we put in
+    _iptables_remove(rs);
+    return -1;
+}
+
+static int _iptables_remove(ruleset_t * rs)
+{
+    char cmd[300];
+    char chain[RULE_CHAIN_LEN];
+    int x;
+    int ret = 0;
+
+    // Unlink, flush and delete, however many rules the chains hold.  A
+    // jump or chain that is already gone isn't an error, one that stays is
+    for(x=0;x<NUM_CHAINS;x++)
+    {
+        ruleset_chain_name(rs,(char *)chains[x].hook,chain,sizeof(chain));
+        snprintf(cmd,sizeof(cmd),"! " IPTABLES_CMD " -C %s -i %s -j %s 2> /dev/null || "
+                 IPTABLES_CMD " -D %s -i %s -j %s",
+                 chains[x].hook,rs->iface,chain,chains[x].hook,rs->iface,chain);
+        if(!_command_ok(_run_command(cmd))) ret = -1;
+        snprintf(cmd,sizeof(cmd),"! " IPTABLES_CMD " -S %s > /dev/null 2>&1 || "
+                 "{ " IPTABLES_CMD " -F %s && " IPTABLES_CMD " -X %s; }",chain,chain,chain);
+        if(!_command_ok(_run_command(cmd))) ret = -1;
+    }
+    if(ret<0) printf("Error removing firewall chains for %s\n",rs->iface);
+    _ipset_destroy(rs);
+    return ret;
+}
+
+// EOF
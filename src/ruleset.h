@@ -0,0 +1,175 @@
+/*********************************************************************
+wgnet WireGuard network utility
+
+Copyright (C) 2020 - Andrew Gaylo - drew@clisystems.com
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*******************************************************************/
+#ifndef __RULESET_H__
+#define __RULESET_H__
+
+#include <net/if.h>
+#include <stdio.h>
+#include <time.h>
+
+// Max length of an iptables chain name, including the terminator
+#define RULE_CHAIN_LEN      29
+#define RULE_DEST_LEN       50
+
+// Most ports one rule can match, iptables' multiport limit.  A range
+// takes two of them
+#define RULE_MAX_PORTS      15
+
+// Per-interface chains are named WGNET-<iface>-FWD and WGNET-<iface>-IN
+#define RULESET_CHAIN_PREFIX    "WGNET-"
+
+// The per-interface ipset is named wgnet-<iface>
+#define RULESET_SET_PREFIX      "wgnet-"
+
+// Installed rules are tagged wgnet:<16 hex digits>, a hash of what the
+// rule matches, so a later restart can tell which ones changed
+#define RULESET_ID_TAG          "wgnet:"
+#define RULESET_ID_LEN          (sizeof(RULESET_ID_TAG)+16)
+
+typedef enum {
+    RULE_ACCEPT = 0,
+    RULE_DROP,
+} rule_target_t;
+
+typedef enum {
+    BACKEND_IPTABLES = 0,   // One iptables process per rule
+    BACKEND_RESTORE,        // One iptables-restore transaction per ruleset
+    BACKEND_NFT,            // One nftables netlink transaction per ruleset
+} ruleset_backend_t;
+
+// TCP destination port range, first==last for a single port
+typedef struct {
+    uint16_t first;
+    uint16_t last;
+} rule_ports_t;
+
+typedef struct {
+    char chain[RULE_CHAIN_LEN];     // Built in chain, FORWARD or INPUT
+    char iface[IFNAMSIZ];       // Input interface, empty matches any
+    char dest[RULE_DEST_LEN];   // Destination address or CIDR, empty matches any
+    char ** dests;              // Destination hosts, used instead of dest if set
+    int num_dests;
+    rule_ports_t ports[RULE_MAX_PORTS];
+    int num_ports;              // 0 matches any port
+    rule_target_t target;
+    bool match_set;             // Match destination and port against the set
+    uint64_t hits;              // Packets counted, or rank from a saved order
+} rule_t;
+
+// One destination host and TCP port in the ruleset's set
+typedef struct {
+    uint32_t addr;              // Network byte order
+    uint16_t port;
+} ruleset_elem_t;
+
+// One rule of an interface chain, either installed or wanted
+typedef struct {
+    char * line;                // As 'iptables -S' prints it, or the spec to add
+    char id[RULESET_ID_LEN];    // Empty if the rule has no ID tag
+    bool keep;                  // In both the installed and the wanted chain
+    uint64_t handle;            // nftables rule handle, if installed
+    rule_t * rule;              // The rule, if wanted
+    uint64_t packets;           // Counter of the installed rule, if read
+} ruleset_entry_t;
+
+typedef struct {
+    ruleset_entry_t * entries;
+    int num;
+    int max;
+} ruleset_list_t;
+
+typedef struct {
+    char iface[IFNAMSIZ];       // Interface the ruleset belongs to
+    rule_t * rules;
+    int num_rules;
+    int max_rules;
+    ruleset_elem_t * set;
+    int num_set;
+    int max_set;
+    bool compiled;              // Rules already went through compile.c
+} ruleset_t;
+
+void ruleset_enable_dryrun();
+
+// Install host/port accept rules as one set lookup instead of a rule each
+void ruleset_enable_sets();
+bool ruleset_sets_enabled();
+
+bool ruleset_set_backend(char * name);
+ruleset_backend_t ruleset_get_backend();
+
+// Building
+void ruleset_init(ruleset_t * rs, char * iface);
+void ruleset_free(ruleset_t * rs);
+bool ruleset_add(ruleset_t * rs, char * chain, char * iface, char * dest,
+                 uint16_t port, rule_target_t target);
+
+// Name of the interface's own chain for a built in chain
+void ruleset_chain_name(ruleset_t * rs, char * hook, char * out, int max_len);
+
+// ID tag of a rule, of one of its destinations if dest>=0, or of the
+// whole rule with all of them
+void ruleset_rule_id(rule_t * rule, int dest, char * out, int max_len);
+
+// Save the ruleset, after it is compiled, or load one saved before in
+// its place.  The text format only has to be read back by ruleset_read()
+bool ruleset_write(ruleset_t * rs, FILE * fp);
+bool ruleset_read(ruleset_t * rs, FILE * fp);
+
+// Install the whole ruleset in the kernel, replacing any old rules
+int ruleset_apply(ruleset_t * rs);
+
+// Bring the installed rules in line with the ruleset, only adding and
+// deleting the rules that differ.  Falls back to ruleset_apply() when
+// nothing is installed yet
+int ruleset_reconcile(ruleset_t * rs);
+
+// Read the packet counters of the installed rules into the hits of the
+// ruleset's rules.  Fails if the ruleset isn't installed
+int ruleset_count_hits(ruleset_t * rs);
+
+// Put the most hit rules first within each run of accept rules, those
+// can trade places without changing what gets through.  Returns how many
+// rules moved
+int ruleset_order_by_hits(ruleset_t * rs);
+
+// Save the rule order to a file, one ID per line, or set the hits from
+// one so that ruleset_order_by_hits() restores it
+bool ruleset_save_order(ruleset_t * rs, char * path);
+bool ruleset_load_order(ruleset_t * rs, char * path);
+
+// Lists of installed and wanted rules, for the backends' reconciles
+bool ruleset_list_add(ruleset_list_t * list, char * line, char * id);
+void ruleset_list_free(ruleset_list_t * list);
+
+// Mark the rules in both lists with keep.  False if the kept rules are
+// in a different order in each, or an ID shows up twice in one list
+bool ruleset_diff(ruleset_list_t * live, ruleset_list_t * want);
+
+// Milliseconds since start on CLOCK_MONOTONIC, to report how long the
+// kernel took to switch rulesets
+double ruleset_elapsed_ms(struct timespec * start);
+
+// Remove everything installed for the ruleset's interface, the ruleset
+// doesn't need to hold any rules for this
+int ruleset_remove(ruleset_t * rs);
+
+#endif
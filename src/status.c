@@ -0,0 +1,224 @@
+/*********************************************************************
+wgnet WireGuard network utility
+
+Copyright (C) 2020 - Andrew Gaylo - drew@clisystems.com
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*******************************************************************/
+
+/*********************************************************************
+ *
+ * Overview:
+ *
+ * This file reads the WireGuard devices of many interfaces at once.  A
+ * few threads, never more than the CPUs or STATUS_MAX_WORKERS, each open
+ * their own WireGuard netlink socket and keep taking the next interface
+ * off a shared counter.  A big device holds up one worker, not the whole
+ * listing.  Each result is written to its interface's own entry, so
+ * nothing is shared but the counter and the order printed is the order
+ * asked for.
+ *
+ ********************************************************************/
+
+#include "defs.h"
+#include "status.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+// Definitions
+// ----------------------------------------------------------------------------
+#define STATUS_MAX_WORKERS  8
+
+// Types
+// ----------------------------------------------------------------------------
+typedef struct {
+    status_entry_t * entries;
+    int num;
+    int next;
+    pthread_mutex_t lock;
+} status_pool_t;
+
+// Variables
+// ----------------------------------------------------------------------------
+static int num_workers = 0;
+
+// Receive tuning, negative keeps the library's default
+static int recv_batch = -1;
+static int recv_rcvbuf = -1;
+static int recv_peek = -1;
+static int recv_pipeline = -1;
+
+// Local functions
+// ----------------------------------------------------------------------------
+static void * _worker(void * arg);
+static int _next_entry(status_pool_t * pool);
+
+// Public functions
+// ----------------------------------------------------------------------------
+status_entry_t * status_collect(char ** names, int num)
+{
+    status_pool_t pool;
+    pthread_t threads[STATUS_MAX_WORKERS];
+    long cpus;
+    int started = 0;
+    int x;
+
+    memset(&pool,0,sizeof(pool));
+    pool.entries = calloc(num ? num : 1,sizeof(status_entry_t));
+    if(!pool.entries) return NULL;
+    pool.num = num;
+    for(x=0;x<num;x++)
+        strncpy(pool.entries[x].name,names[x],IFNAMSIZ-1);
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    num_workers = STATUS_MAX_WORKERS;
+    if(cpus>0 && cpus<num_workers) num_workers = cpus;
+    if(num<num_workers) num_workers = num;
+    if(num_workers<1) num_workers = 1;
+
+    // The calling thread is a worker too, a thread that fails to start
+    // only leaves the rest to the others
+    pthread_mutex_init(&pool.lock,NULL);
+    for(x=1;x<num_workers;x++)
+    {
+        if(pthread_create(&threads[started],NULL,_worker,&pool)!=0) break;
+        started++;
+    }
+    num_workers = started+1;
+    _worker(&pool);
+    for(x=0;x<started;x++)
+        pthread_join(threads[x],NULL);
+    pthread_mutex_destroy(&pool.lock);
+
+    return pool.entries;
+}
+
+void status_free(status_entry_t * entries, int num)
+{
+    int x;
+
+    if(!entries) return;
+    for(x=0;x<num;x++)
+        wg_free_peer_table(entries[x].table);
+    free(entries);
+    return;
+}
+
+int status_workers()
+{
+    return num_workers;
+}
+
+bool status_set_recv(char * spec)
+{
+    char * copy, * item, * save;
+    char * end;
+    long value;
+    bool ok = true;
+
+    copy = strdup(spec);
+    if(!copy) return false;
+    for(item=strtok_r(copy,",",&save);item && ok;item=strtok_r(NULL,",",&save))
+    {
+        if(strcmp(item,"peek")==0){
+            recv_peek = 1;
+        }else if(strcmp(item,"nopeek")==0){
+            recv_peek = 0;
+        }else if(strcmp(item,"pipeline")==0){
+            recv_pipeline = 1;
+        }else if(strcmp(item,"nopipeline")==0){
+            recv_pipeline = 0;
+        }else if(strncmp(item,"batch=",6)==0){
+            value = strtol(item+6,&end,10);
+            if(*end || value<1 || value>64) ok = false;
+            else recv_batch = value;
+        }else if(strncmp(item,"rcvbuf=",7)==0){
+            value = strtol(item+7,&end,10);
+            if(*end=='k' || *end=='K'){ value <<= 10; end++; }
+            else if(*end=='m' || *end=='M'){ value <<= 20; end++; }
+            if(*end || value<1 || value>(1<<30)) ok = false;
+            else recv_rcvbuf = value;
+        }else{
+            ok = false;
+        }
+    }
+    free(copy);
+    if(ok && g_verbose) printf("Receive tuning = %s\n",spec);
+    return ok;
+}
+
+wg_handle * status_open()
+{
+    wg_handle * wg;
+    wg_recv_config recv;
+
+    wg = wg_open();
+    if(!wg) return NULL;
+    if(recv_batch<0 && recv_rcvbuf<0 && recv_peek<0 && recv_pipeline<0)
+        return wg;
+
+    wg_handle_get_recv(wg,&recv);
+    if(recv_batch>=0) recv.batch = recv_batch;
+    if(recv_rcvbuf>=0) recv.rcvbuf = recv_rcvbuf;
+    if(recv_peek>=0) recv.peek = recv_peek;
+    if(recv_pipeline>=0) recv.pipeline = recv_pipeline;
+    // Out of memory for the bigger batch, the defaults still work
+    if(wg_handle_set_recv(wg,&recv)<0 && g_verbose)
+        printf("Error setting receive tuning, using the defaults\n");
+    return wg;
+}
+
+// Private functions
+// ----------------------------------------------------------------------------
+static void * _worker(void * arg)
+{
+    status_pool_t * pool = arg;
+    status_entry_t * entry;
+    wg_handle * wg;
+    int err = 0;
+    int x;
+
+    wg = status_open();
+    if(!wg) err = -errno;
+    while((x = _next_entry(pool)) >= 0)
+    {
+        entry = &pool->entries[x];
+        if(!wg){
+            entry->error = err;
+            continue;
+        }
+        entry->error = wg_handle_get_peer_table(wg,&entry->table,entry->name);
+        wg_handle_recv_stats(wg,&entry->stats);
+    }
+    wg_close(wg);
+    return NULL;
+}
+
+static int _next_entry(status_pool_t * pool)
+{
+    int x = -1;
+
+    pthread_mutex_lock(&pool->lock);
+    if(pool->next<pool->num) x = pool->next++;
+    pthread_mutex_unlock(&pool->lock);
+    return x;
+}
+
+// EOF
@@ -0,0 +1,51 @@
+/*********************************************************************
+wgnet WireGuard network utility
+
+Copyright (C) 2020 - Andrew Gaylo - drew@clisystems.com
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*******************************************************************/
+#ifndef __STATUS_H__
+#define __STATUS_H__
+
+#include "wireguard.h"
+
+// One interface's device, as read by status_collect()
+typedef struct {
+    char name[IFNAMSIZ];
+    wg_peer_table * table;      // NULL if the device couldn't be read
+    int error;                  // Negative errno when table is NULL
+    wg_recv_stats stats;        // Netlink reads the dump took
+} status_entry_t;
+
+// Read the peer table of every named interface over a small pool of
+// workers, each with its own WireGuard netlink socket.  The entries come
+// back in the order of names, however the reads interleaved
+status_entry_t * status_collect(char ** names, int num);
+void status_free(status_entry_t * entries, int num);
+
+// How many workers the last status_collect() ran
+int status_workers();
+
+// Tune how the WireGuard sockets read dumps, from a comma separated list
+// of batch=<datagrams>, rcvbuf=<bytes>, peek or nopeek and pipeline or
+// nopipeline.  What isn't listed keeps the library default
+bool status_set_recv(char * spec);
+
+// A WireGuard netlink handle with the receive tuning applied
+wg_handle * status_open();
+
+#endif
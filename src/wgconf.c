@@ -0,0 +1,414 @@
+/*********************************************************************
+wgnet WireGuard network utility
+
+Copyright (C) 2020 - Andrew Gaylo - drew@clisystems.com
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*******************************************************************/
+
+/*********************************************************************
+ *
+ * Overview:
+ *
+ * This file reads wg-quick's config files into what the native bring
+ * up needs: a wg_device ready for wg_set_device(), the addresses and
+ * MTU to set with rtnetlink, and whether routes to the peers go in.
+ *
+ * [Interface] PrivateKey, ListenPort, FwMark, Address, MTU and
+ * Table=auto|off, and [Peer] PublicKey, PresharedKey, AllowedIPs,
+ * Endpoint and PersistentKeepalive are understood.  DNS, the Pre/Post
+ * Up/Down hooks, SaveConfig, other routing tables and a default route
+ * through the tunnel all depend on wg-quick's scripting, a config using
+ * any of them gets needs_quick set and stays with wg-quick.
+ *
+ ********************************************************************/
+
+#include "defs.h"
+#include "wgconf.h"
+
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+
+// Definitions
+// ----------------------------------------------------------------------------
+#define WGCONF_SEPARATORS   ", \t\r\n"
+
+// Local functions
+// ----------------------------------------------------------------------------
+static char * _trim(char * str);
+static bool _parse_addr(char * str, link_addr_t * addr);
+static bool _parse_endpoint(char * str, wg_peer * peer);
+static bool _parse_allowedips(char * str, wg_peer * peer, wgconf_t * wc);
+static bool _parse_interface(wgconf_t * wc, char * key, char * value);
+static bool _parse_peer(wgconf_t * wc, wg_peer * peer, char * key, char * value);
+
+// Public functions
+// ----------------------------------------------------------------------------
+bool wgconf_load(wgconf_t * wc, char * iface)
+{
+    char name[200];
+    char * line = NULL;
+    size_t size = 0;
+    char * key, * value;
+    wg_peer * peer = NULL;
+    bool in_interface = false;
+    int num = 0;
+    FILE * fp;
+
+    memset(wc,0,sizeof(wgconf_t));
+    wc->routes = true;
+    wc->dev = calloc(1,sizeof(wg_device));
+    if(!wc->dev){
+        printf("Error, out of memory reading WireGuard config\n");
+        return false;
+    }
+    snprintf(wc->dev->name,sizeof(wc->dev->name),"%s",iface);
+
+    snprintf(name,sizeof(name),WGCONF_PATH "/%s.conf",iface);
+    fp = fopen(name,"r");
+    if(!fp){
+        if(g_verbose) printf("Can't open '%s'\n",name);
+        goto wgconf_err;
+    }
+    // Any length, a long AllowedIPs line is still one line
+    while(getline(&line,&size,fp) > 0)
+    {
+        num++;
+        key = strchr(line,'#');
+        if(key) *key = 0;
+        key = _trim(line);
+        if(!*key) continue;
+
+        if(*key=='['){
+            in_interface = (strcasecmp(key,"[Interface]")==0);
+            peer = NULL;
+            if(strcasecmp(key,"[Peer]")==0)
+            {
+                peer = calloc(1,sizeof(wg_peer));
+                if(!peer) goto wgconf_file_err;
+                if(wc->dev->last_peer) wc->dev->last_peer->next_peer = peer;
+                else wc->dev->first_peer = peer;
+                wc->dev->last_peer = peer;
+            }
+            continue;
+        }
+
+        value = strchr(key,'=');
+        if(!value) goto wgconf_file_err;
+        *value++ = 0;
+        key = _trim(key);
+        value = _trim(value);
+
+        if(in_interface){
+            if(!_parse_interface(wc,key,value)) goto wgconf_file_err;
+        }else if(peer){
+            if(!_parse_peer(wc,peer,key,value)) goto wgconf_file_err;
+        }
+    }
+    free(line);
+    fclose(fp);
+
+    // Same checks wg setconf makes
+    if(!(wc->dev->flags & WGDEVICE_HAS_PRIVATE_KEY)){
+        printf("Error, '%s' has no PrivateKey\n",name);
+        goto wgconf_err;
+    }
+    for(peer=wc->dev->first_peer;peer;peer=peer->next_peer)
+    {
+        wg_allowedip * ip;
+
+        if(!(peer->flags & WGPEER_HAS_PUBLIC_KEY)){
+            printf("Error, '%s' has a peer without a PublicKey\n",name);
+            goto wgconf_err;
+        }
+
+        // wg-quick sends a default route through its own table and rules
+        wg_for_each_allowedip(peer,ip)
+            if(ip->cidr==0 && wc->routes) wc->needs_quick = "a default route in AllowedIPs";
+    }
+    wc->dev->flags |= WGDEVICE_REPLACE_PEERS;
+    return true;
+
+wgconf_file_err:
+    printf("Error in '%s' line %d\n",name,num);
+    free(line);
+    fclose(fp);
+wgconf_err:
+    wgconf_free(wc);
+    return false;
+}
+
+void wgconf_free(wgconf_t * wc)
+{
+    wg_free_device(wc->dev);
+    wc->dev = NULL;
+    wc->num_addrs = 0;
+    return;
+}
+
+link_addr_t * wgconf_routes(wgconf_t * wc, int * num)
+{
+    link_addr_t * routes;
+    wg_peer * peer;
+    wg_allowedip * ip;
+    uint8_t * bytes;
+    int bits;
+    int x;
+
+    *num = 0;
+    if(!wc->routes) return NULL;
+    wg_for_each_peer(wc->dev,peer)
+        wg_for_each_allowedip(peer,ip) (*num)++;
+    if(!*num) return NULL;
+
+    routes = calloc(*num,sizeof(link_addr_t));
+    if(!routes){
+        printf("Error, out of memory listing routes\n");
+        *num = 0;
+        return NULL;
+    }
+
+    // Host bits cleared, the kernel won't take a route with any set
+    x = 0;
+    wg_for_each_peer(wc->dev,peer)
+    {
+        wg_for_each_allowedip(peer,ip)
+        {
+            routes[x].family = ip->family;
+            routes[x].cidr = ip->cidr;
+            memcpy(&routes[x].ip6,&ip->ip6,(ip->family==AF_INET)?sizeof(ip->ip4):sizeof(ip->ip6));
+            bytes = (uint8_t *)&routes[x].ip6;
+            for(bits=ip->cidr;bits<((ip->family==AF_INET)?32:128);bits++)
+                bytes[bits/8] &= ~(0x80>>(bits%8));
+            x++;
+        }
+    }
+    return routes;
+}
+
+// Private functions
+// ----------------------------------------------------------------------------
+static char * _trim(char * str)
+{
+    char * end;
+
+    while(isspace((unsigned char)*str)) str++;
+    for(end=str+strlen(str);end>str && isspace((unsigned char)end[-1]);end--);
+    *end = 0;
+    return str;
+}
+
+// address[/cidr], a bare address is a host
+static bool _parse_addr(char * str, link_addr_t * addr)
+{
+    char * slash;
+    char * end;
+    long cidr;
+    int max;
+
+    memset(addr,0,sizeof(link_addr_t));
+    slash = strchr(str,'/');
+    if(slash) *slash = 0;
+    if(inet_pton(AF_INET,str,&addr->ip4)==1){
+        addr->family = AF_INET;
+        max = 32;
+    }else if(inet_pton(AF_INET6,str,&addr->ip6)==1){
+        addr->family = AF_INET6;
+        max = 128;
+    }else{
+        return false;
+    }
+    addr->cidr = max;
+    if(slash)
+    {
+        *slash = '/';
+        cidr = strtol(slash+1,&end,10);
+        if(end==slash+1 || *end || cidr<0 || cidr>max) return false;
+        addr->cidr = cidr;
+    }
+    return true;
+}
+
+// host:port or [v6 host]:port, resolved now as wg does
+static bool _parse_endpoint(char * str, wg_peer * peer)
+{
+    struct addrinfo hints, * res;
+    char host[256];
+    char * port;
+    int ret;
+
+    if(*str=='['){
+        port = strchr(str,']');
+        if(!port || port[1]!=':') return false;
+        snprintf(host,sizeof(host),"%.*s",(int)(port-str-1),str+1);
+        port += 2;
+    }else{
+        port = strrchr(str,':');
+        if(!port) return false;
+        snprintf(host,sizeof(host),"%.*s",(int)(port-str),str);
+        port++;
+    }
+
+    memset(&hints,0,sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_protocol = IPPROTO_UDP;
+    ret = getaddrinfo(host,port,&hints,&res);
+    if(ret!=0){
+        printf("Error resolving endpoint '%s': %s\n",str,gai_strerror(ret));
+        return false;
+    }
+    if(res->ai_addrlen<=sizeof(peer->endpoint))
+        memcpy(&peer->endpoint,res->ai_addr,res->ai_addrlen);
+    freeaddrinfo(res);
+    return true;
+}
+
+static bool _parse_allowedips(char * str, wg_peer * peer, wgconf_t * wc)
+{
+    link_addr_t addr;
+    wg_allowedip * ip;
+    char * tok, * save;
+
+    for(tok=strtok_r(str,WGCONF_SEPARATORS,&save);tok;tok=strtok_r(NULL,WGCONF_SEPARATORS,&save))
+    {
+        if(!_parse_addr(tok,&addr)) return false;
+
+        ip = calloc(1,sizeof(wg_allowedip));
+        if(!ip) return false;
+        ip->family = addr.family;
+        memcpy(&ip->ip6,&addr.ip6,(addr.family==AF_INET)?sizeof(ip->ip4):sizeof(ip->ip6));
+        ip->cidr = addr.cidr;
+        if(peer->last_allowedip) peer->last_allowedip->next_allowedip = ip;
+        else peer->first_allowedip = ip;
+        peer->last_allowedip = ip;
+    }
+    peer->flags |= WGPEER_REPLACE_ALLOWEDIPS;
+    return true;
+}
+
+static bool _parse_interface(wgconf_t * wc, char * key, char * value)
+{
+    wg_device * dev = wc->dev;
+    char * tok, * save, * end;
+    long num;
+
+    if(strcasecmp(key,"PrivateKey")==0)
+    {
+        if(wg_key_from_base64(dev->private_key,value)!=0) return false;
+        wg_generate_public_key(dev->public_key,dev->private_key);
+        dev->flags |= WGDEVICE_HAS_PRIVATE_KEY;
+    }
+    else if(strcasecmp(key,"ListenPort")==0)
+    {
+        num = strtol(value,&end,10);
+        if(*end || num<0 || num>65535) return false;
+        dev->listen_port = num;
+        dev->flags |= WGDEVICE_HAS_LISTEN_PORT;
+    }
+    else if(strcasecmp(key,"FwMark")==0)
+    {
+        if(strcasecmp(value,"off")==0) num = 0;
+        else{
+            num = strtoul(value,&end,0);
+            if(*end) return false;
+        }
+        dev->fwmark = num;
+        dev->flags |= WGDEVICE_HAS_FWMARK;
+    }
+    else if(strcasecmp(key,"Address")==0)
+    {
+        for(tok=strtok_r(value,WGCONF_SEPARATORS,&save);tok;tok=strtok_r(NULL,WGCONF_SEPARATORS,&save))
+        {
+            if(wc->num_addrs==WGCONF_MAX_ADDRS) return false;
+            if(!_parse_addr(tok,&wc->addrs[wc->num_addrs])) return false;
+            wc->num_addrs++;
+        }
+    }
+    else if(strcasecmp(key,"MTU")==0)
+    {
+        num = strtol(value,&end,10);
+        if(*end || num<=0) return false;
+        wc->mtu = num;
+    }
+    else if(strcasecmp(key,"Table")==0)
+    {
+        if(strcasecmp(value,"off")==0) wc->routes = false;
+        else if(strcasecmp(value,"auto")!=0) wc->needs_quick = "Table";
+    }
+    else if(strcasecmp(key,"SaveConfig")==0)
+    {
+        if(strcasecmp(value,"true")==0) wc->needs_quick = "SaveConfig";
+    }
+    else if(strcasecmp(key,"DNS")==0 || strcasecmp(key,"PreUp")==0 ||
+            strcasecmp(key,"PostUp")==0 || strcasecmp(key,"PreDown")==0 ||
+            strcasecmp(key,"PostDown")==0)
+    {
+        wc->needs_quick = "DNS and the Up/Down hooks";
+    }
+    else
+    {
+        if(g_verbose) printf("Ignoring unknown WireGuard setting '%s'\n",key);
+    }
+    return true;
+}
+
+static bool _parse_peer(wgconf_t * wc, wg_peer * peer, char * key, char * value)
+{
+    char * end;
+    long num;
+
+    if(strcasecmp(key,"PublicKey")==0)
+    {
+        if(wg_key_from_base64(peer->public_key,value)!=0) return false;
+        peer->flags |= WGPEER_HAS_PUBLIC_KEY;
+    }
+    else if(strcasecmp(key,"PresharedKey")==0)
+    {
+        if(wg_key_from_base64(peer->preshared_key,value)!=0) return false;
+        peer->flags |= WGPEER_HAS_PRESHARED_KEY;
+    }
+    else if(strcasecmp(key,"AllowedIPs")==0)
+    {
+        return _parse_allowedips(value,peer,wc);
+    }
+    else if(strcasecmp(key,"Endpoint")==0)
+    {
+        return _parse_endpoint(value,peer);
+    }
+    else if(strcasecmp(key,"PersistentKeepalive")==0)
+    {
+        if(strcasecmp(value,"off")==0) num = 0;
+        else{
+            num = strtol(value,&end,10);
+            if(*end) return false;
+        }
+        if(num<0 || num>65535) return false;
+        peer->persistent_keepalive_interval = num;
+        peer->flags |= WGPEER_HAS_PERSISTENT_KEEPALIVE_INTERVAL;
+    }
+    else
+    {
+        if(g_verbose) printf("Ignoring unknown WireGuard peer setting '%s'\n",key);
+    }
+    return true;
+}
+
+// EOF
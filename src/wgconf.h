@@ -0,0 +1,49 @@
+/*********************************************************************
+wgnet WireGuard network utility
+
+Copyright (C) 2020 - Andrew Gaylo - drew@clisystems.com
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*******************************************************************/
+#ifndef __WGCONF_H__
+#define __WGCONF_H__
+
+#include "link.h"
+#include "wireguard.h"
+
+// wg-quick's configs, /etc/wireguard/<iface>.conf
+#define WGCONF_PATH         "/etc/wireguard"
+
+#define WGCONF_MAX_ADDRS    8
+
+typedef struct {
+    wg_device * dev;            // Key, port, fwmark and peers, for wg_set_device()
+    link_addr_t addrs[WGCONF_MAX_ADDRS];
+    int num_addrs;
+    int mtu;                    // 0 if the config leaves it to the kernel
+    bool routes;                // Add a route for each peer's allowed IPs
+    const char * needs_quick;   // Setting only wg-quick can handle, if any
+} wgconf_t;
+
+// Parse the interface's wg-quick config.  False if it's missing or broken
+bool wgconf_load(wgconf_t * wc, char * iface);
+void wgconf_free(wgconf_t * wc);
+
+// The routes the peers' allowed IPs need, none with Table=off.  Returns
+// an array to free, NULL if there are none or out of memory
+link_addr_t * wgconf_routes(wgconf_t * wc, int * num);
+
+#endif
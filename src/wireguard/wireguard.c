@@ -21,8 +21,10 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "wireguard.h"
+#include "mnl.h"
 
 /* wireguard.h netlink uapi: */
 
@@ -78,607 +80,52 @@ enum wgallowedip_attribute {
 	__WGALLOWEDIP_A_LAST
 };
 
-/* libmnl mini library: */
-
-#define MNL_SOCKET_AUTOPID 0
-#define MNL_ALIGNTO 4
-#define MNL_ALIGN(len) (((len)+MNL_ALIGNTO-1) & ~(MNL_ALIGNTO-1))
-#define MNL_NLMSG_HDRLEN MNL_ALIGN(sizeof(struct nlmsghdr))
-#define MNL_ATTR_HDRLEN MNL_ALIGN(sizeof(struct nlattr))
-
-enum mnl_attr_data_type {
-	MNL_TYPE_UNSPEC,
-	MNL_TYPE_U8,
-	MNL_TYPE_U16,
-	MNL_TYPE_U32,
-	MNL_TYPE_U64,
-	MNL_TYPE_STRING,
-	MNL_TYPE_FLAG,
-	MNL_TYPE_MSECS,
-	MNL_TYPE_NESTED,
-	MNL_TYPE_NESTED_COMPAT,
-	MNL_TYPE_NUL_STRING,
-	MNL_TYPE_BINARY,
-	MNL_TYPE_MAX,
-};
-
-#define mnl_attr_for_each(attr, nlh, offset) \
-	for ((attr) = mnl_nlmsg_get_payload_offset((nlh), (offset)); \
-	     mnl_attr_ok((attr), (char *)mnl_nlmsg_get_payload_tail(nlh) - (char *)(attr)); \
-	     (attr) = mnl_attr_next(attr))
-
-#define mnl_attr_for_each_nested(attr, nest) \
-	for ((attr) = mnl_attr_get_payload(nest); \
-	     mnl_attr_ok((attr), (char *)mnl_attr_get_payload(nest) + mnl_attr_get_payload_len(nest) - (char *)(attr)); \
-	     (attr) = mnl_attr_next(attr))
-
-#define mnl_attr_for_each_payload(payload, payload_size) \
-	for ((attr) = (payload); \
-	     mnl_attr_ok((attr), (char *)(payload) + payload_size - (char *)(attr)); \
-	     (attr) = mnl_attr_next(attr))
-
-#define MNL_CB_ERROR	-1
-#define MNL_CB_STOP	0
-#define MNL_CB_OK	1
-
-typedef int (*mnl_attr_cb_t)(const struct nlattr *attr, void *data);
-typedef int (*mnl_cb_t)(const struct nlmsghdr *nlh, void *data);
-
-#ifndef MNL_ARRAY_SIZE
-#define MNL_ARRAY_SIZE(a) (sizeof(a)/sizeof((a)[0]))
-#endif
-
-static size_t mnl_ideal_socket_buffer_size(void)
-{
-	static size_t size = 0;
-
-	if (size)
-		return size;
-	size = (size_t)sysconf(_SC_PAGESIZE);
-	if (size > 8192)
-		size = 8192;
-	return size;
-}
-
-static size_t mnl_nlmsg_size(size_t len)
-{
-	return len + MNL_NLMSG_HDRLEN;
-}
-
-static struct nlmsghdr *mnl_nlmsg_put_header(void *buf)
-{
-	int len = MNL_ALIGN(sizeof(struct nlmsghdr));
-	struct nlmsghdr *nlh = buf;
-
-	memset(buf, 0, len);
-	nlh->nlmsg_len = len;
-	return nlh;
-}
-
-static void *mnl_nlmsg_put_extra_header(struct nlmsghdr *nlh, size_t size)
-{
-	char *ptr = (char *)nlh + nlh->nlmsg_len;
-	size_t len = MNL_ALIGN(size);
-	nlh->nlmsg_len += len;
-	memset(ptr, 0, len);
-	return ptr;
-}
-
-static void *mnl_nlmsg_get_payload(const struct nlmsghdr *nlh)
-{
-	return (void *)nlh + MNL_NLMSG_HDRLEN;
-}
-
-static void *mnl_nlmsg_get_payload_offset(const struct nlmsghdr *nlh, size_t offset)
-{
-	return (void *)nlh + MNL_NLMSG_HDRLEN + MNL_ALIGN(offset);
-}
-
-static bool mnl_nlmsg_ok(const struct nlmsghdr *nlh, int len)
-{
-	return len >= (int)sizeof(struct nlmsghdr) &&
-	       nlh->nlmsg_len >= sizeof(struct nlmsghdr) &&
-	       (int)nlh->nlmsg_len <= len;
-}
-
-static struct nlmsghdr *mnl_nlmsg_next(const struct nlmsghdr *nlh, int *len)
-{
-	*len -= MNL_ALIGN(nlh->nlmsg_len);
-	return (struct nlmsghdr *)((void *)nlh + MNL_ALIGN(nlh->nlmsg_len));
-}
-
-static void *mnl_nlmsg_get_payload_tail(const struct nlmsghdr *nlh)
-{
-	return (void *)nlh + MNL_ALIGN(nlh->nlmsg_len);
-}
-
-static bool mnl_nlmsg_seq_ok(const struct nlmsghdr *nlh, unsigned int seq)
-{
-	return nlh->nlmsg_seq && seq ? nlh->nlmsg_seq == seq : true;
-}
-
-static bool mnl_nlmsg_portid_ok(const struct nlmsghdr *nlh, unsigned int portid)
-{
-	return nlh->nlmsg_pid && portid ? nlh->nlmsg_pid == portid : true;
-}
-
-static uint16_t mnl_attr_get_type(const struct nlattr *attr)
-{
-	return attr->nla_type & NLA_TYPE_MASK;
-}
-
-static uint16_t mnl_attr_get_payload_len(const struct nlattr *attr)
-{
-	return attr->nla_len - MNL_ATTR_HDRLEN;
-}
-
-static void *mnl_attr_get_payload(const struct nlattr *attr)
-{
-	return (void *)attr + MNL_ATTR_HDRLEN;
-}
-
-static bool mnl_attr_ok(const struct nlattr *attr, int len)
-{
-	return len >= (int)sizeof(struct nlattr) &&
-	       attr->nla_len >= sizeof(struct nlattr) &&
-	       (int)attr->nla_len <= len;
-}
-
-static struct nlattr *mnl_attr_next(const struct nlattr *attr)
-{
-	return (struct nlattr *)((void *)attr + MNL_ALIGN(attr->nla_len));
-}
-
-static int mnl_attr_type_valid(const struct nlattr *attr, uint16_t max)
-{
-	if (mnl_attr_get_type(attr) > max) {
-		errno = EOPNOTSUPP;
-		return -1;
-	}
-	return 1;
-}
-
-static int __mnl_attr_validate(const struct nlattr *attr,
-			       enum mnl_attr_data_type type, size_t exp_len)
-{
-	uint16_t attr_len = mnl_attr_get_payload_len(attr);
-	const char *attr_data = mnl_attr_get_payload(attr);
-
-	if (attr_len < exp_len) {
-		errno = ERANGE;
-		return -1;
-	}
-	switch(type) {
-	case MNL_TYPE_FLAG:
-		if (attr_len > 0) {
-			errno = ERANGE;
-			return -1;
-		}
-		break;
-	case MNL_TYPE_NUL_STRING:
-		if (attr_len == 0) {
-			errno = ERANGE;
-			return -1;
-		}
-		if (attr_data[attr_len-1] != '\0') {
-			errno = EINVAL;
-			return -1;
-		}
-		break;
-	case MNL_TYPE_STRING:
-		if (attr_len == 0) {
-			errno = ERANGE;
-			return -1;
-		}
-		break;
-	case MNL_TYPE_NESTED:
-
-		if (attr_len == 0)
-			break;
-
-		if (attr_len < MNL_ATTR_HDRLEN) {
-			errno = ERANGE;
-			return -1;
-		}
-		break;
-	default:
-
-		break;
-	}
-	if (exp_len && attr_len > exp_len) {
-		errno = ERANGE;
-		return -1;
-	}
-	return 0;
-}
-
-static const size_t mnl_attr_data_type_len[MNL_TYPE_MAX] = {
-	[MNL_TYPE_U8]		= sizeof(uint8_t),
-	[MNL_TYPE_U16]		= sizeof(uint16_t),
-	[MNL_TYPE_U32]		= sizeof(uint32_t),
-	[MNL_TYPE_U64]		= sizeof(uint64_t),
-	[MNL_TYPE_MSECS]	= sizeof(uint64_t),
-};
-
-static int mnl_attr_validate(const struct nlattr *attr, enum mnl_attr_data_type type)
-{
-	int exp_len;
-
-	if (type >= MNL_TYPE_MAX) {
-		errno = EINVAL;
-		return -1;
-	}
-	exp_len = mnl_attr_data_type_len[type];
-	return __mnl_attr_validate(attr, type, exp_len);
-}
-
-static int mnl_attr_parse(const struct nlmsghdr *nlh, unsigned int offset,
-			  mnl_attr_cb_t cb, void *data)
-{
-	int ret = MNL_CB_OK;
-	const struct nlattr *attr;
-
-	mnl_attr_for_each(attr, nlh, offset)
-		if ((ret = cb(attr, data)) <= MNL_CB_STOP)
-			return ret;
-	return ret;
-}
-
-static int mnl_attr_parse_nested(const struct nlattr *nested, mnl_attr_cb_t cb,
-				 void *data)
-{
-	int ret = MNL_CB_OK;
-	const struct nlattr *attr;
-
-	mnl_attr_for_each_nested(attr, nested)
-		if ((ret = cb(attr, data)) <= MNL_CB_STOP)
-			return ret;
-	return ret;
-}
-
-static uint8_t mnl_attr_get_u8(const struct nlattr *attr)
-{
-	return *((uint8_t *)mnl_attr_get_payload(attr));
-}
-
-static uint16_t mnl_attr_get_u16(const struct nlattr *attr)
-{
-	return *((uint16_t *)mnl_attr_get_payload(attr));
-}
-
-static uint32_t mnl_attr_get_u32(const struct nlattr *attr)
-{
-	return *((uint32_t *)mnl_attr_get_payload(attr));
-}
-
-static uint64_t mnl_attr_get_u64(const struct nlattr *attr)
-{
-	uint64_t tmp;
-	memcpy(&tmp, mnl_attr_get_payload(attr), sizeof(tmp));
-	return tmp;
-}
-
-static const char *mnl_attr_get_str(const struct nlattr *attr)
-{
-	return mnl_attr_get_payload(attr);
-}
-
-static void mnl_attr_put(struct nlmsghdr *nlh, uint16_t type, size_t len,
-			 const void *data)
-{
-	struct nlattr *attr = mnl_nlmsg_get_payload_tail(nlh);
-	uint16_t payload_len = MNL_ALIGN(sizeof(struct nlattr)) + len;
-	int pad;
-
-	attr->nla_type = type;
-	attr->nla_len = payload_len;
-	memcpy(mnl_attr_get_payload(attr), data, len);
-	nlh->nlmsg_len += MNL_ALIGN(payload_len);
-	pad = MNL_ALIGN(len) - len;
-	if (pad > 0)
-		memset(mnl_attr_get_payload(attr) + len, 0, pad);
-}
-
-static void mnl_attr_put_u16(struct nlmsghdr *nlh, uint16_t type, uint16_t data)
-{
-	mnl_attr_put(nlh, type, sizeof(uint16_t), &data);
-}
-
-static void mnl_attr_put_u32(struct nlmsghdr *nlh, uint16_t type, uint32_t data)
-{
-	mnl_attr_put(nlh, type, sizeof(uint32_t), &data);
-}
-
-static void mnl_attr_put_strz(struct nlmsghdr *nlh, uint16_t type, const char *data)
-{
-	mnl_attr_put(nlh, type, strlen(data)+1, data);
-}
-
-static struct nlattr *mnl_attr_nest_start(struct nlmsghdr *nlh, uint16_t type)
-{
-	struct nlattr *start = mnl_nlmsg_get_payload_tail(nlh);
-
-	start->nla_type = NLA_F_NESTED | type;
-	nlh->nlmsg_len += MNL_ALIGN(sizeof(struct nlattr));
-	return start;
-}
-
-static bool mnl_attr_put_check(struct nlmsghdr *nlh, size_t buflen,
-			       uint16_t type, size_t len, const void *data)
-{
-	if (nlh->nlmsg_len + MNL_ATTR_HDRLEN + MNL_ALIGN(len) > buflen)
-		return false;
-	mnl_attr_put(nlh, type, len, data);
-	return true;
-}
-
-static bool mnl_attr_put_u8_check(struct nlmsghdr *nlh, size_t buflen,
-				  uint16_t type, uint8_t data)
-{
-	return mnl_attr_put_check(nlh, buflen, type, sizeof(uint8_t), &data);
-}
-
-static bool mnl_attr_put_u16_check(struct nlmsghdr *nlh, size_t buflen,
-				   uint16_t type, uint16_t data)
-{
-	return mnl_attr_put_check(nlh, buflen, type, sizeof(uint16_t), &data);
-}
-
-static bool mnl_attr_put_u32_check(struct nlmsghdr *nlh, size_t buflen,
-				   uint16_t type, uint32_t data)
-{
-	return mnl_attr_put_check(nlh, buflen, type, sizeof(uint32_t), &data);
-}
-
-static struct nlattr *mnl_attr_nest_start_check(struct nlmsghdr *nlh, size_t buflen,
-						uint16_t type)
-{
-	if (nlh->nlmsg_len + MNL_ATTR_HDRLEN > buflen)
-		return NULL;
-	return mnl_attr_nest_start(nlh, type);
-}
-
-static void mnl_attr_nest_end(struct nlmsghdr *nlh, struct nlattr *start)
-{
-	start->nla_len = mnl_nlmsg_get_payload_tail(nlh) - (void *)start;
-}
-
-static void mnl_attr_nest_cancel(struct nlmsghdr *nlh, struct nlattr *start)
-{
-	nlh->nlmsg_len -= mnl_nlmsg_get_payload_tail(nlh) - (void *)start;
-}
-
-static int mnl_cb_noop(__attribute__((unused)) const struct nlmsghdr *nlh, __attribute__((unused)) void *data)
-{
-	return MNL_CB_OK;
-}
-
-static int mnl_cb_error(const struct nlmsghdr *nlh, __attribute__((unused)) void *data)
-{
-	const struct nlmsgerr *err = mnl_nlmsg_get_payload(nlh);
-
-	if (nlh->nlmsg_len < mnl_nlmsg_size(sizeof(struct nlmsgerr))) {
-		errno = EBADMSG;
-		return MNL_CB_ERROR;
-	}
-
-	if (err->error < 0)
-		errno = -err->error;
-	else
-		errno = err->error;
-
-	return err->error == 0 ? MNL_CB_STOP : MNL_CB_ERROR;
-}
-
-static int mnl_cb_stop(__attribute__((unused)) const struct nlmsghdr *nlh, __attribute__((unused)) void *data)
-{
-	return MNL_CB_STOP;
-}
-
-static const mnl_cb_t default_cb_array[NLMSG_MIN_TYPE] = {
-	[NLMSG_NOOP]	= mnl_cb_noop,
-	[NLMSG_ERROR]	= mnl_cb_error,
-	[NLMSG_DONE]	= mnl_cb_stop,
-	[NLMSG_OVERRUN]	= mnl_cb_noop,
-};
-
-static int __mnl_cb_run(const void *buf, size_t numbytes,
-			unsigned int seq, unsigned int portid,
-			mnl_cb_t cb_data, void *data,
-			const mnl_cb_t *cb_ctl_array,
-			unsigned int cb_ctl_array_len)
-{
-	int ret = MNL_CB_OK, len = numbytes;
-	const struct nlmsghdr *nlh = buf;
-
-	while (mnl_nlmsg_ok(nlh, len)) {
-
-		if (!mnl_nlmsg_portid_ok(nlh, portid)) {
-			errno = ESRCH;
-			return -1;
-		}
-
-		if (!mnl_nlmsg_seq_ok(nlh, seq)) {
-			errno = EPROTO;
-			return -1;
-		}
-
-		if (nlh->nlmsg_flags & NLM_F_DUMP_INTR) {
-			errno = EINTR;
-			return -1;
-		}
-
-		if (nlh->nlmsg_type >= NLMSG_MIN_TYPE) {
-			if (cb_data){
-				ret = cb_data(nlh, data);
-				if (ret <= MNL_CB_STOP)
-					goto out;
-			}
-		} else if (nlh->nlmsg_type < cb_ctl_array_len) {
-			if (cb_ctl_array && cb_ctl_array[nlh->nlmsg_type]) {
-				ret = cb_ctl_array[nlh->nlmsg_type](nlh, data);
-				if (ret <= MNL_CB_STOP)
-					goto out;
-			}
-		} else if (default_cb_array[nlh->nlmsg_type]) {
-			ret = default_cb_array[nlh->nlmsg_type](nlh, data);
-			if (ret <= MNL_CB_STOP)
-				goto out;
-		}
-		nlh = mnl_nlmsg_next(nlh, &len);
-	}
-out:
-	return ret;
-}
-
-static int mnl_cb_run2(const void *buf, size_t numbytes, unsigned int seq,
-		       unsigned int portid, mnl_cb_t cb_data, void *data,
-		       const mnl_cb_t *cb_ctl_array, unsigned int cb_ctl_array_len)
-{
-	return __mnl_cb_run(buf, numbytes, seq, portid, cb_data, data,
-			    cb_ctl_array, cb_ctl_array_len);
-}
-
-static int mnl_cb_run(const void *buf, size_t numbytes, unsigned int seq,
-		      unsigned int portid, mnl_cb_t cb_data, void *data)
-{
-	return __mnl_cb_run(buf, numbytes, seq, portid, cb_data, data, NULL, 0);
-}
+/* mnlg mini library: */
 
-struct mnl_socket {
-	int 			fd;
-	struct sockaddr_nl	addr;
+/* Replies are read into batch slots of slot_len bytes each, with one
+ * recvmmsg() taking as many datagrams as are queued.  The kernel fills dump
+ * datagrams up to the size of the reads it sees, at most 32k, so a slot of
+ * that size takes each one whole. */
+#define WG_RECV_SLOT 32768
+#define WG_RECV_MAX_BATCH 64
+
+/* Sets are split in messages of up to 32k, attribute lengths being 16 bit,
+ * and sent up to 64 or a send buffer's worth at a time */
+#define WG_SET_CHUNK 32768
+#define WG_SET_WINDOW 64
+#define WG_SET_SNDBUF (1 << 21)
+
+static const wg_recv_config default_recv_config = {
+	.rcvbuf = 1 << 20,
+	.batch = 8,
+	.peek = false,	/* Costs a syscall, dump datagrams fit a slot anyway */
+	.pipeline = false,
 };
 
-static unsigned int mnl_socket_get_portid(const struct mnl_socket *nl)
-{
-	return nl->addr.nl_pid;
-}
-
-static struct mnl_socket *__mnl_socket_open(int bus, int flags)
-{
-	struct mnl_socket *nl;
-
-	nl = calloc(1, sizeof(struct mnl_socket));
-	if (nl == NULL)
-		return NULL;
-
-	nl->fd = socket(AF_NETLINK, SOCK_RAW | flags, bus);
-	if (nl->fd == -1) {
-		free(nl);
-		return NULL;
-	}
-
-	return nl;
-}
-
-static struct mnl_socket *mnl_socket_open(int bus)
-{
-	return __mnl_socket_open(bus, 0);
-}
-
-static int mnl_socket_bind(struct mnl_socket *nl, unsigned int groups, pid_t pid)
-{
-	int ret;
-	socklen_t addr_len;
-
-	nl->addr.nl_family = AF_NETLINK;
-	nl->addr.nl_groups = groups;
-	nl->addr.nl_pid = pid;
-
-	ret = bind(nl->fd, (struct sockaddr *) &nl->addr, sizeof (nl->addr));
-	if (ret < 0)
-		return ret;
-
-	addr_len = sizeof(nl->addr);
-	ret = getsockname(nl->fd, (struct sockaddr *) &nl->addr, &addr_len);
-	if (ret < 0)
-		return ret;
-
-	if (addr_len != sizeof(nl->addr)) {
-		errno = EINVAL;
-		return -1;
-	}
-	if (nl->addr.nl_family != AF_NETLINK) {
-		errno = EINVAL;
-		return -1;
-	}
-	return 0;
-}
-
-static ssize_t mnl_socket_sendto(const struct mnl_socket *nl, const void *buf,
-				 size_t len)
-{
-	static const struct sockaddr_nl snl = {
-		.nl_family = AF_NETLINK
-	};
-	return sendto(nl->fd, buf, len, 0,
-		      (struct sockaddr *) &snl, sizeof(snl));
-}
-
-static ssize_t mnl_socket_recvfrom(const struct mnl_socket *nl, void *buf,
-				   size_t bufsiz)
-{
-	ssize_t ret;
-	struct sockaddr_nl addr;
-	struct iovec iov = {
-		.iov_base	= buf,
-		.iov_len	= bufsiz,
-	};
-	struct msghdr msg = {
-		.msg_name	= &addr,
-		.msg_namelen	= sizeof(struct sockaddr_nl),
-		.msg_iov	= &iov,
-		.msg_iovlen	= 1,
-		.msg_control	= NULL,
-		.msg_controllen	= 0,
-		.msg_flags	= 0,
-	};
-	ret = recvmsg(nl->fd, &msg, 0);
-	if (ret == -1)
-		return ret;
-
-	if (msg.msg_flags & MSG_TRUNC) {
-		errno = ENOSPC;
-		return -1;
-	}
-	if (msg.msg_namelen != sizeof(struct sockaddr_nl)) {
-		errno = EINVAL;
-		return -1;
-	}
-	return ret;
-}
-
-static int mnl_socket_close(struct mnl_socket *nl)
-{
-	int ret = close(nl->fd);
-	free(nl);
-	return ret;
-}
-
-/* mnlg mini library: */
-
 struct mnlg_socket {
 	struct mnl_socket *nl;
 	char *buf;
+	char *rbuf;
+	size_t slot_len;
+	wg_recv_config recv;
+	wg_recv_stats stats;
 	uint16_t id;
 	uint8_t version;
 	unsigned int seq;
 	unsigned int portid;
 };
 
-static struct nlmsghdr *__mnlg_msg_prepare(struct mnlg_socket *nlg, uint8_t cmd,
-					   uint16_t flags, uint16_t id,
-					   uint8_t version)
+static struct nlmsghdr *mnlg_msg_prepare_buf(struct mnlg_socket *nlg, char *buf, uint8_t cmd,
+					     uint16_t flags, uint16_t id,
+					     uint8_t version)
 {
 	struct nlmsghdr *nlh;
 	struct genlmsghdr *genl;
 
-	nlh = mnl_nlmsg_put_header(nlg->buf);
+	nlh = mnl_nlmsg_put_header(buf);
 	nlh->nlmsg_type	= id;
 	nlh->nlmsg_flags = flags;
-	nlg->seq = time(NULL);
-	nlh->nlmsg_seq = nlg->seq;
+	nlh->nlmsg_seq = ++nlg->seq;
 
 	genl = mnl_nlmsg_put_extra_header(nlh, sizeof(struct genlmsghdr));
 	genl->cmd = cmd;
@@ -687,6 +134,13 @@ static struct nlmsghdr *__mnlg_msg_prepare(struct mnlg_socket *nlg, uint8_t cmd,
 	return nlh;
 }
 
+static struct nlmsghdr *__mnlg_msg_prepare(struct mnlg_socket *nlg, uint8_t cmd,
+					   uint16_t flags, uint16_t id,
+					   uint8_t version)
+{
+	return mnlg_msg_prepare_buf(nlg, nlg->buf, cmd, flags, id, version);
+}
+
 static struct nlmsghdr *mnlg_msg_prepare(struct mnlg_socket *nlg, uint8_t cmd,
 					 uint16_t flags)
 {
@@ -746,22 +200,248 @@ static const mnl_cb_t mnlg_cb_array[] = {
 	[NLMSG_OVERRUN]	= mnlg_cb_noop,
 };
 
+static int mnlg_socket_set_recv(struct mnlg_socket *nlg, const wg_recv_config *config, size_t slot_len)
+{
+	wg_recv_config recv = *config;
+	char *rbuf;
+
+	if (recv.batch < 1)
+		recv.batch = 1;
+	if (recv.batch > WG_RECV_MAX_BATCH)
+		recv.batch = WG_RECV_MAX_BATCH;
+	if (slot_len < WG_RECV_SLOT)
+		slot_len = WG_RECV_SLOT;
+	rbuf = malloc(recv.batch * slot_len);
+	if (!rbuf)
+		return -ENOMEM;
+	free(nlg->rbuf);
+	nlg->rbuf = rbuf;
+	nlg->slot_len = slot_len;
+
+	/* Past rmem_max only root can force it, otherwise take what is allowed */
+	if (recv.rcvbuf > 0 && recv.rcvbuf != nlg->recv.rcvbuf &&
+	    setsockopt(nlg->nl->fd, SOL_SOCKET, SO_RCVBUFFORCE, &recv.rcvbuf, sizeof(recv.rcvbuf)) < 0)
+		setsockopt(nlg->nl->fd, SOL_SOCKET, SO_RCVBUF, &recv.rcvbuf, sizeof(recv.rcvbuf));
+	nlg->recv = recv;
+	return 0;
+}
+
 static int mnlg_socket_recv_run(struct mnlg_socket *nlg, mnl_cb_t data_cb, void *data)
 {
-	int err;
+	struct sockaddr_nl addrs[WG_RECV_MAX_BATCH];
+	struct iovec iov[WG_RECV_MAX_BATCH];
+	struct mmsghdr msgs[WG_RECV_MAX_BATCH];
+	bool first = true;
+	ssize_t len;
+	unsigned int i;
+	int n, err;
 
 	do {
-		err = mnl_socket_recvfrom(nlg->nl, nlg->buf,
-					  mnl_ideal_socket_buffer_size());
-		if (err <= 0)
-			break;
-		err = mnl_cb_run2(nlg->buf, err, nlg->seq, nlg->portid,
-				  data_cb, data, mnlg_cb_array, MNL_ARRAY_SIZE(mnlg_cb_array));
+		/* The first reply can be any size, grow the slots to fit it */
+		if (first && nlg->recv.peek) {
+			len = recv(nlg->nl->fd, NULL, 0, MSG_PEEK | MSG_TRUNC);
+			++nlg->stats.syscalls;
+			if (len < 0)
+				return -1;
+			if ((size_t)len > nlg->slot_len && mnlg_socket_set_recv(nlg, &nlg->recv, len) < 0) {
+				errno = ENOMEM;
+				return -1;
+			}
+		}
+		first = false;
+
+		memset(msgs, 0, nlg->recv.batch * sizeof(msgs[0]));
+		for (i = 0; i < nlg->recv.batch; ++i) {
+			iov[i].iov_base = nlg->rbuf + i * nlg->slot_len;
+			iov[i].iov_len = nlg->slot_len;
+			msgs[i].msg_hdr.msg_name = &addrs[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		n = recvmmsg(nlg->nl->fd, msgs, nlg->recv.batch, MSG_WAITFORONE, NULL);
+		++nlg->stats.syscalls;
+		if (n <= 0)
+			return n;
+
+		err = MNL_CB_OK;
+		for (i = 0; i < (unsigned int)n && err > 0; ++i) {
+			if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+				errno = ENOSPC;
+				return -1;
+			}
+			if (msgs[i].msg_hdr.msg_namelen != sizeof(struct sockaddr_nl)) {
+				errno = EINVAL;
+				return -1;
+			}
+			++nlg->stats.datagrams;
+			nlg->stats.bytes += msgs[i].msg_len;
+			err = mnl_cb_run2(iov[i].iov_base, msgs[i].msg_len, nlg->seq, nlg->portid,
+					  data_cb, data, mnlg_cb_array, MNL_ARRAY_SIZE(mnlg_cb_array));
+		}
 	} while (err > 0);
 
 	return err;
 }
 
+/* A dump read on a thread of its own into a ring of slots while the caller
+ * parses the slots already filled, so the kernel builds the next datagram
+ * while the last one is parsed. */
+#define WG_PIPE_SLOTS 16
+
+struct recv_pipe {
+	struct mnlg_socket *nlg;
+	pthread_mutex_t lock;
+	pthread_cond_t filled, drained;
+	char *ring;
+	size_t lens[WG_PIPE_SLOTS];
+	unsigned int head, tail;	/* Next slot to fill and to parse */
+	int err;			/* errno the receiver stopped on */
+	bool done;
+};
+
+/* The last datagram of a dump, or a reply that is no dump at all */
+static bool datagram_ends_dump(const char *buf, int len)
+{
+	const struct nlmsghdr *nlh = (const struct nlmsghdr *)buf;
+
+	while (mnl_nlmsg_ok(nlh, len)) {
+		if (nlh->nlmsg_type == NLMSG_DONE || nlh->nlmsg_type == NLMSG_ERROR || !(nlh->nlmsg_flags & NLM_F_MULTI))
+			return true;
+		nlh = mnl_nlmsg_next(nlh, &len);
+	}
+	return false;
+}
+
+static void *recv_pipe_thread(void *arg)
+{
+	struct recv_pipe *rx = arg;
+	struct mnlg_socket *nlg = rx->nlg;
+	struct iovec iov[WG_RECV_MAX_BATCH];
+	struct mmsghdr msgs[WG_RECV_MAX_BATCH];
+	unsigned int first, count, i;
+	bool done = false;
+	int n, err = 0;
+
+	while (!done && !err) {
+		pthread_mutex_lock(&rx->lock);
+		while (rx->head - rx->tail == WG_PIPE_SLOTS)
+			pthread_cond_wait(&rx->drained, &rx->lock);
+		first = rx->head % WG_PIPE_SLOTS;
+		count = WG_PIPE_SLOTS - (rx->head - rx->tail);
+		pthread_mutex_unlock(&rx->lock);
+
+		/* Only the free slots up to the end of the ring, in one syscall */
+		if (count > WG_PIPE_SLOTS - first)
+			count = WG_PIPE_SLOTS - first;
+		if (count > nlg->recv.batch)
+			count = nlg->recv.batch;
+		memset(msgs, 0, count * sizeof(msgs[0]));
+		for (i = 0; i < count; ++i) {
+			iov[i].iov_base = rx->ring + (first + i) * nlg->slot_len;
+			iov[i].iov_len = nlg->slot_len;
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		n = recvmmsg(nlg->nl->fd, msgs, count, MSG_WAITFORONE, NULL);
+		++nlg->stats.syscalls;
+		if (n <= 0) {
+			err = n < 0 ? errno : EINVAL;
+			n = 0;
+		}
+		for (i = 0; i < (unsigned int)n; ++i) {
+			if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+				err = ENOSPC;
+				n = i;
+				break;
+			}
+			rx->lens[first + i] = msgs[i].msg_len;
+			++nlg->stats.datagrams;
+			nlg->stats.bytes += msgs[i].msg_len;
+			if (datagram_ends_dump(iov[i].iov_base, msgs[i].msg_len)) {
+				done = true;
+				n = i + 1;
+				break;
+			}
+		}
+
+		pthread_mutex_lock(&rx->lock);
+		rx->head += n;
+		rx->err = err;
+		rx->done = done || err;
+		pthread_cond_signal(&rx->filled);
+		pthread_mutex_unlock(&rx->lock);
+	}
+	return NULL;
+}
+
+static int mnlg_socket_recv_pipe(struct mnlg_socket *nlg, mnl_cb_t data_cb, void *data)
+{
+	struct recv_pipe rx = { .nlg = nlg };
+	pthread_t thread;
+	unsigned int slot;
+	int err = MNL_CB_OK, saved_errno = 0;
+	size_t len;
+
+	rx.ring = malloc(WG_PIPE_SLOTS * nlg->slot_len);
+	if (!rx.ring)
+		return mnlg_socket_recv_run(nlg, data_cb, data);
+	pthread_mutex_init(&rx.lock, NULL);
+	pthread_cond_init(&rx.filled, NULL);
+	pthread_cond_init(&rx.drained, NULL);
+	if (pthread_create(&thread, NULL, recv_pipe_thread, &rx)) {
+		err = mnlg_socket_recv_run(nlg, data_cb, data);
+		saved_errno = errno;
+		goto out;
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&rx.lock);
+		while (rx.head == rx.tail && !rx.done)
+			pthread_cond_wait(&rx.filled, &rx.lock);
+		if (rx.head == rx.tail) {
+			pthread_mutex_unlock(&rx.lock);
+			break;
+		}
+		slot = rx.tail % WG_PIPE_SLOTS;
+		len = rx.lens[slot];
+		pthread_mutex_unlock(&rx.lock);
+
+		/* After an error the rest is only read to the end of the dump */
+		if (err > 0) {
+			err = mnl_cb_run2(rx.ring + slot * nlg->slot_len, len, nlg->seq, nlg->portid,
+					  data_cb, data, mnlg_cb_array, MNL_ARRAY_SIZE(mnlg_cb_array));
+			saved_errno = errno;
+		}
+
+		pthread_mutex_lock(&rx.lock);
+		++rx.tail;
+		pthread_cond_signal(&rx.drained);
+		pthread_mutex_unlock(&rx.lock);
+	}
+	pthread_join(thread, NULL);
+	if (rx.err && err > 0) {
+		err = -1;
+		saved_errno = rx.err;
+	}
+
+out:
+	pthread_cond_destroy(&rx.drained);
+	pthread_cond_destroy(&rx.filled);
+	pthread_mutex_destroy(&rx.lock);
+	free(rx.ring);
+	errno = saved_errno;
+	return err;
+}
+
+/* Device dumps go through the pipeline when it is turned on */
+static int mnlg_socket_recv_dump(struct mnlg_socket *nlg, mnl_cb_t data_cb, void *data)
+{
+	if (nlg->recv.pipeline)
+		return mnlg_socket_recv_pipe(nlg, data_cb, data);
+	return mnlg_socket_recv_run(nlg, data_cb, data);
+}
+
 static int get_family_id_attr_cb(const struct nlattr *attr, void *data)
 {
 	const struct nlattr **tb = data;
@@ -795,10 +475,9 @@ static struct mnlg_socket *mnlg_socket_open(const char *family_name, uint8_t ver
 	struct nlmsghdr *nlh;
 	int err;
 
-	nlg = malloc(sizeof(*nlg));
+	nlg = calloc(1, sizeof(*nlg));
 	if (!nlg)
 		return NULL;
-	nlg->id = 0;
 
 	err = -ENOMEM;
 	nlg->buf = malloc(mnl_ideal_socket_buffer_size());
@@ -816,7 +495,12 @@ static struct mnlg_socket *mnlg_socket_open(const char *family_name, uint8_t ver
 		goto err_mnl_socket_bind;
 	}
 
+	err = mnlg_socket_set_recv(nlg, &default_recv_config, WG_RECV_SLOT);
+	if (err)
+		goto err_mnl_socket_bind;
+
 	nlg->portid = mnl_socket_get_portid(nlg->nl);
+	nlg->seq = time(NULL);
 
 	nlh = __mnlg_msg_prepare(nlg, CTRL_CMD_GETFAMILY,
 				 NLM_F_REQUEST | NLM_F_ACK, GENL_ID_CTRL, 1);
@@ -843,6 +527,7 @@ err_mnlg_socket_send:
 err_mnl_socket_bind:
 	mnl_socket_close(nlg->nl);
 err_mnl_socket_open:
+	free(nlg->rbuf);
 	free(nlg->buf);
 err_buf_alloc:
 	free(nlg);
@@ -853,12 +538,124 @@ err_buf_alloc:
 static void mnlg_socket_close(struct mnlg_socket *nlg)
 {
 	mnl_socket_close(nlg->nl);
+	free(nlg->rbuf);
 	free(nlg->buf);
 	free(nlg);
 }
 
+/* Throw away whatever a failed request left queued, so the next request on
+ * a reused socket only sees its own replies. */
+static void mnlg_socket_drain(struct mnlg_socket *nlg)
+{
+	while (recv(nlg->nl->fd, NULL, 0, MSG_DONTWAIT | MSG_TRUNC) >= 0)
+		;
+}
+
+/* arena allocator: */
+
+/* A device read from the kernel lives in one arena, its peers and allowed IPs
+ * bump allocated out of a few large chunks and released all at once.  A reset
+ * keeps the chunks so the next poll of the device reuses them. */
+
+#define WG_ARENA_CHUNK (64 * 1024)
+#define WG_ARENA_MAX_CHUNK (4 * 1024 * 1024)
+#define WG_ARENA_ALIGN 16
+
+struct wg_arena_chunk {
+	struct wg_arena_chunk *next;
+	size_t size;
+	size_t used;
+	_Alignas(WG_ARENA_ALIGN) uint8_t data[];
+};
+
+struct wg_arena {
+	struct wg_arena_chunk *first, *current;
+};
+
+static struct wg_arena_chunk *arena_chunk_new(size_t size)
+{
+	struct wg_arena_chunk *chunk = malloc(sizeof(*chunk) + size);
+
+	if (!chunk)
+		return NULL;
+	chunk->next = NULL;
+	chunk->size = size;
+	chunk->used = 0;
+	return chunk;
+}
+
+static struct wg_arena *arena_new(void)
+{
+	struct wg_arena *arena = calloc(1, sizeof(*arena));
+
+	if (!arena)
+		return NULL;
+	arena->first = arena->current = arena_chunk_new(WG_ARENA_CHUNK);
+	if (!arena->first) {
+		free(arena);
+		return NULL;
+	}
+	return arena;
+}
+
+static void arena_reset(struct wg_arena *arena)
+{
+	struct wg_arena_chunk *chunk;
+
+	for (chunk = arena->first; chunk; chunk = chunk->next)
+		chunk->used = 0;
+	arena->current = arena->first;
+}
+
+static void arena_destroy(struct wg_arena *arena)
+{
+	struct wg_arena_chunk *chunk, *next;
+
+	for (chunk = arena->first; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	free(arena);
+}
+
+static void *arena_alloc(struct wg_arena *arena, size_t size)
+{
+	struct wg_arena_chunk *chunk = arena->current, *new_chunk;
+	size_t new_size;
+	void *ret;
+
+	size = (size + WG_ARENA_ALIGN - 1) & ~(size_t)(WG_ARENA_ALIGN - 1);
+	while (chunk->size - chunk->used < size) {
+		/* Kept from before a reset, or a new one twice the size of the last */
+		if (chunk->next && chunk->next->size >= size) {
+			chunk = chunk->next;
+			continue;
+		}
+		new_size = chunk->size * 2 > WG_ARENA_MAX_CHUNK ? WG_ARENA_MAX_CHUNK : chunk->size * 2;
+		if (new_size < size)
+			new_size = size;
+		new_chunk = arena_chunk_new(new_size);
+		if (!new_chunk)
+			return NULL;
+		new_chunk->next = chunk->next;
+		chunk->next = new_chunk;
+		chunk = new_chunk;
+	}
+	arena->current = chunk;
+	ret = chunk->data + chunk->used;
+	chunk->used += size;
+	memset(ret, 0, size);
+	return ret;
+}
+
 /* wireguard-specific parts: */
 
+struct wg_handle {
+	struct mnlg_socket *nlg;
+	wg_device *scratch; /* Polled into by wg_handle_get_peer_table() */
+	wg_set_status set_status;
+};
+
 struct string_list {
 	char *buffer;
 	size_t len;
@@ -890,8 +687,17 @@ static int string_list_add(struct string_list *list, const char *str)
 	return 0;
 }
 
+/* The names of the WireGuard links and what the dump said about them */
+struct device_list {
+	struct string_list names;
+	wg_link *links;
+	size_t num_links;
+	size_t max_links;
+};
+
 struct interface {
 	const char *name;
+	uint32_t mtu;
 	bool is_wireguard;
 };
 
@@ -912,12 +718,40 @@ static int parse_infomsg(const struct nlattr *attr, void *data)
 		return mnl_attr_parse_nested(attr, parse_linkinfo, data);
 	else if (mnl_attr_get_type(attr) == IFLA_IFNAME)
 		interface->name = mnl_attr_get_str(attr);
+	else if (mnl_attr_get_type(attr) == IFLA_MTU)
+		interface->mtu = mnl_attr_get_u32(attr);
 	return MNL_CB_OK;
 }
 
+static int device_list_add(struct device_list *list, const struct ifinfomsg *ifm, const struct interface *interface)
+{
+	wg_link *link;
+	size_t max;
+	int ret;
+
+	ret = string_list_add(&list->names, interface->name);
+	if (ret < 0)
+		return ret;
+	if (list->num_links == list->max_links) {
+		max = list->max_links ? list->max_links * 2 : 8;
+		link = realloc(list->links, max * sizeof(*link));
+		if (!link)
+			return -errno;
+		list->links = link;
+		list->max_links = max;
+	}
+	link = &list->links[list->num_links++];
+	memset(link, 0, sizeof(*link));
+	strncpy(link->name, interface->name, sizeof(link->name) - 1);
+	link->ifindex = ifm->ifi_index;
+	link->flags = ifm->ifi_flags;
+	link->mtu = interface->mtu;
+	return 0;
+}
+
 static int read_devices_cb(const struct nlmsghdr *nlh, void *data)
 {
-	struct string_list *list = data;
+	struct device_list *list = data;
 	struct interface interface = { 0 };
 	int ret;
 
@@ -925,7 +759,7 @@ static int read_devices_cb(const struct nlmsghdr *nlh, void *data)
 	if (ret != MNL_CB_OK)
 		return ret;
 	if (interface.name && interface.is_wireguard)
-		ret = string_list_add(list, interface.name);
+		ret = device_list_add(list, mnl_nlmsg_get_payload(nlh), &interface);
 	if (ret < 0)
 		return ret;
 	if (nlh->nlmsg_type != NLMSG_DONE)
@@ -933,19 +767,24 @@ static int read_devices_cb(const struct nlmsghdr *nlh, void *data)
 	return MNL_CB_OK;
 }
 
-static int fetch_device_names(struct string_list *list)
+/* With strict checking the kernel only dumps the links of kind wireguard,
+ * otherwise every link comes back and is checked here.  The kind is checked
+ * either way, a kernel can take the filter and still ignore it. */
+static int fetch_device_names(struct device_list *list)
 {
 	struct mnl_socket *nl = NULL;
 	char *rtnl_buffer = NULL;
 	size_t message_len;
 	unsigned int portid, seq;
 	ssize_t len;
-	int ret = 0;
+	int ret = 0, one = 1;
+	bool filtered;
 	struct nlmsghdr *nlh;
 	struct ifinfomsg *ifm;
+	struct nlattr *linkinfo_nest;
 
 	ret = -ENOMEM;
-	rtnl_buffer = calloc(mnl_ideal_socket_buffer_size(), 1);
+	rtnl_buffer = calloc(WG_RECV_SLOT, 1);
 	if (!rtnl_buffer)
 		goto cleanup;
 
@@ -960,14 +799,22 @@ static int fetch_device_names(struct string_list *list)
 		goto cleanup;
 	}
 
+	filtered = setsockopt(nl->fd, SOL_NETLINK, NETLINK_GET_STRICT_CHK, &one, sizeof(one)) == 0;
 	seq = time(NULL);
 	portid = mnl_socket_get_portid(nl);
+
+again:
 	nlh = mnl_nlmsg_put_header(rtnl_buffer);
 	nlh->nlmsg_type = RTM_GETLINK;
 	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | NLM_F_DUMP;
-	nlh->nlmsg_seq = seq;
+	nlh->nlmsg_seq = ++seq;
 	ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifm));
 	ifm->ifi_family = AF_UNSPEC;
+	if (filtered) {
+		linkinfo_nest = mnl_attr_nest_start(nlh, IFLA_LINKINFO);
+		mnl_attr_put_strz(nlh, IFLA_INFO_KIND, WG_GENL_NAME);
+		mnl_attr_nest_end(nlh, linkinfo_nest);
+	}
 	message_len = nlh->nlmsg_len;
 
 	if (mnl_socket_sendto(nl, rtnl_buffer, message_len) < 0) {
@@ -976,7 +823,7 @@ static int fetch_device_names(struct string_list *list)
 	}
 
 another:
-	if ((len = mnl_socket_recvfrom(nl, rtnl_buffer, mnl_ideal_socket_buffer_size())) < 0) {
+	if ((len = mnl_socket_recvfrom(nl, rtnl_buffer, WG_RECV_SLOT)) < 0) {
 		ret = -errno;
 		goto cleanup;
 	}
@@ -987,6 +834,11 @@ another:
 		 * than retrying, potentially indefinitely, we just work with the
 		 * partial results. */
 		if (errno != EINTR) {
+			/* A kernel that checks strictly but can't filter on kind */
+			if (filtered && !list->num_links) {
+				filtered = false;
+				goto again;
+			}
 			ret = -errno;
 			goto cleanup;
 		}
@@ -1054,28 +906,87 @@ static int add_del_iface(const char *ifname, bool add)
 	}
 	ret = 0;
 
-cleanup:
-	free(rtnl_buffer);
-	if (nl)
-		mnl_socket_close(nl);
+cleanup:
+	free(rtnl_buffer);
+	if (nl)
+		mnl_socket_close(nl);
+	return ret;
+}
+
+wg_handle *wg_open(void)
+{
+	wg_handle *handle;
+	int err;
+
+	handle = calloc(1, sizeof(*handle));
+	if (!handle)
+		return NULL;
+	handle->nlg = mnlg_socket_open(WG_GENL_NAME, WG_GENL_VERSION);
+	if (!handle->nlg) {
+		err = errno;
+		free(handle);
+		errno = err;
+		return NULL;
+	}
+	return handle;
+}
+
+void wg_close(wg_handle *handle)
+{
+	if (!handle)
+		return;
+	mnlg_socket_close(handle->nlg);
+	wg_free_device(handle->scratch);
+	free(handle);
+}
+
+int wg_handle_set_recv(wg_handle *handle, const wg_recv_config *config)
+{
+	return mnlg_socket_set_recv(handle->nlg, config, handle->nlg->slot_len);
+}
+
+void wg_handle_set_status(wg_handle *handle, wg_set_status *status)
+{
+	*status = handle->set_status;
+}
+
+void wg_handle_get_recv(wg_handle *handle, wg_recv_config *config)
+{
+	*config = handle->nlg->recv;
+}
+
+void wg_handle_recv_stats(wg_handle *handle, wg_recv_stats *stats)
+{
+	*stats = handle->nlg->stats;
+}
+
+int wg_set_device(wg_device *dev)
+{
+	wg_handle *handle;
+	int ret;
+
+	handle = wg_open();
+	if (!handle)
+		return -errno;
+	ret = wg_handle_set_device(handle, dev);
+	wg_close(handle);
+	errno = -ret;
 	return ret;
 }
 
-int wg_set_device(wg_device *dev)
+/* Put as much of the device as fits in one message of at most WG_SET_CHUNK
+ * bytes at buf, from where *peer_cursor and *allowedip_cursor point.  They
+ * are left where the next message starts, *peer_cursor NULL after the last. */
+static struct nlmsghdr *encode_set_device(struct mnlg_socket *nlg, char *buf, wg_device *dev,
+					  wg_peer **peer_cursor, wg_allowedip **allowedip_cursor)
 {
-	int ret = 0;
-	wg_peer *peer = NULL;
-	wg_allowedip *allowedip = NULL;
+	const size_t max = WG_SET_CHUNK;
+	wg_peer *peer = *peer_cursor;
+	wg_allowedip *allowedip = *allowedip_cursor;
 	struct nlattr *peers_nest, *peer_nest, *allowedips_nest, *allowedip_nest;
 	struct nlmsghdr *nlh;
-	struct mnlg_socket *nlg;
-
-	nlg = mnlg_socket_open(WG_GENL_NAME, WG_GENL_VERSION);
-	if (!nlg)
-		return -errno;
 
-again:
-	nlh = mnlg_msg_prepare(nlg, WG_CMD_SET_DEVICE, NLM_F_REQUEST | NLM_F_ACK);
+	nlh = mnlg_msg_prepare_buf(nlg, buf, WG_CMD_SET_DEVICE, NLM_F_REQUEST, nlg->id, nlg->version);
 	mnl_attr_put_strz(nlh, WGDEVICE_A_IFNAME, dev->name);
 
 	if (!peer) {
@@ -1099,10 +1010,10 @@ again:
 	for (peer = peer ? peer : dev->first_peer; peer; peer = peer->next_peer) {
 		uint32_t flags = 0;
 
-		peer_nest = mnl_attr_nest_start_check(nlh, mnl_ideal_socket_buffer_size(), 0);
+		peer_nest = mnl_attr_nest_start_check(nlh, max, 0);
 		if (!peer_nest)
 			goto toobig_peers;
-		if (!mnl_attr_put_check(nlh, mnl_ideal_socket_buffer_size(), WGPEER_A_PUBLIC_KEY, sizeof(peer->public_key), peer->public_key))
+		if (!mnl_attr_put_check(nlh, max, WGPEER_A_PUBLIC_KEY, sizeof(peer->public_key), peer->public_key))
 			goto toobig_peers;
 		if (peer->flags & WGPEER_REMOVE_ME)
 			flags |= WGPEER_F_REMOVE_ME;
@@ -1110,45 +1021,45 @@ again:
 			if (peer->flags & WGPEER_REPLACE_ALLOWEDIPS)
 				flags |= WGPEER_F_REPLACE_ALLOWEDIPS;
 			if (peer->flags & WGPEER_HAS_PRESHARED_KEY) {
-				if (!mnl_attr_put_check(nlh, mnl_ideal_socket_buffer_size(), WGPEER_A_PRESHARED_KEY, sizeof(peer->preshared_key), peer->preshared_key))
+				if (!mnl_attr_put_check(nlh, max, WGPEER_A_PRESHARED_KEY, sizeof(peer->preshared_key), peer->preshared_key))
 					goto toobig_peers;
 			}
 			if (peer->endpoint.addr.sa_family == AF_INET) {
-				if (!mnl_attr_put_check(nlh, mnl_ideal_socket_buffer_size(), WGPEER_A_ENDPOINT, sizeof(peer->endpoint.addr4), &peer->endpoint.addr4))
+				if (!mnl_attr_put_check(nlh, max, WGPEER_A_ENDPOINT, sizeof(peer->endpoint.addr4), &peer->endpoint.addr4))
 					goto toobig_peers;
 			} else if (peer->endpoint.addr.sa_family == AF_INET6) {
-				if (!mnl_attr_put_check(nlh, mnl_ideal_socket_buffer_size(), WGPEER_A_ENDPOINT, sizeof(peer->endpoint.addr6), &peer->endpoint.addr6))
+				if (!mnl_attr_put_check(nlh, max, WGPEER_A_ENDPOINT, sizeof(peer->endpoint.addr6), &peer->endpoint.addr6))
 					goto toobig_peers;
 			}
 			if (peer->flags & WGPEER_HAS_PERSISTENT_KEEPALIVE_INTERVAL) {
-				if (!mnl_attr_put_u16_check(nlh, mnl_ideal_socket_buffer_size(), WGPEER_A_PERSISTENT_KEEPALIVE_INTERVAL, peer->persistent_keepalive_interval))
+				if (!mnl_attr_put_u16_check(nlh, max, WGPEER_A_PERSISTENT_KEEPALIVE_INTERVAL, peer->persistent_keepalive_interval))
 					goto toobig_peers;
 			}
 		}
 		if (flags) {
-			if (!mnl_attr_put_u32_check(nlh, mnl_ideal_socket_buffer_size(), WGPEER_A_FLAGS, flags))
+			if (!mnl_attr_put_u32_check(nlh, max, WGPEER_A_FLAGS, flags))
 				goto toobig_peers;
 		}
 		if (peer->first_allowedip) {
 			if (!allowedip)
 				allowedip = peer->first_allowedip;
-			allowedips_nest = mnl_attr_nest_start_check(nlh, mnl_ideal_socket_buffer_size(), WGPEER_A_ALLOWEDIPS);
+			allowedips_nest = mnl_attr_nest_start_check(nlh, max, WGPEER_A_ALLOWEDIPS);
 			if (!allowedips_nest)
 				goto toobig_allowedips;
 			for (; allowedip; allowedip = allowedip->next_allowedip) {
-				allowedip_nest = mnl_attr_nest_start_check(nlh, mnl_ideal_socket_buffer_size(), 0);
+				allowedip_nest = mnl_attr_nest_start_check(nlh, max, 0);
 				if (!allowedip_nest)
 					goto toobig_allowedips;
-				if (!mnl_attr_put_u16_check(nlh, mnl_ideal_socket_buffer_size(), WGALLOWEDIP_A_FAMILY, allowedip->family))
+				if (!mnl_attr_put_u16_check(nlh, max, WGALLOWEDIP_A_FAMILY, allowedip->family))
 					goto toobig_allowedips;
 				if (allowedip->family == AF_INET) {
-					if (!mnl_attr_put_check(nlh, mnl_ideal_socket_buffer_size(), WGALLOWEDIP_A_IPADDR, sizeof(allowedip->ip4), &allowedip->ip4))
+					if (!mnl_attr_put_check(nlh, max, WGALLOWEDIP_A_IPADDR, sizeof(allowedip->ip4), &allowedip->ip4))
 						goto toobig_allowedips;
 				} else if (allowedip->family == AF_INET6) {
-					if (!mnl_attr_put_check(nlh, mnl_ideal_socket_buffer_size(), WGALLOWEDIP_A_IPADDR, sizeof(allowedip->ip6), &allowedip->ip6))
+					if (!mnl_attr_put_check(nlh, max, WGALLOWEDIP_A_IPADDR, sizeof(allowedip->ip6), &allowedip->ip6))
 						goto toobig_allowedips;
 				}
-				if (!mnl_attr_put_u8_check(nlh, mnl_ideal_socket_buffer_size(), WGALLOWEDIP_A_CIDR_MASK, allowedip->cidr))
+				if (!mnl_attr_put_u8_check(nlh, max, WGALLOWEDIP_A_CIDR_MASK, allowedip->cidr))
 					goto toobig_allowedips;
 				mnl_attr_nest_end(nlh, allowedip_nest);
 				allowedip_nest = NULL;
@@ -1177,20 +1088,106 @@ toobig_peers:
 	mnl_attr_nest_end(nlh, peers_nest);
 	goto send;
 send:
-	if (mnlg_socket_send(nlg, nlh) < 0) {
-		ret = -errno;
-		goto out;
-	}
-	errno = 0;
-	if (mnlg_socket_recv_run(nlg, NULL, NULL) < 0) {
-		ret = errno ? -errno : -EINVAL;
-		goto out;
+	*peer_cursor = peer;
+	*allowedip_cursor = allowedip;
+	return nlh;
+}
+
+/* Wait for the kernel to acknowledge the message with last_seq, the last
+ * of a window.  Returns the first error reported for any of them, with the
+ * sequence number of the message it refused in *failed_seq. */
+static int mnlg_socket_recv_acks(struct mnlg_socket *nlg, unsigned int last_seq, unsigned int *failed_seq)
+{
+	const struct nlmsghdr *nlh;
+	const struct nlmsgerr *err;
+	int ret = 0, len;
+
+	for (;;) {
+		len = recv(nlg->nl->fd, nlg->rbuf, nlg->slot_len, 0);
+		if (len < 0)
+			return -errno;
+		for (nlh = (struct nlmsghdr *)nlg->rbuf; mnl_nlmsg_ok(nlh, len); nlh = mnl_nlmsg_next(nlh, &len)) {
+			if (nlh->nlmsg_type != NLMSG_ERROR)
+				continue;
+			err = mnl_nlmsg_get_payload(nlh);
+			if (err->error && !ret) {
+				ret = err->error < 0 ? err->error : -err->error;
+				*failed_seq = err->msg.nlmsg_seq;
+			}
+			if (nlh->nlmsg_seq == last_seq)
+				return ret;
+		}
 	}
-	if (peer)
-		goto again;
+}
 
-out:
-	mnlg_socket_close(nlg);
+/* Messages are written back to back, a window of them per send, and only
+ * the last of each window asks for an ACK.  The kernel handles a netlink
+ * send before it returns and answers only the messages it refuses, so a
+ * window costs one send and one receive however many chunks it holds.  A
+ * refusal is matched back by sequence number to where its chunk started. */
+int wg_handle_set_device(wg_handle *handle, wg_device *dev)
+{
+	struct mnlg_socket *nlg = handle->nlg;
+	wg_set_status *status = &handle->set_status;
+	wg_peer *peer = NULL, *start_peer[WG_SET_WINDOW];
+	wg_allowedip *allowedip = NULL, *start_allowedip[WG_SET_WINDOW];
+	struct nlmsghdr *nlh;
+	unsigned int first_seq, failed_seq = 0;
+	int ret = 0, sndbuf = WG_SET_SNDBUF, one = 1, count;
+	socklen_t optlen = sizeof(sndbuf);
+	size_t window, len;
+	char *buf;
+
+	/* A window has to go in one send, and refusals needn't echo it back */
+	if (setsockopt(nlg->nl->fd, SOL_SOCKET, SO_SNDBUFFORCE, &sndbuf, sizeof(sndbuf)) < 0)
+		setsockopt(nlg->nl->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	if (getsockopt(nlg->nl->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &optlen) < 0 || sndbuf < WG_SET_CHUNK + 32)
+		sndbuf = WG_SET_CHUNK + 32;
+	setsockopt(nlg->nl->fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+	window = sndbuf - 32;
+
+	memset(status, 0, sizeof(*status));
+	buf = malloc(window);
+	if (!buf)
+		return -ENOMEM;
+	do {
+		len = 0;
+		count = 0;
+		first_seq = nlg->seq + 1;
+		do {
+			/* Only the first chunk starts with no cursor */
+			start_peer[count] = peer ? peer : (status->chunks ? NULL : dev->first_peer);
+			start_allowedip[count] = allowedip;
+			nlh = encode_set_device(nlg, buf + len, dev, &peer, &allowedip);
+			len += NLMSG_ALIGN(nlh->nlmsg_len);
+			++status->chunks;
+		} while (peer && ++count < WG_SET_WINDOW && window - len >= WG_SET_CHUNK);
+		nlh->nlmsg_flags |= NLM_F_ACK;
+
+		if (mnl_socket_sendto(nlg->nl, buf, len) < 0) {
+			ret = -errno;
+			break;
+		}
+		ret = mnlg_socket_recv_acks(nlg, nlh->nlmsg_seq, &failed_seq);
+		if (ret && failed_seq - first_seq < WG_SET_WINDOW) {
+			wg_allowedip *ip;
+
+			/* Copied, dev may be gone by the time the caller looks */
+			count = failed_seq - first_seq;
+			status->failed_chunk = status->chunks - (nlh->nlmsg_seq - first_seq + 1) + count;
+			if (start_peer[count]) {
+				status->failed_has_peer = true;
+				memcpy(status->failed_peer, start_peer[count]->public_key, sizeof(status->failed_peer));
+				for (ip = start_peer[count]->first_allowedip; ip && start_allowedip[count] && ip != start_allowedip[count]; ip = ip->next_allowedip)
+					++status->failed_allowedip;
+			}
+		}
+	} while (!ret && peer);
+	free(buf);
+	status->error = ret;
+
+	if (ret)
+		mnlg_socket_drain(nlg);
 	errno = -ret;
 	return ret;
 }
@@ -1221,10 +1218,17 @@ static int parse_allowedip(const struct nlattr *attr, void *data)
 	return MNL_CB_OK;
 }
 
+/* A peer being parsed, and the arena of its device */
+struct peer_ctx {
+	wg_peer *peer;
+	struct wg_arena *arena;
+};
+
 static int parse_allowedips(const struct nlattr *attr, void *data)
 {
-	wg_peer *peer = data;
-	wg_allowedip *new_allowedip = calloc(1, sizeof(wg_allowedip));
+	struct peer_ctx *ctx = data;
+	wg_peer *peer = ctx->peer;
+	wg_allowedip *new_allowedip = ctx->arena ? arena_alloc(ctx->arena, sizeof(wg_allowedip)) : calloc(1, sizeof(wg_allowedip));
 	int ret;
 
 	if (!new_allowedip)
@@ -1259,7 +1263,8 @@ bool wg_key_is_zero(const wg_key key)
 
 static int parse_peer(const struct nlattr *attr, void *data)
 {
-	wg_peer *peer = data;
+	struct peer_ctx *ctx = data;
+	wg_peer *peer = ctx->peer;
 
 	switch (mnl_attr_get_type(attr)) {
 	case WGPEER_A_UNSPEC:
@@ -1306,7 +1311,7 @@ static int parse_peer(const struct nlattr *attr, void *data)
 			peer->tx_bytes = mnl_attr_get_u64(attr);
 		break;
 	case WGPEER_A_ALLOWEDIPS:
-		return mnl_attr_parse_nested(attr, parse_allowedips, peer);
+		return mnl_attr_parse_nested(attr, parse_allowedips, ctx);
 	}
 
 	return MNL_CB_OK;
@@ -1315,7 +1320,8 @@ static int parse_peer(const struct nlattr *attr, void *data)
 static int parse_peers(const struct nlattr *attr, void *data)
 {
 	wg_device *device = data;
-	wg_peer *new_peer = calloc(1, sizeof(wg_peer));
+	wg_peer *new_peer = device->arena ? arena_alloc(device->arena, sizeof(wg_peer)) : calloc(1, sizeof(wg_peer));
+	struct peer_ctx ctx = { new_peer, device->arena };
 	int ret;
 
 	if (!new_peer)
@@ -1326,7 +1332,7 @@ static int parse_peers(const struct nlattr *attr, void *data)
 		device->last_peer->next_peer = new_peer;
 		device->last_peer = new_peer;
 	}
-	ret = mnl_attr_parse_nested(attr, parse_peer, new_peer);
+	ret = mnl_attr_parse_nested(attr, parse_peer, &ctx);
 	if (!ret)
 		return ret;
 	if (!(new_peer->flags & WGPEER_HAS_PUBLIC_KEY)) {
@@ -1385,45 +1391,438 @@ static int read_device_cb(const struct nlmsghdr *nlh, void *data)
 	return mnl_attr_parse(nlh, sizeof(struct genlmsghdr), parse_device, data);
 }
 
-static void coalesce_peers(wg_device *device)
+/* peer index: */
+
+/* Open addressing over the peers' public keys, at most half full.  It lives
+ * in the device's arena, or is malloc()ed for a device built by hand. */
+struct wg_peer_index {
+	size_t mask;
+	wg_peer *slots[];
+};
+
+static size_t key_hash(const wg_key key)
 {
-	wg_peer *old_next_peer, *peer = device->first_peer;
+	uint64_t hash = 0, word;
+	int i;
 
-	while (peer && peer->next_peer) {
-		if (memcmp(peer->public_key, peer->next_peer->public_key, sizeof(wg_key))) {
-			peer = peer->next_peer;
+	for (i = 0; i < 4; ++i) {
+		memcpy(&word, key + i * 8, sizeof(word));
+		hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+		hash ^= hash >> 32;
+	}
+	return hash;
+}
+
+static wg_peer **peer_index_slot(struct wg_peer_index *index, const wg_key key)
+{
+	size_t i = key_hash(key) & index->mask;
+
+	while (index->slots[i] && memcmp(index->slots[i]->public_key, key, sizeof(wg_key)))
+		i = (i + 1) & index->mask;
+	return &index->slots[i];
+}
+
+/* Index the peers, merging every peer that repeats an earlier one's key into
+ * it.  The kernel splits a peer with many allowed IPs over several messages,
+ * and nothing guarantees the parts arrive next to each other. */
+static int coalesce_peers(wg_device *device)
+{
+	struct wg_peer_index *index;
+	wg_peer *peer, *prev = NULL, *next, **slot;
+	size_t num_peers = 0, size = 16, bytes;
+
+	wg_for_each_peer(device, peer)
+		++num_peers;
+	while (size < num_peers * 2)
+		size <<= 1;
+	bytes = sizeof(*index) + size * sizeof(index->slots[0]);
+	index = device->arena ? arena_alloc(device->arena, bytes) : calloc(1, bytes);
+	if (!index)
+		return -ENOMEM;
+	index->mask = size - 1;
+	if (!device->arena)
+		free(device->peer_index);
+	device->peer_index = index;
+
+	for (peer = device->first_peer; peer; peer = next) {
+		next = peer->next_peer;
+		slot = peer_index_slot(index, peer->public_key);
+		if (!*slot) {
+			*slot = peer;
+			prev = peer;
 			continue;
 		}
-		if (!peer->first_allowedip) {
-			peer->first_allowedip = peer->next_peer->first_allowedip;
-			peer->last_allowedip = peer->next_peer->last_allowedip;
-		} else {
-			peer->last_allowedip->next_allowedip = peer->next_peer->first_allowedip;
-			peer->last_allowedip = peer->next_peer->last_allowedip;
+		if (!(*slot)->first_allowedip)
+			(*slot)->first_allowedip = peer->first_allowedip;
+		else
+			(*slot)->last_allowedip->next_allowedip = peer->first_allowedip;
+		if (peer->first_allowedip)
+			(*slot)->last_allowedip = peer->last_allowedip;
+		prev->next_peer = next;
+		if (!next)
+			device->last_peer = prev;
+		if (!device->arena)
+			free(peer);
+	}
+	return 0;
+}
+
+int wg_device_index_peers(wg_device *dev)
+{
+	return coalesce_peers(dev);
+}
+
+wg_peer *wg_device_find_peer(const wg_device *dev, const wg_key public_key)
+{
+	wg_peer *peer;
+
+	if (dev->peer_index)
+		return *peer_index_slot(dev->peer_index, public_key);
+	wg_for_each_peer(dev, peer) {
+		if (!memcmp(peer->public_key, public_key, sizeof(wg_key)))
+			return peer;
+	}
+	return NULL;
+}
+
+/* incremental sync: */
+
+/* An allowed IP with the host bits cleared, comparable with memcmp() */
+struct flat_allowedip {
+	uint16_t family;
+	uint8_t cidr;
+	uint8_t addr[16];
+};
+
+static int flat_allowedip_cmp(const void *a, const void *b)
+{
+	return memcmp(a, b, sizeof(struct flat_allowedip));
+}
+
+/* A peer's allowed IPs sorted, without duplicates.  NULL only on ENOMEM. */
+static struct flat_allowedip *flatten_allowedips(const wg_peer *peer, size_t *num)
+{
+	struct flat_allowedip *flat, *out;
+	const wg_allowedip *allowedip;
+	size_t count = 0, i;
+	int bits, j;
+
+	wg_for_each_allowedip(peer, allowedip)
+		++count;
+	flat = calloc(count ?: 1, sizeof(*flat));
+	if (!flat)
+		return NULL;
+	out = flat;
+	wg_for_each_allowedip(peer, allowedip) {
+		out->family = allowedip->family;
+		out->cidr = allowedip->cidr;
+		if (allowedip->family == AF_INET6)
+			memcpy(out->addr, &allowedip->ip6, sizeof(allowedip->ip6));
+		else
+			memcpy(out->addr, &allowedip->ip4, sizeof(allowedip->ip4));
+		for (j = 0, bits = allowedip->cidr; j < 16; ++j, bits -= 8) {
+			if (bits <= 0)
+				out->addr[j] = 0;
+			else if (bits < 8)
+				out->addr[j] &= 0xff << (8 - bits);
+		}
+		++out;
+	}
+	qsort(flat, count, sizeof(*flat), flat_allowedip_cmp);
+	for (i = 0, *num = 0; i < count; ++i) {
+		if (!*num || flat_allowedip_cmp(&flat[*num - 1], &flat[i]))
+			flat[(*num)++] = flat[i];
+	}
+	return flat;
+}
+
+static int add_flat_allowedip(wg_peer *peer, const struct flat_allowedip *flat)
+{
+	wg_allowedip *allowedip = calloc(1, sizeof(*allowedip));
+
+	if (!allowedip)
+		return -ENOMEM;
+	allowedip->family = flat->family;
+	allowedip->cidr = flat->cidr;
+	if (flat->family == AF_INET6)
+		memcpy(&allowedip->ip6, flat->addr, sizeof(allowedip->ip6));
+	else
+		memcpy(&allowedip->ip4, flat->addr, sizeof(allowedip->ip4));
+	if (!peer->first_allowedip)
+		peer->first_allowedip = allowedip;
+	else
+		peer->last_allowedip->next_allowedip = allowedip;
+	peer->last_allowedip = allowedip;
+	return 0;
+}
+
+static void free_allowedips(wg_peer *peer)
+{
+	wg_allowedip *allowedip, *next;
+
+	for (allowedip = peer->first_allowedip; allowedip; allowedip = next) {
+		next = allowedip->next_allowedip;
+		free(allowedip);
+	}
+	peer->first_allowedip = peer->last_allowedip = NULL;
+}
+
+/* Put the allowed IPs that want has and have is missing in change.  The
+ * kernel can only add allowed IPs to a peer, so if have holds any that want
+ * doesn't, change replaces the whole list instead. */
+static int diff_allowedips(wg_peer *change, const wg_peer *want, const wg_peer *have)
+{
+	struct flat_allowedip *want_ips, *have_ips = NULL;
+	size_t num_want, num_have, i = 0, j = 0;
+	int cmp, ret = -ENOMEM;
+	bool removed = false;
+	const wg_allowedip *x, *y;
+
+	/* Usually nothing changed and both lists are in the same order */
+	for (x = want->first_allowedip, y = have->first_allowedip; x && y; x = x->next_allowedip, y = y->next_allowedip) {
+		if (x->family != y->family || x->cidr != y->cidr ||
+		    memcmp(&x->ip6, &y->ip6, x->family == AF_INET6 ? sizeof(x->ip6) : sizeof(x->ip4)))
+			break;
+	}
+	if (!x && !y)
+		return 0;
+
+	want_ips = flatten_allowedips(want, &num_want);
+	if (!want_ips)
+		goto out;
+	have_ips = flatten_allowedips(have, &num_have);
+	if (!have_ips)
+		goto out;
+
+	ret = 0;
+	while (i < num_want || j < num_have) {
+		cmp = i == num_want ? 1 : j == num_have ? -1 : flat_allowedip_cmp(&want_ips[i], &have_ips[j]);
+		if (cmp > 0) {
+			removed = true;
+			break;
+		}
+		if (cmp < 0)
+			ret = add_flat_allowedip(change, &want_ips[i]);
+		else
+			++j;
+		++i;
+		if (ret)
+			goto out;
+	}
+	if (removed) {
+		free_allowedips(change);
+		change->flags |= WGPEER_REPLACE_ALLOWEDIPS;
+		for (i = 0; i < num_want && !ret; ++i)
+			ret = add_flat_allowedip(change, &want_ips[i]);
+	}
+out:
+	free(want_ips);
+	free(have_ips);
+	return ret;
+}
+
+static bool endpoint_equal(const wg_peer *a, const wg_peer *b)
+{
+	if (a->endpoint.addr.sa_family != b->endpoint.addr.sa_family)
+		return false;
+	if (a->endpoint.addr.sa_family == AF_INET)
+		return a->endpoint.addr4.sin_port == b->endpoint.addr4.sin_port &&
+		       a->endpoint.addr4.sin_addr.s_addr == b->endpoint.addr4.sin_addr.s_addr;
+	if (a->endpoint.addr.sa_family == AF_INET6)
+		return a->endpoint.addr6.sin6_port == b->endpoint.addr6.sin6_port &&
+		       a->endpoint.addr6.sin6_scope_id == b->endpoint.addr6.sin6_scope_id &&
+		       !memcmp(&a->endpoint.addr6.sin6_addr, &b->endpoint.addr6.sin6_addr, sizeof(struct in6_addr));
+	return true;
+}
+
+/* Append a copy of change, which hands it its allowed IPs */
+static int add_change(wg_device *changes, wg_peer *change)
+{
+	wg_peer *peer = malloc(sizeof(*peer));
+
+	if (!peer) {
+		free_allowedips(change);
+		return -ENOMEM;
+	}
+	*peer = *change;
+	peer->next_peer = NULL;
+	if (!changes->first_peer)
+		changes->first_peer = peer;
+	else
+		changes->last_peer->next_peer = peer;
+	changes->last_peer = peer;
+	return 0;
+}
+
+wg_device *wg_device_diff(wg_device *want, const wg_device *have)
+{
+	static const wg_key zero_key = { 0 };
+	static const wg_peer no_peer = { 0 };
+	wg_device *changes;
+	wg_peer *peer, *old, change;
+	const uint8_t *preshared_key;
+	uint16_t keepalive;
+	bool changed;
+	int ret = -ENOMEM;
+
+	changes = calloc(1, sizeof(*changes));
+	if (!changes)
+		goto err;
+	memcpy(changes->name, have->name, sizeof(changes->name));
+	changes->ifindex = have->ifindex;
+
+	if ((want->flags & WGDEVICE_HAS_PRIVATE_KEY) && memcmp(want->private_key, have->private_key, sizeof(wg_key))) {
+		memcpy(changes->private_key, want->private_key, sizeof(wg_key));
+		changes->flags |= WGDEVICE_HAS_PRIVATE_KEY;
+	}
+	if ((want->flags & WGDEVICE_HAS_LISTEN_PORT) && want->listen_port != have->listen_port) {
+		changes->listen_port = want->listen_port;
+		changes->flags |= WGDEVICE_HAS_LISTEN_PORT;
+	}
+	if ((want->flags & WGDEVICE_HAS_FWMARK) && want->fwmark != have->fwmark) {
+		changes->fwmark = want->fwmark;
+		changes->flags |= WGDEVICE_HAS_FWMARK;
+	}
+
+	ret = wg_device_index_peers(want);
+	if (ret)
+		goto err;
+
+	wg_for_each_peer(want, peer) {
+		memset(&change, 0, sizeof(change));
+		memcpy(change.public_key, peer->public_key, sizeof(wg_key));
+		change.flags = WGPEER_HAS_PUBLIC_KEY;
+
+		old = wg_device_find_peer(have, peer->public_key);
+		if (!old) {
+			change.flags |= peer->flags & (WGPEER_HAS_PRESHARED_KEY | WGPEER_HAS_PERSISTENT_KEEPALIVE_INTERVAL);
+			memcpy(change.preshared_key, peer->preshared_key, sizeof(wg_key));
+			change.persistent_keepalive_interval = peer->persistent_keepalive_interval;
+			change.endpoint = peer->endpoint;
+			ret = diff_allowedips(&change, peer, &no_peer);
+			if (!ret)
+				ret = add_change(changes, &change);
+			else
+				free_allowedips(&change);
+			if (ret)
+				goto err;
+			continue;
+		}
+
+		changed = false;
+		preshared_key = (peer->flags & WGPEER_HAS_PRESHARED_KEY) ? peer->preshared_key : zero_key;
+		if (memcmp(preshared_key, old->preshared_key, sizeof(wg_key))) {
+			memcpy(change.preshared_key, preshared_key, sizeof(wg_key));
+			change.flags |= WGPEER_HAS_PRESHARED_KEY;
+			changed = true;
+		}
+		keepalive = (peer->flags & WGPEER_HAS_PERSISTENT_KEEPALIVE_INTERVAL) ? peer->persistent_keepalive_interval : 0;
+		if (keepalive != old->persistent_keepalive_interval) {
+			change.persistent_keepalive_interval = keepalive;
+			change.flags |= WGPEER_HAS_PERSISTENT_KEEPALIVE_INTERVAL;
+			changed = true;
 		}
-		old_next_peer = peer->next_peer;
-		peer->next_peer = old_next_peer->next_peer;
-		free(old_next_peer);
+		/* No endpoint wanted leaves the one the peer roamed to */
+		if (peer->endpoint.addr.sa_family && !endpoint_equal(peer, old)) {
+			change.endpoint = peer->endpoint;
+			changed = true;
+		}
+		ret = diff_allowedips(&change, peer, old);
+		if (!ret && (changed || change.first_allowedip || (change.flags & WGPEER_REPLACE_ALLOWEDIPS)))
+			ret = add_change(changes, &change);
+		else
+			free_allowedips(&change);
+		if (ret)
+			goto err;
 	}
+
+	wg_for_each_peer(have, old) {
+		if (wg_device_find_peer(want, old->public_key))
+			continue;
+		memset(&change, 0, sizeof(change));
+		memcpy(change.public_key, old->public_key, sizeof(wg_key));
+		change.flags = WGPEER_HAS_PUBLIC_KEY | WGPEER_REMOVE_ME;
+		ret = add_change(changes, &change);
+		if (ret)
+			goto err;
+	}
+	return changes;
+
+err:
+	wg_free_device(changes);
+	errno = -ret;
+	return NULL;
+}
+
+int wg_handle_sync_device(wg_handle *handle, wg_device *want)
+{
+	wg_device *changes;
+	wg_peer *peer;
+	int ret, num_changed = 0;
+
+	memset(&handle->set_status, 0, sizeof(handle->set_status));
+	ret = wg_handle_poll_device(handle, &handle->scratch, want->name);
+	if (ret)
+		return ret;
+	changes = wg_device_diff(want, handle->scratch);
+	if (!changes)
+		return -errno;
+	wg_for_each_peer(changes, peer)
+		++num_changed;
+	if (num_changed || changes->flags)
+		ret = wg_handle_set_device(handle, changes);
+	wg_free_device(changes);
+	return ret ? ret : num_changed;
 }
 
 int wg_get_device(wg_device **device, const char *device_name)
+{
+	wg_handle *handle;
+	int ret;
+
+	*device = NULL;
+	handle = wg_open();
+	if (!handle)
+		return -errno;
+	ret = wg_handle_get_device(handle, device, device_name);
+	wg_close(handle);
+	errno = -ret;
+	return ret;
+}
+
+int wg_handle_get_device(wg_handle *handle, wg_device **device, const char *device_name)
+{
+	*device = NULL;
+	return wg_handle_poll_device(handle, device, device_name);
+}
+
+int wg_handle_poll_device(wg_handle *handle, wg_device **device, const char *device_name)
 {
 	int ret = 0;
 	struct nlmsghdr *nlh;
-	struct mnlg_socket *nlg;
+	struct mnlg_socket *nlg = handle->nlg;
+	struct wg_arena *arena = *device ? (*device)->arena : NULL;
 
-try_again:
-	*device = calloc(1, sizeof(wg_device));
-	if (!*device)
-		return -errno;
+	memset(&nlg->stats, 0, sizeof(nlg->stats));
 
-	nlg = mnlg_socket_open(WG_GENL_NAME, WG_GENL_VERSION);
-	if (!nlg) {
+	/* Only a device read from the kernel has an arena to reuse */
+	if (*device && !arena)
 		wg_free_device(*device);
-		*device = NULL;
-		return -errno;
+	*device = NULL;
+	if (!arena) {
+		arena = arena_new();
+		if (!arena)
+			return -ENOMEM;
+	}
+
+try_again:
+	arena_reset(arena);
+	*device = arena_alloc(arena, sizeof(wg_device));
+	if (!*device) {
+		ret = -ENOMEM;
+		goto out;
 	}
+	(*device)->arena = arena;
 
 	nlh = mnlg_msg_prepare(nlg, WG_CMD_GET_DEVICE, NLM_F_REQUEST | NLM_F_ACK | NLM_F_DUMP);
 	mnl_attr_put_strz(nlh, WGDEVICE_A_IFNAME, device_name);
@@ -1432,37 +1831,199 @@ try_again:
 		goto out;
 	}
 	errno = 0;
-	if (mnlg_socket_recv_run(nlg, read_device_cb, *device) < 0) {
+	if (mnlg_socket_recv_dump(nlg, read_device_cb, *device) < 0) {
 		ret = errno ? -errno : -EINVAL;
 		goto out;
 	}
-	coalesce_peers(*device);
+	ret = coalesce_peers(*device);
 
 out:
-	if (nlg)
-		mnlg_socket_close(nlg);
 	if (ret) {
-		wg_free_device(*device);
+		mnlg_socket_drain(nlg);
 		if (ret == -EINTR)
 			goto try_again;
+		arena_destroy(arena);
 		*device = NULL;
 	}
 	errno = -ret;
 	return ret;
 }
 
+/* peer streaming: */
+
+/* Each message is parsed into its own arena and its peers handed over, all
+ * but the last.  That one may go on in the next message, so it is copied
+ * into one of two small arenas and held until a peer with another key or
+ * the end of the dump shows up.  Memory stays at one message and a peer
+ * however many peers the device has. */
+struct peer_stream {
+	wg_device device;
+	struct wg_arena *message;
+	struct wg_arena *held_arena, *spare_arena;
+	wg_peer *held;
+	wg_peer_fn fn;
+	void *data;
+	bool started;
+	int stopped;
+};
+
+static wg_peer *copy_peer(struct wg_arena *arena, const wg_peer *peer)
+{
+	wg_peer *copy = arena_alloc(arena, sizeof(*copy));
+	wg_allowedip *allowedip, *new_allowedip;
+
+	if (!copy)
+		return NULL;
+	*copy = *peer;
+	copy->first_allowedip = copy->last_allowedip = NULL;
+	copy->next_peer = NULL;
+	wg_for_each_allowedip(peer, allowedip) {
+		new_allowedip = arena_alloc(arena, sizeof(*new_allowedip));
+		if (!new_allowedip)
+			return NULL;
+		*new_allowedip = *allowedip;
+		new_allowedip->next_allowedip = NULL;
+		if (!copy->first_allowedip)
+			copy->first_allowedip = new_allowedip;
+		else
+			copy->last_allowedip->next_allowedip = new_allowedip;
+		copy->last_allowedip = new_allowedip;
+	}
+	return copy;
+}
+
+static int stream_peer(struct peer_stream *stream, wg_peer *peer)
+{
+	peer->next_peer = NULL;
+	stream->stopped = stream->fn(&stream->device, peer, stream->data);
+	return stream->stopped ? MNL_CB_STOP : MNL_CB_OK;
+}
+
+static int read_device_stream_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct peer_stream *stream = data;
+	wg_device *device = &stream->device;
+	struct wg_arena *swap;
+	wg_peer *peer, *next;
+	int ret;
+
+	arena_reset(stream->message);
+	device->first_peer = device->last_peer = NULL;
+	ret = mnl_attr_parse(nlh, sizeof(struct genlmsghdr), parse_device, device);
+	if (ret != MNL_CB_OK)
+		return ret;
+	if (!stream->started) {
+		stream->started = true;
+		stream->stopped = stream->fn(device, NULL, stream->data);
+		if (stream->stopped)
+			return MNL_CB_STOP;
+	}
+
+	for (peer = device->first_peer; peer; peer = next) {
+		next = peer->next_peer;
+		if (stream->held && !memcmp(stream->held->public_key, peer->public_key, sizeof(wg_key))) {
+			/* The rest of the held peer, in this message's arena */
+			if (!stream->held->first_allowedip)
+				stream->held->first_allowedip = peer->first_allowedip;
+			else if (peer->first_allowedip)
+				stream->held->last_allowedip->next_allowedip = peer->first_allowedip;
+			if (peer->first_allowedip)
+				stream->held->last_allowedip = peer->last_allowedip;
+		} else {
+			if (stream->held && stream_peer(stream, stream->held) != MNL_CB_OK)
+				return MNL_CB_STOP;
+			stream->held = peer;
+		}
+	}
+
+	/* Whatever is held may point into this message, copy it out first */
+	if (stream->held) {
+		arena_reset(stream->spare_arena);
+		stream->held = copy_peer(stream->spare_arena, stream->held);
+		if (!stream->held) {
+			errno = ENOMEM;
+			return MNL_CB_ERROR;
+		}
+		swap = stream->held_arena;
+		stream->held_arena = stream->spare_arena;
+		stream->spare_arena = swap;
+	}
+	return MNL_CB_OK;
+}
+
+int wg_handle_for_each_peer(wg_handle *handle, const char *device_name, wg_peer_fn fn, void *data)
+{
+	struct peer_stream stream = { .fn = fn, .data = data };
+	struct mnlg_socket *nlg = handle->nlg;
+	struct nlmsghdr *nlh;
+	int ret = -ENOMEM;
+
+	memset(&nlg->stats, 0, sizeof(nlg->stats));
+	stream.message = arena_new();
+	stream.held_arena = arena_new();
+	stream.spare_arena = arena_new();
+	if (!stream.message || !stream.held_arena || !stream.spare_arena)
+		goto out;
+	stream.device.arena = stream.message;
+
+	nlh = mnlg_msg_prepare(nlg, WG_CMD_GET_DEVICE, NLM_F_REQUEST | NLM_F_ACK | NLM_F_DUMP);
+	mnl_attr_put_strz(nlh, WGDEVICE_A_IFNAME, device_name);
+	if (mnlg_socket_send(nlg, nlh) < 0) {
+		ret = -errno;
+		goto out;
+	}
+	errno = 0;
+	if (mnlg_socket_recv_dump(nlg, read_device_stream_cb, &stream) < 0) {
+		ret = errno ? -errno : -EINVAL;
+		goto out;
+	}
+	ret = stream.stopped;
+	if (!ret && stream.held)
+		ret = fn(&stream.device, stream.held, data);
+
+out:
+	/* Stopping early leaves the rest of the dump queued */
+	if (ret)
+		mnlg_socket_drain(nlg);
+	if (stream.message)
+		arena_destroy(stream.message);
+	if (stream.held_arena)
+		arena_destroy(stream.held_arena);
+	if (stream.spare_arena)
+		arena_destroy(stream.spare_arena);
+	errno = ret < 0 ? -ret : 0;
+	return ret;
+}
+
 /* first\0second\0third\0forth\0last\0\0 */
 char *wg_list_device_names(void)
 {
-	struct string_list list = { 0 };
+	struct device_list list = { 0 };
+	int ret = fetch_device_names(&list);
+
+	free(list.links);
+	errno = -ret;
+	if (errno) {
+		free(list.names.buffer);
+		return NULL;
+	}
+	return list.names.buffer ?: strdup("\0");
+}
+
+wg_link *wg_list_devices(size_t *num)
+{
+	struct device_list list = { 0 };
 	int ret = fetch_device_names(&list);
 
+	free(list.names.buffer);
+	*num = 0;
 	errno = -ret;
 	if (errno) {
-		free(list.buffer);
+		free(list.links);
 		return NULL;
 	}
-	return list.buffer ?: strdup("\0");
+	*num = list.num_links;
+	return list.links ?: calloc(1, sizeof(wg_link));
 }
 
 int wg_add_device(const char *device_name)
@@ -1482,14 +2043,113 @@ void wg_free_device(wg_device *dev)
 
 	if (!dev)
 		return;
+	if (dev->arena) {
+		arena_destroy(dev->arena);
+		return;
+	}
 	for (peer = dev->first_peer, np = peer ? peer->next_peer : NULL; peer; peer = np, np = peer ? peer->next_peer : NULL) {
 		for (allowedip = peer->first_allowedip, na = allowedip ? allowedip->next_allowedip : NULL; allowedip; allowedip = na, na = allowedip ? allowedip->next_allowedip : NULL)
 			free(allowedip);
 		free(peer);
 	}
+	free(dev->peer_index);
 	free(dev);
 }
 
+wg_peer_table *wg_peer_table_from_device(const wg_device *dev)
+{
+	wg_peer_table *table;
+	wg_peer *peer;
+	wg_allowedip *allowedip;
+	wg_peer_stats *stats;
+	wg_peer_keys *keys;
+	wg_peer_allowedip *flat;
+	size_t num_peers = 0, num_allowedips = 0;
+
+	wg_for_each_peer(dev, peer) {
+		++num_peers;
+		wg_for_each_allowedip(peer, allowedip)
+			++num_allowedips;
+	}
+
+	/* One block, the header and then each array in turn */
+	table = calloc(1, sizeof(*table) + num_peers * (sizeof(*stats) + sizeof(*keys)) + num_allowedips * sizeof(*flat));
+	if (!table)
+		return NULL;
+	table->peers = (wg_peer_stats *)(table + 1);
+	table->keys = (wg_peer_keys *)(table->peers + num_peers);
+	table->allowedips = (wg_peer_allowedip *)(table->keys + num_peers);
+
+	memcpy(table->name, dev->name, sizeof(table->name));
+	table->ifindex = dev->ifindex;
+	table->flags = dev->flags;
+	memcpy(table->public_key, dev->public_key, sizeof(wg_key));
+	table->fwmark = dev->fwmark;
+	table->listen_port = dev->listen_port;
+
+	stats = table->peers;
+	keys = table->keys;
+	flat = table->allowedips;
+	wg_for_each_peer(dev, peer) {
+		stats->rx_bytes = peer->rx_bytes;
+		stats->tx_bytes = peer->tx_bytes;
+		stats->last_handshake_time = peer->last_handshake_time;
+		memcpy(&stats->endpoint, &peer->endpoint, sizeof(stats->endpoint));
+		stats->persistent_keepalive_interval = peer->persistent_keepalive_interval;
+		stats->first_allowedip = flat - table->allowedips;
+		wg_for_each_allowedip(peer, allowedip) {
+			flat->family = allowedip->family;
+			if (allowedip->family == AF_INET6)
+				flat->ip6 = allowedip->ip6;
+			else
+				flat->ip4 = allowedip->ip4;
+			flat->cidr = allowedip->cidr;
+			++flat;
+		}
+		stats->num_allowedips = (flat - table->allowedips) - stats->first_allowedip;
+
+		keys->flags = peer->flags;
+		memcpy(keys->public_key, peer->public_key, sizeof(wg_key));
+		memcpy(keys->preshared_key, peer->preshared_key, sizeof(wg_key));
+		++stats;
+		++keys;
+	}
+	table->num_peers = num_peers;
+	table->num_allowedips = num_allowedips;
+	return table;
+}
+
+int wg_handle_get_peer_table(wg_handle *handle, wg_peer_table **table, const char *device_name)
+{
+	int ret;
+
+	*table = NULL;
+	ret = wg_handle_poll_device(handle, &handle->scratch, device_name);
+	if (ret)
+		return ret;
+	*table = wg_peer_table_from_device(handle->scratch);
+	return *table ? 0 : -ENOMEM;
+}
+
+int wg_get_peer_table(wg_peer_table **table, const char *device_name)
+{
+	wg_handle *handle;
+	int ret;
+
+	handle = wg_open();
+	if (!handle)
+		return -errno;
+	ret = wg_handle_get_peer_table(handle, table, device_name);
+	wg_close(handle);
+	errno = -ret;
+	return ret;
+}
+
+void wg_free_peer_table(wg_peer_table *table)
+{
+	free(table);
+}
+
 static void encode_base64(char dest[static 4], const uint8_t src[static 3])
 {
 	const uint8_t input[] = { (src[0] >> 2) & 63, ((src[0] << 4) | (src[1] >> 4)) & 63, ((src[1] << 2) | (src[2] >> 6)) & 63, src[2] & 63 };
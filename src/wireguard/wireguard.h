@@ -81,18 +81,174 @@ typedef struct wg_device {
 	uint16_t listen_port;
 
 	struct wg_peer *first_peer, *last_peer;
+
+	/* Peers by public key, see wg_device_find_peer() */
+	struct wg_peer_index *peer_index;
+
+	/* Set when read from the kernel, everything above lives in it */
+	struct wg_arena *arena;
 } wg_device;
 
+/* A device's peers as flat arrays instead of lists, for going over many
+ * peers without chasing pointers.  Peer i's counters and endpoint, read by
+ * most walks, are peers[i] and its keys, read by few, are keys[i].  Its
+ * allowed IPs are the num_allowedips entries of allowedips starting at
+ * first_allowedip.  The whole table is one allocation. */
+typedef struct wg_peer_stats {
+	uint64_t rx_bytes, tx_bytes;
+	struct timespec64 last_handshake_time;
+
+	union {
+		struct sockaddr addr;
+		struct sockaddr_in addr4;
+		struct sockaddr_in6 addr6;
+	} endpoint;
+
+	uint32_t first_allowedip, num_allowedips;
+	uint16_t persistent_keepalive_interval;
+} wg_peer_stats;
+
+typedef struct wg_peer_keys {
+	enum wg_peer_flags flags;
+	wg_key public_key;
+	wg_key preshared_key;
+} wg_peer_keys;
+
+typedef struct wg_peer_allowedip {
+	uint16_t family;
+	union {
+		struct in_addr ip4;
+		struct in6_addr ip6;
+	};
+	uint8_t cidr;
+} wg_peer_allowedip;
+
+typedef struct wg_peer_table {
+	char name[IFNAMSIZ];
+	uint32_t ifindex;
+
+	enum wg_device_flags flags;
+
+	wg_key public_key;
+
+	uint32_t fwmark;
+	uint16_t listen_port;
+
+	size_t num_peers, num_allowedips;
+	wg_peer_stats *peers;
+	wg_peer_keys *keys;
+	wg_peer_allowedip *allowedips;
+} wg_peer_table;
+
 #define wg_for_each_device_name(__names, __name, __len) for ((__name) = (__names), (__len) = 0; ((__len) = strlen(__name)); (__name) += (__len) + 1)
 #define wg_for_each_peer(__dev, __peer) for ((__peer) = (__dev)->first_peer; (__peer); (__peer) = (__peer)->next_peer)
 #define wg_for_each_allowedip(__peer, __allowedip) for ((__allowedip) = (__peer)->first_allowedip; (__allowedip); (__allowedip) = (__allowedip)->next_allowedip)
 
+/* A generic netlink socket with the WireGuard family already resolved, for
+ * any number of get and set calls.  wg_get_device() and wg_set_device()
+ * open and close one per call. */
+typedef struct wg_handle wg_handle;
+
+wg_handle *wg_open(void);
+void wg_close(wg_handle *handle);
+
+/* How a handle reads the kernel's replies.  A big dump arrives as many
+ * datagrams, and each read syscall can take a batch of them. */
+typedef struct wg_recv_config {
+	int rcvbuf;		/* SO_RCVBUF to ask for, 0 keeps the current one */
+	unsigned int batch;	/* Datagrams per recvmmsg(), 1 to 64 */
+	bool peek;		/* Size the buffer to the first reply with MSG_PEEK|MSG_TRUNC */
+	bool pipeline;		/* Receive device dumps on a second thread while parsing */
+} wg_recv_config;
+
+/* Counted from the start of the last get or poll of a device */
+typedef struct wg_recv_stats {
+	unsigned long syscalls;
+	unsigned long datagrams;
+	unsigned long bytes;
+} wg_recv_stats;
+
+int wg_handle_set_recv(wg_handle *handle, const wg_recv_config *config);
+void wg_handle_get_recv(wg_handle *handle, wg_recv_config *config);
+void wg_handle_recv_stats(wg_handle *handle, wg_recv_stats *stats);
+int wg_handle_set_device(wg_handle *handle, wg_device *dev);
+
+/* Where the last wg_handle_set_device() on the handle stopped.  A device is
+ * sent in chunks, a window of them per send, and the kernel goes on applying
+ * the rest of a window after it refuses one.  A failed set leaves the device
+ * partly applied: the chunks of earlier windows and every chunk of the
+ * failed window but the refused one.  No further windows are sent, so the
+ * caller should read the device back and resync. */
+typedef struct wg_set_status {
+	int error;			/* First refusal, 0 if every chunk took */
+	unsigned int chunks;		/* Chunks sent */
+	unsigned int failed_chunk;	/* Index of the refused chunk, 0 also holds the device settings */
+	bool failed_has_peer;		/* The refused chunk held peers, the first being... */
+	wg_key failed_peer;		/* ...this one, by public key */
+	unsigned int failed_allowedip;	/* Its first allowed IP in the chunk, 0 unless split */
+} wg_set_status;
+
+void wg_handle_set_status(wg_handle *handle, wg_set_status *status);
+int wg_handle_get_device(wg_handle *handle, wg_device **dev, const char *device_name);
+
+/* As wg_handle_get_device(), but *dev may hold a device from an earlier get
+ * or poll.  Its memory is reused for the new one instead of freed, so polling
+ * the same device again allocates nothing once it stops growing.  On error
+ * *dev is freed and set to NULL. */
+int wg_handle_poll_device(wg_handle *handle, wg_device **dev, const char *device_name);
+
+/* Called by wg_handle_for_each_peer(), first with peer NULL once the
+ * device's own settings are read, then for each peer with its allowed IPs.
+ * Both are only valid during the call.  Non zero stops the walk. */
+typedef int (*wg_peer_fn)(const wg_device *device, const wg_peer *peer, void *data);
+
+/* Hand the peers of a device to fn as they are read, without ever holding
+ * the whole device in memory.  Returns what fn stopped with, 0 once every
+ * peer was seen, or a negative errno.  Unlike a get, a dump interrupted by
+ * a change to the device fails with -EINTR, some peers already seen. */
+int wg_handle_for_each_peer(wg_handle *handle, const char *device_name, wg_peer_fn fn, void *data);
+
+/* The peers of a device as a wg_peer_table, without its private key.  The
+ * handle keeps the device it reads into for the next call. */
+int wg_handle_get_peer_table(wg_handle *handle, wg_peer_table **table, const char *device_name);
+int wg_get_peer_table(wg_peer_table **table, const char *device_name);
+wg_peer_table *wg_peer_table_from_device(const wg_device *dev);
+void wg_free_peer_table(wg_peer_table *table);
+
+/* Find a peer by public key.  Devices read from the kernel come indexed,
+ * one built by hand is searched in order until wg_device_index_peers() is
+ * called on it, and again after adding peers to it.  Indexing also merges
+ * peers repeating a key into the first of them. */
+wg_peer *wg_device_find_peer(const wg_device *dev, const wg_key public_key);
+int wg_device_index_peers(wg_device *dev);
+
+/* The changes that take have to want, as a device for wg_set_device(): peers
+ * to add or remove, and only the settings and allowed IPs that differ for
+ * the rest.  Peers without an endpoint in want keep theirs.  want gets
+ * indexed, have should come from the kernel.  NULL with errno on error. */
+wg_device *wg_device_diff(wg_device *want, const wg_device *have);
+
+/* Read the device named in want and set only wg_device_diff() of the two.
+ * Returns the number of peers changed, or a negative errno. */
+int wg_handle_sync_device(wg_handle *handle, wg_device *want);
+
 int wg_set_device(wg_device *dev);
 int wg_get_device(wg_device **dev, const char *device_name);
 int wg_add_device(const char *device_name);
 int wg_del_device(const char *device_name);
 void wg_free_device(wg_device *dev);
 char *wg_list_device_names(void); /* first\0second\0third\0forth\0last\0\0 */
+
+/* A WireGuard link as the dump listing it found it */
+typedef struct wg_link {
+	char name[IFNAMSIZ];
+	uint32_t ifindex;
+	uint32_t flags; /* IFF_UP and the rest */
+	uint32_t mtu;
+} wg_link;
+
+/* The WireGuard links, an array of *num to free(), NULL with errno on error */
+wg_link *wg_list_devices(size_t *num);
 void wg_key_to_base64(wg_key_b64_string base64, const wg_key key);
 int wg_key_from_base64(wg_key key, const wg_key_b64_string base64);
 bool wg_key_is_zero(const wg_key key);